@@ -0,0 +1,197 @@
+//
+// accesslog.c: Asynchronous binary access log.
+//
+// Every worker owns a single-producer/single-consumer ring of fixed-size
+// records. A background flusher drains all rings into the log file with
+// writev. A full ring drops the record and counts it; workers never block.
+// Records lost to a failed write are counted too.
+//
+
+#include "segel.h"
+#include "accesslog.h"
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#define ACCESSLOG_RING 4096          // Records per ring, power of two
+#define ACCESSLOG_FLUSH_US 10000
+#define ACCESSLOG_IOV 1024           // Kernel limit (UIO_MAXIOV)
+
+typedef struct AccessRing {
+    atomic_ulong head;               // Written by the worker
+    char pad0[64 - sizeof(atomic_ulong)];
+    atomic_ulong tail;               // Written by the flusher
+    atomic_ulong dropped;
+    char pad1[64 - 2 * sizeof(atomic_ulong)];
+    AccessRecord records[ACCESSLOG_RING];
+} AccessRing;
+
+// One ring per stats slot, allocated by its owner on first use since the
+// pool may never grow into most of the slots
+static AccessRing** rings;
+static int nrings;
+static int logfd = -1;
+static atomic_ulong write_dropped;   // Lost by the flusher; the rings' counts are the workers'
+static off_t logend;                 // End of the last whole record written
+static int torn;                     // A partial record follows logend
+
+static void* accesslogFlusher(void* arg) {
+    struct iovec iov[ACCESSLOG_IOV];
+    unsigned long upto[nrings];
+    AccessRing* seen[nrings];
+
+    while (1) {
+        size_t bytes = 0;
+        int niov = 0;
+
+        for (int i = 0; i < nrings; i++) {
+            AccessRing* r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+            seen[i] = r;
+            if (r == NULL) {
+                continue;
+            }
+            unsigned long tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            unsigned long head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+            upto[i] = tail;
+            if (head == tail || niov + 2 > ACCESSLOG_IOV) {
+                continue;
+            }
+            unsigned long first = tail % ACCESSLOG_RING;
+            unsigned long count = head - tail;
+            unsigned long run = count < ACCESSLOG_RING - first ? count : ACCESSLOG_RING - first;
+
+            bytes += count * sizeof(AccessRecord);
+            iov[niov].iov_base = &r->records[first];
+            iov[niov++].iov_len = run * sizeof(AccessRecord);
+            if (run < count) {
+                iov[niov].iov_base = &r->records[0];
+                iov[niov++].iov_len = (count - run) * sizeof(AccessRecord);
+            }
+            upto[i] = head;
+        }
+
+        if (niov > 0) {
+            // A failed or short write (disk full) loses the rest of the batch.
+            // Nothing is appended after a partial record until it is cut off
+            // again, or every later record would be misaligned.
+            ssize_t n = -1;
+            if (!torn || ftruncate(logfd, logend) == 0) {
+                torn = 0;
+                n = writev(logfd, iov, niov);
+            }
+            if (n < 0) {
+                fprintf(stderr, "access log: %s\n", strerror(errno));
+                n = 0;
+            }
+            size_t written = (size_t)n / sizeof(AccessRecord);
+            logend += written * sizeof(AccessRecord);
+            if ((size_t)n % sizeof(AccessRecord) != 0 && ftruncate(logfd, logend) != 0) {
+                torn = 1;
+            }
+            if ((size_t)n < bytes) {
+                atomic_fetch_add_explicit(&write_dropped, bytes / sizeof(AccessRecord) - written, memory_order_relaxed);
+            }
+            for (int i = 0; i < nrings; i++) {
+                if (seen[i] != NULL) {
+                    atomic_store_explicit(&seen[i]->tail, upto[i], memory_order_release);
+                }
+            }
+        }
+        else {
+            usleep(ACCESSLOG_FLUSH_US);
+        }
+    }
+    return NULL;
+}
+
+void accesslogInit(const char* path, int n) {
+    AccessLogHeader header = { ACCESSLOG_MAGIC, ACCESSLOG_VERSION, sizeof(AccessRecord), 0, 0, 0 };
+    struct timespec now;
+    struct stat sbuf;
+    pthread_t tid;
+
+    logfd = open(path, O_WRONLY | O_CREAT | O_APPEND, DEF_MODE);
+    if (logfd < 0) {
+        unix_error("Access log open error");
+    }
+    if (fstat(logfd, &sbuf) == 0 && sbuf.st_size == 0) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        header.wall_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+        header.mono_ns = clockToNs(clockNow());
+        if (write(logfd, &header, sizeof(header)) != sizeof(header)) {
+            unix_error("Access log write error");
+        }
+    }
+    else {
+        // Appending to a log from an earlier run would mix timebases
+        fprintf(stderr, "access log: %s is not empty, timestamps are relative to its first run\n", path);
+    }
+    // An earlier run may have stopped mid-record; the first flush cuts it off
+    off_t size = lseek(logfd, 0, SEEK_END);
+    logend = size;
+    if (size > (off_t)sizeof(header)) {
+        logend -= (size - (off_t)sizeof(header)) % (off_t)sizeof(AccessRecord);
+    }
+    torn = logend != size;
+
+    nrings = n;
+    rings = calloc(n, sizeof(AccessRing*));
+    if (rings == NULL) {
+        exit(1);
+    }
+
+    if (pthread_create(&tid, NULL, accesslogFlusher, NULL) != 0) {
+        exit(1);
+    }
+    pthread_detach(tid);
+}
+
+//
+// Called by the worker that owns the ring, after the connection is closed
+//
+void accesslogAppend(int ring, int thread_id, int fd, int vip, RequestTrace* trace) {
+    if (rings == NULL || ring < 0 || ring >= nrings) {
+        return;
+    }
+    AccessRing* r = rings[ring];
+    if (r == NULL) {
+        r = aligned_alloc(64, sizeof(AccessRing));
+        if (r == NULL) {
+            return;
+        }
+        memset(r, 0, sizeof(AccessRing));
+        __atomic_store_n(&rings[ring], r, __ATOMIC_RELEASE);
+    }
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) >= ACCESSLOG_RING) {
+        atomic_store_explicit(&r->dropped, atomic_load_explicit(&r->dropped, memory_order_relaxed) + 1, memory_order_relaxed);
+        return;
+    }
+
+    AccessRecord* rec = &r->records[head % ACCESSLOG_RING];
+    rec->accept_ns = clockToNs(trace->stamp[STAGE_ACCEPT]);
+    rec->wait_ns = clockToNs(trace->stamp[STAGE_DEQUEUE] - trace->stamp[STAGE_ENQUEUE]);
+    rec->total_ns = clockToNs(trace->stamp[STAGE_CLOSE] - trace->stamp[STAGE_ACCEPT]);
+    rec->bytes = trace->bytes;
+    rec->uri_hash = trace->uri_hash;
+    rec->fd = fd;
+    rec->status = trace->status;
+    rec->thread_id = thread_id;
+    rec->vip = vip;
+    memset(rec->pad, 0, sizeof(rec->pad));
+    memcpy(rec->uri, trace->uri, ACCESSLOG_URI);
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+unsigned long accesslogDropped(void) {
+    unsigned long total = atomic_load_explicit(&write_dropped, memory_order_relaxed);
+    for (int i = 0; i < nrings; i++) {
+        AccessRing* r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if (r != NULL) {
+            total += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        }
+    }
+    return total;
+}
@@ -0,0 +1,39 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdint.h>
+#include "trace.h"
+
+#define ACCESSLOG_MAGIC 0x4c413357u   // "W3AL"
+#define ACCESSLOG_VERSION 1
+#define ACCESSLOG_URI TRACE_URI
+
+// On-disk file header, followed by AccessRecords
+typedef struct AccessLogHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t wall_ns;       // CLOCK_REALTIME when the log was opened
+    uint64_t mono_ns;       // clockNow() at the same moment, in ns
+} AccessLogHeader;
+
+typedef struct AccessRecord {
+    uint64_t accept_ns;     // Monotonic, same base as AccessLogHeader.mono_ns
+    uint64_t wait_ns;       // Enqueue -> dequeue
+    uint64_t total_ns;      // Accept -> close
+    uint64_t bytes;
+    uint32_t uri_hash;      // FNV-1a of the whole URI
+    int32_t fd;
+    int16_t status;
+    int16_t thread_id;
+    uint8_t vip;
+    uint8_t pad[3];
+    char uri[ACCESSLOG_URI]; // URI prefix, NUL padded
+} AccessRecord;
+
+void accesslogInit(const char* path, int nrings);
+void accesslogAppend(int ring, int thread_id, int fd, int vip, RequestTrace* trace);
+unsigned long accesslogDropped(void);
+
+#endif
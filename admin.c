@@ -0,0 +1,163 @@
+//
+// admin.c: Local control socket for reconfiguring a running server.
+//
+// A single thread serves one admin connection at a time; commands are rare
+// and each takes effect before its reply is sent.
+//
+
+#include "segel.h"
+#include "admin.h"
+
+// An idle admin connection is dropped after this long, freeing the thread
+#define ADMIN_IDLE_SEC 30
+
+// Pause after a failed accept, so running out of descriptors does not spin
+#define ADMIN_ACCEPT_BACKOFF_US 100000
+
+static Pool* pools[POOL_MAX];
+static int npools;
+static int adminfd = -1;
+
+static void adminShow(char* reply, size_t cap) {
+    size_t len = snprintf(reply, cap, "ok");
+
+    for (int i = 0; i < npools && len < cap; i++) {
+        Pool* p = pools[i];
+        Queue* q = p->queue;
+        if (p->vip) {
+            len += snprintf(reply + len, cap - len, " | %s threads %d", p->name, atomic_load(&p->threads));
+            continue;
+        }
+        pthread_mutex_lock(&q->lock);
+        len += snprintf(reply + len, cap - len, " | %s threads %d queue %d policy %s sjf %d cost %lu",
+                        p->name, atomic_load(&p->threads), q->capacity, policy_names[q->policy],
+                        q->aging, q->cost_capacity / 1000);
+        pthread_mutex_unlock(&q->lock);
+    }
+    if (len + 1 < cap) {
+        strcpy(reply + len, "\n");
+    }
+}
+
+static Pool* adminFindPool(const char* name) {
+    for (int i = 0; i < npools; i++) {
+        if (strcmp(pools[i]->name, name) == 0) {
+            return pools[i];
+        }
+    }
+    return NULL;
+}
+
+static void adminCommand(char* line, char* reply, size_t cap) {
+    char cmd[32], arg[64], name[32];
+    int n = sscanf(line, "%31s %63s %31s", cmd, arg, name);
+    Pool* pool;
+    int rc;
+
+    if (n < 1) {
+        snprintf(reply, cap, "error empty command\n");
+        return;
+    }
+    if (strcmp(cmd, "show") == 0) {
+        adminShow(reply, cap);
+        return;
+    }
+    if (n < 2) {
+        snprintf(reply, cap, "error %s needs an argument\n", cmd);
+        return;
+    }
+    if (strcmp(cmd, "vip") == 0) {
+        strcpy(cmd, "threads");
+        strcpy(name, "vip");
+        n = 3;
+    }
+    pool = n == 3 ? adminFindPool(name) : pools[0];
+    if (pool == NULL) {
+        snprintf(reply, cap, "error unknown pool %s\n", name);
+        return;
+    }
+    if (strcmp(cmd, "threads") != 0 && pool->vip) {
+        snprintf(reply, cap, "error %s has no queue of its own\n", pool->name);
+        return;
+    }
+
+    Queue* queue = pool->queue;
+    int value = atoi(arg);
+    if (strcmp(cmd, "policy") == 0) {
+        int policy = policyFromName(arg);
+        if (policy < 0) {
+            snprintf(reply, cap, "error unknown policy %s\n", arg);
+            return;
+        }
+        setQueuePolicy(queue, policy);
+        rc = 0;
+    }
+    else if (strcmp(cmd, "threads") == 0) {
+        rc = value < 1 ? -1 : pool->resize(pool, value);
+    }
+    else if (strcmp(cmd, "queue") == 0) {
+        rc = resizeQueue(queue, value);
+    }
+    else if (strcmp(cmd, "sjf") == 0) {
+        setQueueAging(queue, value);
+        rc = 0;
+    }
+    else if (strcmp(cmd, "cost") == 0) {
+        setQueueCostCapacity(queue, value > 0 ? (unsigned long)value * 1000 : 0);
+        rc = 0;
+    }
+    else {
+        snprintf(reply, cap, "error unknown command %s\n", cmd);
+        return;
+    }
+    if (rc < 0) {
+        snprintf(reply, cap, "error %s %s refused\n", cmd, arg);
+        return;
+    }
+    adminShow(reply, cap);
+}
+
+static void* adminLoop(void* arg) {
+    char line[MAXLINE], reply[MAXLINE];
+
+    (void)arg;
+    while (1) {
+        int fd = accept(adminfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                usleep(ADMIN_ACCEPT_BACKOFF_US);
+            }
+            continue;
+        }
+        struct timeval idle = { ADMIN_IDLE_SEC, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        FILE* in = fdopen(fd, "r");
+        if (in == NULL) {
+            close(fd);
+            continue;
+        }
+        while (fgets(line, sizeof(line), in) != NULL) {
+            adminCommand(line, reply, sizeof(reply));
+            // The reply is short; a client that went away must not SIGPIPE us
+            if (send(fd, reply, strlen(reply), MSG_NOSIGNAL) < 0) {
+                break;
+            }
+        }
+        fclose(in);
+    }
+    return NULL;
+}
+
+void adminStart(const char* path, Pool** p, int n) {
+    pthread_t tid;
+
+    npools = n < POOL_MAX ? n : POOL_MAX;
+    memcpy(pools, p, sizeof(Pool*) * npools);
+
+    adminfd = Open_unixlistenfd((char*)path, 0600, 4);
+
+    if (pthread_create(&tid, NULL, adminLoop, NULL) != 0) {
+        exit(1);
+    }
+    pthread_detach(tid);
+}
@@ -0,0 +1,19 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include "pool.h"
+
+// Listens on a Unix socket at path for one-line commands; [pool] defaults
+// to the first pool given:
+//   threads <n> [pool]    worker thread count
+//   vip <n>               VIP thread count, same as "threads <n> vip"
+//   queue <n> [pool]      queue capacity, queued requests are kept
+//   policy <name> [pool]  overload policy
+//   sjf <n> [pool]        shortest-job-first aging factor, 0 for FIFO
+//   cost <ms> [pool]      estimated work the queue admits, 0 for no limit
+//   show                  current settings
+// Each command gets one "ok ..." or "error ..." line back. A VIP pool's
+// queue settings are those of the pool it shares its queue with.
+void adminStart(const char* path, Pool** pools, int npools);
+
+#endif
@@ -0,0 +1,95 @@
+//
+// arena.c: Size-classed per-request arenas with per-thread free lists.
+//
+
+#include "segel.h"
+#include "arena.h"
+
+#define ARENA_CACHED 16           // Free arenas kept per class and thread
+
+static __thread Arena* free_lists[ARENA_CLASSES];
+static __thread int free_counts[ARENA_CLASSES];
+
+static int sizeClass(size_t size) {
+    int cls = 0;
+    while (cls < ARENA_CLASSES - 1 && ((size_t)ARENA_MIN << cls) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+Arena* arenaAcquire(size_t size) {
+    int cls = sizeClass(size);
+    Arena* a = free_lists[cls];
+
+    if (a != NULL) {
+        free_lists[cls] = a->next;
+        free_counts[cls]--;
+    }
+    else {
+        a = malloc(sizeof(Arena) + ((size_t)ARENA_MIN << cls));
+        if (a == NULL) {
+            return NULL;
+        }
+        a->cls = cls;
+        a->size = (size_t)ARENA_MIN << cls;
+    }
+    a->next = NULL;
+    a->chunks = NULL;
+    a->used = 0;
+    return a;
+}
+
+//
+// Moves the contents into an arena of at least size bytes. Pointers into the
+// old arena are invalidated, so only grow before handing out allocations.
+//
+Arena* arenaGrow(Arena* a, size_t size) {
+    Arena* bigger = arenaAcquire(size);
+
+    if (bigger == NULL) {
+        return NULL;
+    }
+    memcpy(bigger->data, a->data, a->used);
+    bigger->used = a->used;
+    bigger->chunks = a->chunks;
+    a->chunks = NULL;
+    arenaRelease(a);
+    return bigger;
+}
+
+void* arenaAlloc(Arena* a, size_t n) {
+    n = (n + 7) & ~(size_t)7;
+    if (a->size - a->used >= n) {
+        void* p = a->data + a->used;
+        a->used += n;
+        return p;
+    }
+
+    ArenaChunk* c = malloc(sizeof(ArenaChunk) + n);
+    if (c == NULL) {
+        return NULL;
+    }
+    c->next = a->chunks;
+    a->chunks = c;
+    return c->data;
+}
+
+void arenaRelease(Arena* a) {
+    if (a == NULL) {
+        return;
+    }
+    while (a->chunks != NULL) {
+        ArenaChunk* c = a->chunks;
+        a->chunks = c->next;
+        free(c);
+    }
+    if (free_counts[a->cls] < ARENA_CACHED) {
+        a->next = free_lists[a->cls];
+        free_lists[a->cls] = a;
+        free_counts[a->cls]++;
+    }
+    else {
+        free(a);
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_MIN 1024            // Smallest arena, enough for a typical request head
+#define ARENA_MAX (64 * 1024)     // Largest arena, and so the largest request head
+#define ARENA_CLASSES 7           // Power-of-two sizes from ARENA_MIN to ARENA_MAX
+
+// Per-request bump allocator. Arenas come in power-of-two size classes and
+// are recycled through per-thread free lists; allocations that do not fit
+// spill into separately malloc'ed chunks freed on release.
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    char data[];
+} ArenaChunk;
+
+typedef struct Arena {
+    struct Arena* next;           // Free list link
+    ArenaChunk* chunks;           // Overflow allocations
+    int cls;
+    size_t size;                  // Capacity of data
+    size_t used;
+    char data[];
+} Arena;
+
+Arena* arenaAcquire(size_t size);
+Arena* arenaGrow(Arena* a, size_t size);
+void* arenaAlloc(Arena* a, size_t n);
+void arenaRelease(Arena* a);
+
+#endif
@@ -0,0 +1,365 @@
+/*
+ * bench.c: Microbenchmarks for the queue, the request parser and the serve paths.
+ *
+ * To run: ./bench [queue] [parse] [static] [drop]   (no arguments runs all)
+ *
+ * Prints one JSON object per line so results from different commits can be
+ * diffed or loaded into a script. "make bench" runs every suite and writes
+ * bench_output.txt, tagging each line with the current git revision.
+ */
+
+#include "segel.h"
+#include <stdarg.h>
+#include "queue.h"
+#include "request.h"
+#include "cache.h"
+#include "stats.h"
+#include "clock.h"
+#include "arena.h"
+
+static const char* rev;
+
+static void emit(const char* suite, const char* fmt, ...) {
+    va_list ap;
+
+    printf("{\"rev\":\"%s\",\"suite\":\"%s\",", rev, suite);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("}\n");
+    fflush(stdout);
+}
+
+static uint64_t nowNs(void) {
+    return clockToNs(clockNow());
+}
+
+static int cmpU64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void discardRequest(Request req) {
+}
+
+/**********************************
+ * enqueue / dequeue
+ **********************************/
+
+#define QUEUE_ITEMS 200000
+#define QUEUE_CAPACITY 1024
+#define QUEUE_MAX_BATCH 16
+
+typedef struct QueueBench {
+    Queue q;
+    int producers;
+    int batch;                // Requests per enqueueBatch / dequeueBatch
+    uint64_t* latency;        // One slot per item
+    atomic_ulong next_sample;
+} QueueBench;
+
+static void* queueProducer(void* arg) {
+    QueueBench* b = (QueueBench*)arg;
+    int items = QUEUE_ITEMS / b->producers;
+    Request reqs[QUEUE_MAX_BATCH];
+
+    memset(reqs, 0, sizeof(reqs));
+    for (int i = 0; i < items; i += b->batch) {
+        int n = items - i < b->batch ? items - i : b->batch;
+        uint64_t now = clockNow();
+        for (int j = 0; j < n; j++) {
+            reqs[j].connfd = i + j;
+            reqs[j].trace.stamp[STAGE_ENQUEUE] = now;
+        }
+        enqueueBatch(&b->q, reqs, n);
+    }
+    return NULL;
+}
+
+static void* queueConsumer(void* arg) {
+    QueueBench* b = (QueueBench*)arg;
+
+    Request reqs[QUEUE_MAX_BATCH];
+
+    while (1) {
+        int n = dequeueBatch(&b->q, reqs, b->batch, 0);
+        uint64_t now = clockNow();
+        for (int i = 0; i < n; i++) {
+            if (reqs[i].connfd == -2) {
+                // Stop marker: hand back what follows it to the other consumers
+                enqueueBatch(&b->q, reqs + i + 1, n - i - 1);
+                return NULL;
+            }
+            b->latency[atomic_fetch_add(&b->next_sample, 1)] = now - reqs[i].trace.stamp[STAGE_ENQUEUE];
+        }
+    }
+}
+
+static void benchQueueRun(int threads, int batch) {
+    QueueBench b;
+    pthread_t prod[threads], cons[threads];
+
+    memset(&b, 0, sizeof(b));
+    initQueue(&b.q, QUEUE_CAPACITY, POLICY_BLOCK);
+    b.q.on_drop = discardRequest;
+    b.producers = threads;
+    b.batch = batch;
+    b.latency = malloc(sizeof(uint64_t) * QUEUE_ITEMS);
+    if (b.latency == NULL) {
+        exit(1);
+    }
+
+    uint64_t start = nowNs();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&cons[i], NULL, queueConsumer, &b);
+        pthread_create(&prod[i], NULL, queueProducer, &b);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(prod[i], NULL);
+    }
+    for (int i = 0; i < threads; i++) {
+        enqueue(&b.q, (Request) { .connfd = -2 }, 0);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(cons[i], NULL);
+    }
+    uint64_t elapsed = nowNs() - start;
+
+    unsigned long n = atomic_load(&b.next_sample);
+    qsort(b.latency, n, sizeof(uint64_t), cmpU64);
+    emit("queue", "\"threads\":%d,\"batch\":%d,\"items\":%lu,\"ops_per_sec\":%.0f,\"p50_ns\":%lu,\"p99_ns\":%lu,\"max_ns\":%lu",
+         threads, batch, n, n * 1e9 / elapsed,
+         (unsigned long)clockToNs(b.latency[n / 2]),
+         (unsigned long)clockToNs(b.latency[n * 99 / 100]),
+         (unsigned long)clockToNs(b.latency[n - 1]));
+
+    free(b.latency);
+    destroyQueue(&b.q);
+}
+
+static void benchQueue(void) {
+    for (int batch = 1; batch <= QUEUE_MAX_BATCH; batch *= QUEUE_MAX_BATCH) {
+        for (int threads = 1; threads <= 64; threads *= 2) {
+            benchQueueRun(threads, batch);
+        }
+    }
+}
+
+/**********************************
+ * rio_readlineb + request parsing
+ **********************************/
+
+#define PARSE_COPIES 20000
+
+static const char* recorded_heads[][2] = {
+    { "curl",
+      "GET /home.html HTTP/1.1\r\n"
+      "Host: localhost:8080\r\n"
+      "User-Agent: curl/7.88.1\r\n"
+      "Accept: */*\r\n"
+      "\r\n" },
+    { "browser",
+      "GET /home.html HTTP/1.1\r\n"
+      "Host: localhost:8080\r\n"
+      "Connection: keep-alive\r\n"
+      "Cache-Control: max-age=0\r\n"
+      "Upgrade-Insecure-Requests: 1\r\n"
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+      "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+      "Accept-Encoding: gzip, deflate, br\r\n"
+      "Accept-Language: en-US,en;q=0.9,he;q=0.8\r\n"
+      "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+      "\r\n" },
+    { "cgi",
+      "GET /output.cgi?0.25 HTTP/1.0\r\n"
+      "Host: localhost\r\n"
+      "\r\n" },
+};
+
+static void benchParse(void) {
+    char line[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char filename[MAXLINE], cgiargs[MAXLINE];
+    rio_t rio;
+
+    for (int h = 0; h < sizeof(recorded_heads) / sizeof(recorded_heads[0]); h++) {
+        FILE* f = tmpfile();
+        const char* head = recorded_heads[h][1];
+        size_t len = strlen(head);
+
+        if (f == NULL) {
+            unix_error("tmpfile error");
+        }
+        for (int i = 0; i < PARSE_COPIES; i++) {
+            fwrite(head, 1, len, f);
+        }
+        fflush(f);
+        int fd = fileno(f);
+
+        Lseek(fd, 0, SEEK_SET);
+        rio_readinitb(&rio, fd);
+        uint64_t start = nowNs();
+        for (int i = 0; i < PARSE_COPIES; i++) {
+            rio_readlineb(&rio, line, MAXLINE);
+            sscanf(line, "%s %s %s", method, uri, version);
+            requestReadhdrs(&rio);
+            isStaticRequest(uri);
+            requestParseURI(uri, filename, cgiargs);
+        }
+        uint64_t elapsed = nowNs() - start;
+
+        emit("parse", "\"head\":\"%s\",\"reader\":\"rio\",\"head_bytes\":%lu,\"requests\":%d,\"ns_per_request\":%.1f,\"mb_per_sec\":%.1f",
+             recorded_heads[h][0], len, PARSE_COPIES, (double)elapsed / PARSE_COPIES,
+             (double)len * PARSE_COPIES / elapsed * 1e3);
+
+        // The server's reader: one head per read, parsed in place in an arena
+        if (ftruncate(fd, len) < 0) {
+            unix_error("ftruncate error");
+        }
+        start = nowNs();
+        for (int i = 0; i < PARSE_COPIES; i++) {
+            RequestHead parsed;
+            Arena* arena = arenaAcquire(ARENA_MIN);
+
+            Lseek(fd, 0, SEEK_SET);
+            requestReadHead(fd, &arena, &parsed);
+            size_t uri_len = strlen(parsed.uri);
+            char* name = arenaAlloc(arena, uri_len + sizeof("./public/home.html"));
+            char* args = arenaAlloc(arena, uri_len + 1);
+            isStaticRequest(parsed.uri);
+            requestParseURI(parsed.uri, name, args);
+            arenaRelease(arena);
+        }
+        elapsed = nowNs() - start;
+
+        emit("parse", "\"head\":\"%s\",\"reader\":\"arena\",\"head_bytes\":%lu,\"requests\":%d,\"ns_per_request\":%.1f,\"mb_per_sec\":%.1f",
+             recorded_heads[h][0], len, PARSE_COPIES, (double)elapsed / PARSE_COPIES,
+             (double)len * PARSE_COPIES / elapsed * 1e3);
+        fclose(f);
+    }
+}
+
+/**********************************
+ * requestServeStatic over a socketpair
+ **********************************/
+
+static void* drainSocket(void* arg) {
+    int fd = *(int*)arg;
+    char buf[65536];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+static void benchStatic(void) {
+    static const int sizes[] = { 1024, 16384, 262144, 4194304 };
+    char dir[] = "/tmp/benchXXXXXX", path[MAXLINE];
+    threads_stats t_stats = statsSlot(0, 0);
+
+    if (mkdtemp(dir) == NULL) {
+        unix_error("mkdtemp error");
+    }
+
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int size = sizes[i];
+        int iterations = (int)(256LL * 1024 * 1024 / size);
+        char* data = malloc(size);
+        int sv[2];
+        pthread_t drainer;
+
+        if (iterations > 20000) iterations = 20000;
+        memset(data, 'x', size);
+        sprintf(path, "%s/f_%d.html", dir, size);
+        int fd = Open(path, O_WRONLY | O_CREAT | O_TRUNC, DEF_MODE);
+        Rio_writen(fd, data, size);
+        Close(fd);
+        free(data);
+
+        for (int cached = 0; cached <= 1; cached++) {
+            CacheEntry* entry = cached ? cacheLoad(path, 0) : NULL;
+            RequestTrace trace;
+
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+                unix_error("socketpair error");
+            }
+            pthread_create(&drainer, NULL, drainSocket, &sv[1]);
+
+            uint64_t start = nowNs();
+            for (int n = 0; n < iterations; n++) {
+                memset(&trace, 0, sizeof(trace));
+                if (entry != NULL) {
+                    requestServeCached(sv[0], entry, &trace);
+                }
+                else {
+                    requestServeStatic(sv[0], path, size, &trace, t_stats);
+                }
+            }
+            uint64_t elapsed = nowNs() - start;
+            Close(sv[0]);
+            pthread_join(drainer, NULL);
+            Close(sv[1]);
+
+            emit("static", "\"file_bytes\":%d,\"cached\":%s,\"requests\":%d,\"ns_per_request\":%.0f,\"mb_per_sec\":%.1f",
+                 size, cached ? "true" : "false", iterations, (double)elapsed / iterations,
+                 (double)size * iterations / elapsed * 1e3);
+        }
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+/**********************************
+ * dropRandomRequests
+ **********************************/
+
+static void benchDrop(void) {
+    static const int capacities[] = { 1024, 8192, 65536 };
+
+    for (int i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++) {
+        int capacity = capacities[i];
+        Queue q;
+
+        initQueue(&q, capacity, POLICY_DROP_RANDOM);
+        q.on_drop = discardRequest;
+        for (int n = 0; n < capacity; n++) {
+            enqueue(&q, (Request) { .connfd = n }, 0);
+        }
+
+        pthread_mutex_lock(&q.lock);
+        uint64_t start = nowNs();
+        dropRandomRequests(&q, 50);
+        uint64_t elapsed = nowNs() - start;
+        pthread_mutex_unlock(&q.lock);
+
+        emit("drop", "\"capacity\":%d,\"dropped\":%lu,\"ns_total\":%lu,\"ns_per_drop\":%.1f",
+             capacity, q.dropped, (unsigned long)elapsed, (double)elapsed / (q.dropped ? q.dropped : 1));
+        destroyQueue(&q);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    static const struct { const char* name; void (*run)(void); } suites[] = {
+        { "queue", benchQueue },
+        { "parse", benchParse },
+        { "static", benchStatic },
+        { "drop", benchDrop },
+    };
+    int nsuites = sizeof(suites) / sizeof(suites[0]);
+
+    rev = getenv("BENCH_REV") ? getenv("BENCH_REV") : "unknown";
+    clockInit();
+    cacheInit();
+    statsInit(1);
+    srand(1);
+
+    for (int i = 0; i < nsuites; i++) {
+        int selected = argc == 1;
+        for (int a = 1; a < argc; a++) {
+            selected |= strcmp(argv[a], suites[i].name) == 0;
+        }
+        if (selected) {
+            suites[i].run();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+//
+// bundle.c: Serves static files out of a packed asset bundle (see pack.c).
+//
+// The bundle is mapped once at startup and never changes, so lookups are a
+// lock-free binary search over its index and payloads are sent straight
+// from the mapping.
+//
+
+#include "segel.h"
+#include "bundle.h"
+
+static const char* base;
+static const BundleHeader* header;
+static const BundleEntry* entries;
+
+//
+// Maps the bundle; returns -1 (and serves from ./public only) if it is
+// missing or malformed
+//
+int bundleOpen(const char* path) {
+    struct stat sbuf;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "bundle: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &sbuf) < 0 || (size_t)sbuf.st_size < sizeof(BundleHeader)) {
+        fprintf(stderr, "bundle: %s: too short\n", path);
+        close(fd);
+        return -1;
+    }
+    const char* map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "bundle: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    const BundleHeader* h = (const BundleHeader*)map;
+    if (h->magic != BUNDLE_MAGIC || h->version != BUNDLE_VERSION || h->entry_size != sizeof(BundleEntry) ||
+        h->size != (uint64_t)sbuf.st_size || h->index_offset + (uint64_t)h->count * sizeof(BundleEntry) > h->size ||
+        h->strings_offset + h->strings_size > h->size || h->strings_size == 0 || map[h->strings_offset + h->strings_size - 1] != '\0') {
+        fprintf(stderr, "bundle: %s: not a bundle of this version\n", path);
+        munmap((void*)map, sbuf.st_size);
+        return -1;
+    }
+    const BundleEntry* e = (const BundleEntry*)(map + h->index_offset);
+    for (uint32_t i = 0; i < h->count; i++, e++) {
+        if (e->path >= h->strings_size || e->type >= h->strings_size || e->etag >= h->strings_size ||
+            e->offset + e->size > h->size || e->gzip_offset + e->gzip_size > h->size) {
+            fprintf(stderr, "bundle: %s: entry %u out of bounds\n", path, i);
+            munmap((void*)map, sbuf.st_size);
+            return -1;
+        }
+    }
+    // The index is hot, the payloads are paged in as they are served
+    madvise((void*)map, h->strings_offset + h->strings_size, MADV_WILLNEED);
+
+    base = map;
+    header = h;
+    entries = (const BundleEntry*)(map + h->index_offset);
+    return 0;
+}
+
+const char* bundleString(uint32_t offset) {
+    return base + header->strings_offset + offset;
+}
+
+const char* bundleData(uint64_t offset) {
+    return base + offset;
+}
+
+const BundleEntry* bundleLookup(const char* filename) {
+    size_t prefix = strlen(BUNDLE_PREFIX);
+
+    if (header == NULL || strncmp(filename, BUNDLE_PREFIX, prefix) != 0) {
+        return NULL;
+    }
+    filename += prefix;
+
+    int lo = 0, hi = (int)header->count - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(filename, bundleString(entries[mid].path));
+        if (cmp == 0) {
+            return &entries[mid];
+        }
+        if (cmp < 0) {
+            hi = mid - 1;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
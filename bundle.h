@@ -0,0 +1,39 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+
+#define BUNDLE_MAGIC 0x4b503357u     // "W3PK"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGN 64              // Payload alignment
+#define BUNDLE_PREFIX "./public/"    // Request file names map to bundle paths below it
+
+// On-disk layout: header, index sorted by path, payloads, string table
+typedef struct BundleHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t count;
+    uint64_t index_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t size;                   // Whole file
+} BundleHeader;
+
+typedef struct BundleEntry {
+    uint32_t path;                   // String table offsets
+    uint32_t type;
+    uint32_t etag;                   // Quoted, of the identity payload
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t gzip_offset;            // gzip variant, gzip_size 0 if none
+    uint64_t gzip_size;
+} BundleEntry;
+
+int bundleOpen(const char* path);
+const BundleEntry* bundleLookup(const char* filename);
+const char* bundleString(uint32_t offset);
+const char* bundleData(uint64_t offset);
+
+#endif
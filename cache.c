@@ -0,0 +1,334 @@
+//
+// cache.c: In-memory cache of static files and the startup warm-up that fills it.
+//
+// Entries are only ever added, never removed, so lookups walk the bucket chains
+// without taking a lock; inserts publish a fully built entry with a CAS on the
+// bucket head.
+//
+
+#include "segel.h"
+#include "request.h"
+#include "cache.h"
+#include "hugemem.h"
+#include <dirent.h>
+
+#define CACHE_BUCKETS 1024
+#define PUBLIC_DIR "./public"
+
+static CacheEntry* buckets[CACHE_BUCKETS];
+
+static unsigned int hashPath(const char* path) {
+    unsigned int h = 2166136261u;
+    while (*path) {
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    }
+    return h & (CACHE_BUCKETS - 1);
+}
+
+void cacheInit(void) {
+    memset(buckets, 0, sizeof(buckets));
+}
+
+CacheEntry* cacheLookup(const char* path) {
+    CacheEntry* e = __atomic_load_n(&buckets[hashPath(path)], __ATOMIC_ACQUIRE);
+    for (; e != NULL; e = e->next) {
+        if (strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+int cacheFresh(const CacheEntry* e) {
+    struct stat sbuf;
+
+    if (!e->revalidate) {
+        return 1;
+    }
+    return stat(e->path, &sbuf) == 0 && (size_t)sbuf.st_size == e->size &&
+           sbuf.st_mtim.tv_sec == e->mtime.tv_sec && sbuf.st_mtim.tv_nsec == e->mtime.tv_nsec;
+}
+
+//
+// Reads the file into memory carved from huge pages, where a hot set of
+// small files shares a few TLB entries instead of one per 4 KB page
+//
+static char* cacheCopy(int fd, size_t size) {
+    char* data = hugememCarve(MEM_CACHE, size);
+    size_t done = 0;
+
+    if (data == NULL) {
+        return NULL;
+    }
+    while (done < size) {
+        ssize_t n = pread(fd, data + done, size - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // Shrunk or unreadable
+            hugememUncarve(MEM_CACHE, data, size);
+            return NULL;
+        }
+        done += n;
+    }
+    return data;
+}
+
+//
+// Maps the file (or copies it, with -H huge), faults it in and renders its
+// response header
+//
+CacheEntry* cacheLoad(const char* path, int flags) {
+    int pin = flags & CACHE_PIN;
+    CacheEntry* e;
+    struct stat sbuf;
+    char header[REQUEST_HEADER_MAX];
+    int fd;
+
+    if ((e = cacheLookup(path)) != NULL) {
+        return e;
+    }
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    e = calloc(1, sizeof(CacheEntry));
+    if (e == NULL) {
+        close(fd);
+        return NULL;
+    }
+    e->size = sbuf.st_size;
+    e->revalidate = (flags & CACHE_REVALIDATE) != 0;
+    e->mtime = sbuf.st_mtim;
+    if (e->size > 0 && (hugememFlags() & HUGEMEM_HUGE)) {
+        e->data = cacheCopy(fd, e->size);
+        if (e->data == NULL) {
+            close(fd);
+            free(e);
+            return NULL;
+        }
+        e->huge = 1;
+        if (pin && mlock(e->data, e->size) == 0) {
+            e->pinned = 1;
+        }
+    }
+    else if (e->size > 0) {
+        e->data = mmap(0, e->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (e->data == MAP_FAILED) {
+            close(fd);
+            free(e);
+            return NULL;
+        }
+        madvise(e->data, e->size, MADV_WILLNEED);
+        if (pin && mlock(e->data, e->size) == 0) {
+            e->pinned = 1;
+        }
+        hugememAccount(MEM_CACHE, e->size, e->pinned);
+    }
+    close(fd);
+
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\n"
+             "Server: OS-HW3 Web Server\r\n"
+             "Content-Length: %lu\r\n"
+             "Content-Type: %s\r\n\r\n",
+             (unsigned long)e->size, requestGetFiletype(path));
+    e->header = strdup(header);
+    e->header_len = strlen(header);
+    e->path = strdup(path);
+
+    unsigned int b = hashPath(path);
+    e->next = __atomic_load_n(&buckets[b], __ATOMIC_ACQUIRE);
+    do {
+        // Another loader may have inserted the file since our lookup, not
+        // only since the last CAS
+        CacheEntry* other;
+        for (other = e->next; other != NULL; other = other->next) {
+            if (strcmp(other->path, path) == 0) {
+                break;
+            }
+        }
+        if (other != NULL) {
+            // Lost the race against another loader of the same file. A
+            // copy keeps any lock: its pages may hold other entries too.
+            if (e->huge) {
+                hugememUncarve(MEM_CACHE, e->data, e->size);
+            }
+            else if (e->size > 0) {
+                if (e->pinned) munlock(e->data, e->size);
+                munmap(e->data, e->size);
+                hugememAccount(MEM_CACHE, -(long)e->size, e->pinned);
+            }
+            free(e->header);
+            free(e->path);
+            free(e);
+            return other;
+        }
+    } while (!__atomic_compare_exchange_n(&buckets[b], &e->next, e, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    return e;
+}
+
+/**********************************
+ * Startup warm-up
+ **********************************/
+
+typedef struct WarmupFile {
+    char* path;
+    int pin;
+} WarmupFile;
+
+typedef struct Warmup {
+    WarmupFile* files;
+    int count;
+    int capacity;
+    int next;          // Next file index to load, claimed atomically
+    int running;       // Loader threads still working
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} Warmup;
+
+static void warmupAdd(Warmup* w, const char* path, int pin) {
+    if (w->count == w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : 64;
+        w->files = realloc(w->files, sizeof(WarmupFile) * w->capacity);
+        if (w->files == NULL) {
+            exit(1);
+        }
+    }
+    w->files[w->count].path = strdup(path);
+    w->files[w->count].pin = pin;
+    w->count++;
+}
+
+static void warmupWalk(Warmup* w, const char* dir) {
+    DIR* d = opendir(dir);
+    struct dirent* ent;
+    char path[MAXLINE];
+    struct stat sbuf;
+
+    if (d == NULL) {
+        return;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        if (stat(path, &sbuf) < 0) {
+            continue;
+        }
+        if (S_ISDIR(sbuf.st_mode)) {
+            warmupWalk(w, path);
+        }
+        else if (S_ISREG(sbuf.st_mode)) {
+            warmupAdd(w, path, 0);
+        }
+    }
+    closedir(d);
+}
+
+//
+// Manifest lines are "<path relative to ./public> [pin]", '#' starts a comment
+//
+static void warmupReadManifest(Warmup* w, const char* manifest) {
+    FILE* f = fopen(manifest, "r");
+    char line[MAXLINE], name[MAXLINE], flag[MAXLINE], path[MAXLINE + sizeof(PUBLIC_DIR)];
+
+    if (f == NULL) {
+        fprintf(stderr, "warm-up: cannot open manifest %s\n", manifest);
+        return;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char* hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        int n = sscanf(line, "%s %s", name, flag);
+        if (n < 1) {
+            continue;
+        }
+        snprintf(path, sizeof(path), PUBLIC_DIR "/%s", name[0] == '/' ? name + 1 : name);
+        warmupAdd(w, path, n == 2 && strcmp(flag, "pin") == 0);
+    }
+    fclose(f);
+}
+
+static void* warmupLoader(void* arg) {
+    Warmup* w = (Warmup*)arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->count) {
+        // Revalidated like the I/O pool's entries: a file edited after
+        // startup must not be served stale, nor one truncated under its
+        // mapping fault the worker reading it
+        cacheLoad(w->files[i].path, CACHE_REVALIDATE | (w->files[i].pin ? CACHE_PIN : 0));
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (--w->running == 0) {
+        pthread_cond_signal(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+void warmupPublic(const char* manifest, int nthreads, int deadline_ms) {
+    // Leaked on purpose: loaders may outlive the deadline
+    Warmup* w = calloc(1, sizeof(Warmup));
+    struct timespec deadline;
+    pthread_t tid;
+
+    if (w == NULL) {
+        exit(1);
+    }
+    if (manifest != NULL) {
+        warmupReadManifest(w, manifest);
+    }
+    else {
+        warmupWalk(w, PUBLIC_DIR);
+    }
+    if (w->count == 0) {
+        return;
+    }
+    if (nthreads > w->count) nthreads = w->count;
+    if (nthreads < 1) nthreads = 1;
+
+    // The deadline is on the monotonic clock, so setting the time of day
+    // cannot stretch or cut short the wait
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->done, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_mutex_lock(&w->lock);
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&tid, NULL, warmupLoader, w) != 0) {
+            break;
+        }
+        pthread_detach(tid);
+        w->running++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += deadline_ms / 1000;
+    deadline.tv_nsec += (long)(deadline_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (w->running > 0) {
+        if (deadline_ms <= 0) {
+            pthread_cond_wait(&w->done, &w->lock);
+        }
+        else if (pthread_cond_timedwait(&w->done, &w->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+}
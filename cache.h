@@ -0,0 +1,37 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+
+// cacheLoad flags
+#define CACHE_PIN 1           // mlock the contents
+#define CACHE_REVALIDATE 2    // Check the file is unchanged on every hit, see cacheFresh
+
+typedef struct CacheEntry {
+    char* path;           // Key, e.g. "./public/home.html"
+    char* data;           // File contents (mmap'ed or copied, may be NULL when size is 0)
+    size_t size;
+    char* header;         // Pre-rendered "HTTP/1.0 200 OK" response header
+    int header_len;
+    int pinned;           // Contents are mlock'ed
+    int huge;             // Contents copied into huge pages rather than mapped
+    int revalidate;       // Loaded with CACHE_REVALIDATE
+    struct timespec mtime;  // Of the file when it was loaded
+    struct CacheEntry* next;
+} CacheEntry;
+
+void cacheInit(void);
+CacheEntry* cacheLookup(const char* path);
+CacheEntry* cacheLoad(const char* path, int flags);
+
+// Whether e still matches its file. Entries are never replaced, so a stale
+// one is only bypassed: the caller serves the file from disk instead.
+int cacheFresh(const CacheEntry* e);
+
+// Preloads ./public (or the files listed in manifest) with nthreads loaders.
+// Returns once everything is loaded or deadline_ms has passed (0 = no deadline),
+// the loaders keep running in the background in the latter case.
+void warmupPublic(const char* manifest, int nthreads, int deadline_ms);
+
+#endif
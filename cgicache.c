@@ -0,0 +1,231 @@
+//
+// cgicache.c: Opt-in cache of CGI output keyed by program and query string.
+//
+// The first request for a key becomes the leader and runs the program; the
+// requests that arrive while it runs wait on the entry's eventfd (through
+// rio_wait, so coroutine workers yield instead of blocking their thread) and
+// are served the leader's output. Finished entries live for the rule's TTL,
+// and the oldest are evicted to keep the total under the byte limit.
+//
+
+#include "segel.h"
+#include "cgicache.h"
+#include "clock.h"
+#include "metrics.h"
+#include <sys/eventfd.h>
+
+#define CGI_CACHE_BUCKETS 256
+#define CGI_CACHE_RULES 16
+#define PUBLIC_DIR "./public/"
+
+typedef struct CgiRule {
+    char* filename;
+    uint64_t ttl_ns;
+} CgiRule;
+
+atomic_ulong cgi_cache_results[CGI_CACHE_RESULTS];
+
+static CgiRule rules[CGI_CACHE_RULES];
+static int nrules;
+static size_t limit = 1024 * 1024;
+static size_t used;
+static CgiEntry* buckets[CGI_CACHE_BUCKETS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cgiCacheAddRule(const char* uri, int ttl_ms) {
+    if (nrules == CGI_CACHE_RULES) {
+        fprintf(stderr, "cgi cache: too many rules, ignoring %s\n", uri);
+        return;
+    }
+    while (*uri == '/') {
+        uri++;
+    }
+    rules[nrules].filename = malloc(sizeof(PUBLIC_DIR) + strlen(uri));
+    if (rules[nrules].filename == NULL) {
+        exit(1);
+    }
+    sprintf(rules[nrules].filename, PUBLIC_DIR "%s", uri);
+    rules[nrules].ttl_ns = (uint64_t)ttl_ms * 1000000;
+    nrules++;
+}
+
+void cgiCacheSetLimit(size_t bytes) {
+    limit = bytes;
+}
+
+size_t cgiCacheLimit(void) {
+    return limit;
+}
+
+static unsigned int hashKey(const char* key) {
+    unsigned int h = 2166136261u;
+    while (*key) {
+        h = (h ^ (unsigned char)*key++) * 16777619u;
+    }
+    return h & (CGI_CACHE_BUCKETS - 1);
+}
+
+// Caller holds the lock
+static void entryPut(CgiEntry* e) {
+    if (--e->refs > 0) {
+        return;
+    }
+    if (e->done_fd >= 0) {
+        close(e->done_fd);
+    }
+    free(e->data);
+    free(e->key);
+    free(e);
+}
+
+// Caller holds the lock
+static void entryUnlink(CgiEntry* e) {
+    CgiEntry** pp = &buckets[hashKey(e->key)];
+    while (*pp != e) {
+        pp = &(*pp)->next;
+    }
+    *pp = e->next;
+    e->linked = 0;
+    if (e->ready && !e->failed) {
+        used -= e->size;
+    }
+    entryPut(e);
+}
+
+// Caller holds the lock. Drops the entries closest to expiry (expired ones
+// first) until need more bytes fit.
+static void evict(size_t need) {
+    while (used + need > limit) {
+        CgiEntry* oldest = NULL;
+        for (int b = 0; b < CGI_CACHE_BUCKETS; b++) {
+            for (CgiEntry* e = buckets[b]; e != NULL; e = e->next) {
+                if (e->ready && !e->failed && (oldest == NULL || e->expires_ns < oldest->expires_ns)) {
+                    oldest = e;
+                }
+            }
+        }
+        if (oldest == NULL) {
+            return;
+        }
+        entryUnlink(oldest);
+    }
+}
+
+CgiEntry* cgiCacheAcquire(const char* filename, const char* cgiargs, int* leader) {
+    CgiRule* rule = NULL;
+    CgiEntry* e;
+    uint64_t now;
+    char* key;
+
+    for (int i = 0; i < nrules; i++) {
+        if (strcmp(rules[i].filename, filename) == 0) {
+            rule = &rules[i];
+            break;
+        }
+    }
+    if (rule == NULL) {
+        return NULL;
+    }
+    key = malloc(strlen(filename) + strlen(cgiargs) + 2);
+    if (key == NULL) {
+        return NULL;
+    }
+    sprintf(key, "%s?%s", filename, cgiargs);
+    now = clockToNs(clockNow());
+
+    pthread_mutex_lock(&lock);
+    for (e = buckets[hashKey(key)]; e != NULL; e = e->next) {
+        if (strcmp(e->key, key) == 0) {
+            break;
+        }
+    }
+    if (e != NULL && e->ready && (e->failed || e->expires_ns <= now)) {
+        entryUnlink(e);
+        e = NULL;
+    }
+    if (e != NULL) {
+        e->refs++;
+        pthread_mutex_unlock(&lock);
+        free(key);
+        *leader = 0;
+        atomic_fetch_add_explicit(&cgi_cache_results[e->ready ? CGI_CACHE_HIT : CGI_CACHE_COALESCED], 1, memory_order_relaxed);
+        return e;
+    }
+
+    e = calloc(1, sizeof(CgiEntry));
+    if (e == NULL || (e->done_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        pthread_mutex_unlock(&lock);
+        free(e);
+        free(key);
+        return NULL;
+    }
+    e->key = key;
+    e->expires_ns = rule->ttl_ns;    // Relative until the leader completes
+    e->refs = 2;
+    e->linked = 1;
+    unsigned int b = hashKey(key);
+    e->next = buckets[b];
+    buckets[b] = e;
+    pthread_mutex_unlock(&lock);
+
+    *leader = 1;
+    atomic_fetch_add_explicit(&cgi_cache_results[CGI_CACHE_MISS], 1, memory_order_relaxed);
+    return e;
+}
+
+//
+// Publishes the leader's output (taking ownership of data) and wakes the
+// waiters. With ok == 0 the waiters run the program themselves.
+//
+void cgiCacheComplete(CgiEntry* e, char* data, size_t size, int ok) {
+    uint64_t now = clockToNs(clockNow()), one = 1;
+
+    pthread_mutex_lock(&lock);
+    if (ok && size <= limit) {
+        if (e->linked) {
+            evict(size);
+            used += size;
+        }
+        e->data = data;
+        e->size = size;
+    }
+    else {
+        free(data);
+        e->failed = 1;
+    }
+    e->expires_ns += now;
+    e->ready = 1;
+    pthread_mutex_unlock(&lock);
+
+    // Cannot fail short of a bug; the waiters would then sleep until their
+    // own requests time out, which beats taking the server down
+    while (write(e->done_fd, &one, sizeof(one)) < 0) {
+        if (errno != EINTR) {
+            metricsIoError(IO_CGI, errno);
+            break;
+        }
+    }
+}
+
+void cgiCacheWait(CgiEntry* e) {
+    if (__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    // A descriptor of our own: epoll keeps one registration per descriptor
+    // and several waiters may share a coroutine scheduler
+    int fd = dup(e->done_fd);
+    while (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) {
+        if (rio_wait(fd < 0 ? e->done_fd : fd, POLLIN) < 0) {
+            break;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void cgiCacheRelease(CgiEntry* e) {
+    pthread_mutex_lock(&lock);
+    entryPut(e);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,40 @@
+#ifndef CGICACHE_H
+#define CGICACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// A cached (or in-flight) CGI output for one (program, QUERY_STRING) pair
+typedef struct CgiEntry {
+    char* key;              // "<filename>?<cgiargs>"
+    char* data;             // Program output, valid once ready
+    size_t size;
+    uint64_t expires_ns;    // clockToNs(clockNow()) after which it is stale
+    int ready;              // Leader finished (data valid unless failed)
+    int failed;             // Leader could not produce a cacheable result
+    int done_fd;            // eventfd, readable once ready is set
+    int refs;               // Table reference plus one per leader/waiter
+    int linked;             // Still in the table
+    struct CgiEntry* next;
+} CgiEntry;
+
+typedef enum { CGI_CACHE_HIT, CGI_CACHE_MISS, CGI_CACHE_COALESCED, CGI_CACHE_RESULTS } CgiCacheResult;
+
+extern atomic_ulong cgi_cache_results[CGI_CACHE_RESULTS];
+
+// Caches the output of uri (e.g. "/output.cgi") for ttl_ms. Off for all
+// programs until a rule is added.
+void cgiCacheAddRule(const char* uri, int ttl_ms);
+void cgiCacheSetLimit(size_t bytes);
+size_t cgiCacheLimit(void);
+
+// Returns NULL when filename is not cached. Otherwise *leader is set when the
+// caller must run the program and hand its output to cgiCacheComplete; all
+// other callers wait with cgiCacheWait. Either way cgiCacheRelease follows.
+CgiEntry* cgiCacheAcquire(const char* filename, const char* cgiargs, int* leader);
+void cgiCacheComplete(CgiEntry* e, char* data, size_t size, int ok);
+void cgiCacheWait(CgiEntry* e);
+void cgiCacheRelease(CgiEntry* e);
+
+#endif
@@ -0,0 +1,60 @@
+//
+// clock.c: Calibrates the TSC against CLOCK_MONOTONIC.
+//
+
+#include "segel.h"
+#include "clock.h"
+
+int clock_use_tsc = 0;
+static uint64_t ns_mult;   // ns per tick, 32.32 fixed point
+
+static int tscIsInvariant(void) {
+    FILE* f = fopen("/proc/cpuinfo", "r");
+    char line[MAXLINE];
+    int constant = 0, nonstop = 0;
+
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "flags", 5) == 0) {
+            constant = strstr(line, " constant_tsc") != NULL;
+            nonstop = strstr(line, " nonstop_tsc") != NULL;
+            break;
+        }
+    }
+    fclose(f);
+    return constant && nonstop;
+}
+
+void clockInit(void) {
+#if defined(__x86_64__)
+    struct timespec t0, t1, pause = { 0, 20000000 };
+    uint64_t c0, c1, ns;
+
+    if (!tscIsInvariant()) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    c0 = __rdtsc();
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    c1 = __rdtsc();
+
+    ns = (t1.tv_sec - t0.tv_sec) * 1000000000ull + (t1.tv_nsec - t0.tv_nsec);
+    if (c1 <= c0 || ns == 0) {
+        return;
+    }
+    ns_mult = (uint64_t)(((unsigned __int128)ns << 32) / (c1 - c0));
+    clock_use_tsc = 1;
+#endif
+}
+
+uint64_t clockToNs(uint64_t ticks) {
+#if defined(__x86_64__)
+    if (clock_use_tsc) {
+        return (uint64_t)(((unsigned __int128)ticks * ns_mult) >> 32);
+    }
+#endif
+    return ticks;
+}
@@ -0,0 +1,28 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+// Monotonic timebase for request tracing. Uses the TSC when the CPU reports
+// an invariant one (calibrated once in clockInit), CLOCK_MONOTONIC otherwise.
+extern int clock_use_tsc;
+
+void clockInit(void);
+uint64_t clockToNs(uint64_t ticks);
+
+static inline uint64_t clockNow(void) {
+#if defined(__x86_64__)
+    if (clock_use_tsc) {
+        return __rdtsc();
+    }
+#endif
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,229 @@
+//
+// coro.c: M:N worker mode. Each worker is a stackful coroutine (ucontext);
+// a few OS threads each run an epoll loop that resumes coroutines whose
+// descriptor became ready.
+//
+// Queue wake-ups go through an eventfd in semaphore mode: every regular
+// enqueue adds one token, and a scheduler with an idle worker takes one
+// token per worker it wakes. Tokens for requests that were dropped or taken
+// by a busy worker just cause a spurious dequeue of an empty queue.
+//
+
+#include "segel.h"
+#include "coro.h"
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#define CORO_EVENTS 64
+
+typedef struct Coroutine {
+    ucontext_t ctx;
+    struct Scheduler* sched;
+    threads_stats t_stats;
+    void* stack;
+    size_t stack_size;
+    int idle;                    // Parked waiting for a queue token
+    struct Coroutine* next;      // Run queue / idle list link
+} Coroutine;
+
+typedef struct Scheduler {
+    ucontext_t ctx;
+    int epfd;
+    Coroutine* run_head;
+    Coroutine* run_tail;
+    Coroutine* idle;             // Workers waiting for requests
+    int queue_armed;             // notify fd currently in the epoll set
+    Coroutine** workers;
+    int nworkers;
+} Scheduler;
+
+static Queue* queue;
+static CoroServeFn serve_fn;
+static __thread Scheduler* current_sched;
+static __thread Coroutine* current_coro;
+
+static void makeRunnable(Scheduler* s, Coroutine* c) {
+    c->next = NULL;
+    if (s->run_tail) {
+        s->run_tail->next = c;
+    }
+    else {
+        s->run_head = c;
+    }
+    s->run_tail = c;
+}
+
+// Switches back to the scheduler; the caller arranged to be resumed
+static void coroSuspend(void) {
+    Coroutine* c = current_coro;
+    swapcontext(&c->ctx, &c->sched->ctx);
+}
+
+static int coroWaitFd(int fd, short events) {
+    Coroutine* c = current_coro;
+    struct epoll_event ev;
+
+    if (c == NULL) {
+        return rio_poll(fd, events);     // Acceptor, VIP and session threads
+    }
+
+    ev.events = EPOLLONESHOT | ((events & POLLIN) ? EPOLLIN | EPOLLRDHUP : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if (epoll_ctl(c->sched->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        if (errno != ENOENT || epoll_ctl(c->sched->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            return -1;
+        }
+    }
+    coroSuspend();
+    return 0;
+}
+
+pid_t coroWaitChild(pid_t pid, int* status) {
+    pid_t rc;
+
+    if (current_coro != NULL) {
+        int pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (pidfd >= 0) {
+            coroWaitFd(pidfd, POLLIN);
+            close(pidfd);
+        }
+    }
+    while ((rc = waitpid(pid, status, 0)) < 0 && errno == EINTR)
+        ;
+    return rc;
+}
+
+static void coroWorker(unsigned int lo, unsigned int hi) {
+    Coroutine* c = (Coroutine*)(((uintptr_t)hi << 32) | lo);
+
+    while (1) {
+        Request req = dequeue(queue, 0);
+        if (req.connfd < 0) {
+            c->idle = 1;
+            c->next = c->sched->idle;
+            c->sched->idle = c;
+            coroSuspend();
+            continue;
+        }
+        fcntl(req.connfd, F_SETFL, fcntl(req.connfd, F_GETFL) | O_NONBLOCK);
+        serve_fn(&req, c->t_stats);
+    }
+}
+
+static Coroutine* coroCreate(Scheduler* s, int id, size_t stack_size) {
+    Coroutine* c = calloc(1, sizeof(Coroutine));
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (c == NULL) {
+        exit(1);
+    }
+    c->sched = s;
+    c->t_stats = statsSlot(id, id);
+    c->stack_size = stack_size + page;
+    c->stack = mmap(NULL, c->stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (c->stack == MAP_FAILED) {
+        unix_error("Coroutine stack error");
+    }
+    mprotect(c->stack, page, PROT_NONE);     // Guard page
+
+    getcontext(&c->ctx);
+    c->ctx.uc_stack.ss_sp = (char*)c->stack + page;
+    c->ctx.uc_stack.ss_size = stack_size;
+    c->ctx.uc_link = NULL;
+    makecontext(&c->ctx, (void (*)(void))coroWorker, 2,
+                (unsigned int)(uintptr_t)c, (unsigned int)((uintptr_t)c >> 32));
+    return c;
+}
+
+static void armQueue(Scheduler* s, int want) {
+    struct epoll_event ev = { EPOLLIN, { .ptr = NULL } };
+
+    if (want == s->queue_armed) {
+        return;
+    }
+    epoll_ctl(s->epfd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, queue->notify_fd, &ev);
+    s->queue_armed = want;
+}
+
+static void* schedulerLoop(void* arg) {
+    Scheduler* s = (Scheduler*)arg;
+    struct epoll_event events[CORO_EVENTS];
+
+    current_sched = s;
+    for (int i = 0; i < s->nworkers; i++) {
+        makeRunnable(s, s->workers[i]);
+    }
+
+    while (1) {
+        while (s->run_head != NULL) {
+            Coroutine* c = s->run_head;
+            s->run_head = c->next;
+            if (s->run_head == NULL) {
+                s->run_tail = NULL;
+            }
+            current_coro = c;
+            swapcontext(&s->ctx, &c->ctx);
+            current_coro = NULL;
+        }
+
+        armQueue(s, s->idle != NULL);
+        int n = epoll_wait(s->epfd, events, CORO_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            Coroutine* c = events[i].data.ptr;
+            if (c != NULL) {
+                makeRunnable(s, c);
+                continue;
+            }
+            // Queue tokens: wake one idle worker per token
+            uint64_t token;
+            while (s->idle != NULL && read(queue->notify_fd, &token, sizeof(token)) == sizeof(token)) {
+                Coroutine* w = s->idle;
+                s->idle = w->next;
+                w->idle = 0;
+                makeRunnable(s, w);
+            }
+        }
+    }
+    return NULL;
+}
+
+void coroStart(Queue* q, int nsched, int nworkers, size_t stack_size, CoroServeFn serve) {
+    pthread_t tid;
+
+    queue = q;
+    serve_fn = serve;
+    q->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
+    if (q->notify_fd < 0) {
+        unix_error("eventfd error");
+    }
+    rio_set_wait_hook(coroWaitFd);
+
+    if (nsched < 1) nsched = 1;
+    if (nsched > nworkers) nsched = nworkers;
+
+    for (int i = 0, next_id = 0; i < nsched; i++) {
+        Scheduler* s = calloc(1, sizeof(Scheduler));
+        if (s == NULL) {
+            exit(1);
+        }
+        s->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (s->epfd < 0) {
+            unix_error("epoll_create error");
+        }
+        // Spread workers as evenly as possible
+        s->nworkers = nworkers / nsched + (i < nworkers % nsched);
+        s->workers = malloc(sizeof(Coroutine*) * s->nworkers);
+        if (s->workers == NULL) {
+            exit(1);
+        }
+        for (int w = 0; w < s->nworkers; w++) {
+            s->workers[w] = coroCreate(s, next_id++, stack_size);
+        }
+        if (pthread_create(&tid, NULL, schedulerLoop, s) != 0) {
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "queue.h"
+#include "stats.h"
+
+// Serves one dequeued request to completion (dequeue stamp to access log)
+typedef void (*CoroServeFn)(Request* req, threads_stats t_stats);
+
+// Runs nworkers worker coroutines, each with its own stats slot and a stack of
+// stack_size bytes, over nsched OS threads. Sockets are switched to
+// non-blocking mode and would-block I/O yields to an epoll scheduler.
+void coroStart(Queue* q, int nsched, int nworkers, size_t stack_size, CoroServeFn serve);
+
+// Waits for a child without blocking the OS thread when run in a coroutine;
+// status as for waitpid (may be NULL)
+pid_t coroWaitChild(pid_t pid, int* status);
+
+#endif
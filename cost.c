@@ -0,0 +1,94 @@
+//
+// cost.c: Service time estimates for the shortest-job-first queue.
+//
+// Static requests are priced by file size. A CGI request is priced by its
+// numeric query string, which output.cgi takes as seconds to run, or else
+// by a running average of that program's recent run times. The averages
+// live in a small hash table updated with relaxed atomics; a lost update
+// only makes an estimate a little staler.
+//
+
+#include "segel.h"
+#include "request.h"
+#include "cost.h"
+#include <stdatomic.h>
+
+#define COST_SLOTS 256               // Power of two
+#define COST_EWMA_SHIFT 2            // New samples weigh 1/4
+
+typedef struct CostSlot {
+    atomic_uint hash;                // 0 = empty
+    atomic_ulong avg_us;
+} CostSlot;
+
+static CostSlot slots[COST_SLOTS];
+
+static unsigned int hashName(const char* s) {
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h ? h : 1;
+}
+
+static unsigned long costStatic(const char* filename) {
+    const BundleEntry* packed = bundleLookup(filename);
+    CacheEntry* e = cacheLookup(filename);
+    struct stat sbuf;
+    size_t size = 0;
+
+    if (packed != NULL) {
+        size = packed->size;
+    }
+    else if (e != NULL) {
+        size = e->size;
+    }
+    else if (stat(filename, &sbuf) == 0) {
+        size = sbuf.st_size;
+    }
+    return COST_STATIC_US + size / COST_BYTES_PER_US;
+}
+
+static unsigned long costDynamic(const char* filename, const char* cgiargs) {
+    char* end;
+    double seconds = strtod(cgiargs, &end);
+
+    if (end != cgiargs && *end == '\0' && seconds >= 0) {
+        return seconds * 1e6 < COST_MAX_US ? (unsigned long)(seconds * 1e6) + 1 : COST_MAX_US;
+    }
+
+    unsigned int h = hashName(filename);
+    CostSlot* slot = &slots[h & (COST_SLOTS - 1)];
+    if (atomic_load_explicit(&slot->hash, memory_order_relaxed) == h) {
+        return atomic_load_explicit(&slot->avg_us, memory_order_relaxed);
+    }
+    return COST_DYNAMIC_US;
+}
+
+unsigned long costEstimate(const char* request_line) {
+    char method[16], uri[MAXLINE], filename[MAXLINE + 16], cgiargs[MAXLINE];
+
+    if (sscanf(request_line, "%15s %8191s", method, uri) != 2) {
+        return COST_STATIC_US;
+    }
+    // Classified the way requestServe will
+    int is_static = isStaticRequest(uri);
+    requestParseURI(uri, filename, cgiargs);
+    return is_static ? costStatic(filename) : costDynamic(filename, cgiargs);
+}
+
+void costObserve(const char* filename, uint64_t service_ns) {
+    unsigned int h = hashName(filename);
+    CostSlot* slot = &slots[h & (COST_SLOTS - 1)];
+    unsigned long sample = service_ns / 1000 + 1;
+
+    if (atomic_load_explicit(&slot->hash, memory_order_relaxed) != h) {
+        // Empty, or another program's: the newer one takes it over
+        atomic_store_explicit(&slot->avg_us, sample, memory_order_relaxed);
+        atomic_store_explicit(&slot->hash, h, memory_order_relaxed);
+        return;
+    }
+    long avg = atomic_load_explicit(&slot->avg_us, memory_order_relaxed);
+    avg += ((long)sample - avg) >> COST_EWMA_SHIFT;
+    atomic_store_explicit(&slot->avg_us, avg > 0 ? avg : 1, memory_order_relaxed);
+}
@@ -0,0 +1,19 @@
+#ifndef COST_H
+#define COST_H
+
+#include <stdint.h>
+
+// Service time estimates, in microseconds, that order the queue under
+// shortest-job-first and count against its cost capacity
+#define COST_STATIC_US 50            // Fixed part of a static request
+#define COST_BYTES_PER_US 1000       // Transfer rate assumed for static files
+#define COST_DYNAMIC_US 100000       // CGI program not seen yet
+#define COST_MAX_US 60000000ul
+
+// Estimates the cost of the request whose request line is given
+unsigned long costEstimate(const char* request_line);
+
+// Feeds back how long a CGI program actually took
+void costObserve(const char* filename, uint64_t service_ns);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef FILETYPE_H
+#define FILETYPE_H
+
+#include <string.h>
+
+// Content type by file name, shared by the server and ./pack
+static inline const char* filetypeOf(const char* filename) {
+    if (strstr(filename, ".html"))
+        return "text/html";
+    else if (strstr(filename, ".gif"))
+        return "image/gif";
+    else if (strstr(filename, ".jpg"))
+        return "image/jpeg";
+    else
+        return "text/plain";
+}
+
+#endif
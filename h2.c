@@ -0,0 +1,1068 @@
+//
+// h2.c: Cleartext HTTP/2 (h2c) front end.
+//
+// Each HTTP/2 connection gets a session thread that owns the socket. Streams
+// are not served in the session: every request is rewritten as HTTP/1.0 onto
+// a socketpair whose other end is queued like a freshly accepted connection,
+// so static files, the caches, CGI and /metrics all work unchanged and streams
+// run concurrently on the workers. The session reads each stream's HTTP/1.0
+// response back, turns the head into a HEADERS frame and the rest into DATA
+// frames within the peer's flow-control windows. Frames produced in one pass
+// over the streams go out with a single gather write. Request bodies take
+// the opposite way: DATA is written into the socketpair after the request
+// head, and the client's stream window is only credited for what the
+// worker has taken.
+//
+
+#include "segel.h"
+#include "h2.h"
+#include "hpack.h"
+#include "metrics.h"
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <ctype.h>
+
+#define H2_MAX_STREAMS 100      // SETTINGS_MAX_CONCURRENT_STREAMS we advertise
+#define H2_MAX_FRAME 16384      // Largest frame sent or accepted
+#define H2_FRAME_HEADER 9
+#define H2_HEAD_MAX 8192        // Response head read back from a worker
+#define H2_REQUEST_MAX 8192     // Request rewritten as HTTP/1.0
+#define H2_IOV 64
+#define H2_SCRATCH 65536        // Copied frame bytes awaiting the gather write
+#define H2_INPUT (64 * 1024 + H2_MAX_FRAME + H2_FRAME_HEADER)
+#define H2_DEFAULT_WINDOW 65535
+
+#define H2_CLIENT_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+enum { H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS, H2_PUSH_PROMISE,
+       H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION };
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+enum { H2_NO_ERROR, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR,
+       H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM,
+       H2_CANCEL, H2_COMPRESSION_ERROR, H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM };
+
+enum { H2_SETTINGS_HEADER_TABLE_SIZE = 1, H2_SETTINGS_ENABLE_PUSH, H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+       H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_SETTINGS_MAX_FRAME_SIZE, H2_SETTINGS_MAX_HEADER_LIST_SIZE };
+
+typedef struct H2Stream {
+    uint32_t id;
+    int fd;                 // Session end of the socketpair
+    int64_t window;         // Send window
+    int head_sent;          // HEADERS emitted for the response
+    int eof;                // Worker closed its end
+    int reset;              // Client gave up: drain the worker, send nothing
+    int done;               // Finished, freed after the next flush
+    char* head;             // Response head until the blank line
+    size_t head_len;
+    uint8_t* chunk;         // Response bytes not yet sent as DATA
+    size_t chunk_off, chunk_len;
+    uint8_t* body;          // Request body the socketpair has not taken yet
+    size_t body_len;
+    int body_end;           // Client sent END_STREAM: 1, then 2 once the worker was told
+} H2Stream;
+
+typedef struct H2Session {
+    int fd;
+    uint8_t* in;
+    size_t in_len;
+    size_t preface_seen;    // Bytes of the client preface matched so far
+    HpackTable decoder;
+    HpackTable encoder;
+    int encoder_resized;    // Size update owed at the start of the next block
+    H2Stream streams[H2_MAX_STREAMS];
+    int nstreams;
+    uint32_t last_stream;   // Highest stream id the client opened
+    int64_t window;         // Connection send window
+    int64_t initial_window; // Peer's SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t max_frame;     // Largest frame the peer accepts (capped at ours)
+    uint8_t* block;         // Header block being assembled from HEADERS + CONTINUATION
+    size_t block_len;
+    uint32_t block_stream;
+    int block_end;          // The HEADERS frame carried END_STREAM
+    int client_closed;      // EOF or a failed write: nothing more to send
+    int failed;             // We sent GOAWAY for an error: stop reading
+    int goaway;             // GOAWAY sent or received: no new streams
+    struct iovec iov[H2_IOV];
+    int niov;
+    uint8_t scratch[H2_SCRATCH];
+    size_t scratch_len;
+} H2Session;
+
+// Request fields collected while decoding a header block
+typedef struct H2Request {
+    char* method;
+    char* path;
+    char* authority;
+    char headers[H2_REQUEST_MAX];
+    size_t len;
+    int overflow;
+} H2Request;
+
+static H2Submit submit;
+static atomic_int sessions;     // Session threads running
+
+void h2Init(H2Submit fn) {
+    submit = fn;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**********************************
+ * Output
+ **********************************/
+
+static void outFlush(H2Session* s) {
+    struct msghdr msg = { 0 };
+    struct iovec* iov = s->iov;
+    int niov = s->niov;
+
+    // sendmsg is writev with MSG_NOSIGNAL: a vanished client must not raise SIGPIPE
+    while (niov > 0 && !s->client_closed) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+        ssize_t n = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            metricsIoError(IO_WRITE, errno);
+            s->client_closed = 1;
+            break;
+        }
+        while (niov > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    s->niov = 0;
+    s->scratch_len = 0;
+}
+
+// Room for len copied bytes, merged into the last iovec when contiguous
+static uint8_t* outReserve(H2Session* s, size_t len) {
+    if (s->scratch_len + len > H2_SCRATCH || s->niov + 2 > H2_IOV) {
+        outFlush(s);
+    }
+    uint8_t* p = s->scratch + s->scratch_len;
+    struct iovec* last = s->niov > 0 ? &s->iov[s->niov - 1] : NULL;
+    if (last != NULL && (uint8_t*)last->iov_base + last->iov_len == p) {
+        last->iov_len += len;
+    }
+    else {
+        s->iov[s->niov].iov_base = p;
+        s->iov[s->niov].iov_len = len;
+        s->niov++;
+    }
+    s->scratch_len += len;
+    return p;
+}
+
+static void outFrameHeader(uint8_t* p, size_t len, int type, int flags, uint32_t stream) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, stream & 0x7fffffff);
+}
+
+static void outFrame(H2Session* s, int type, int flags, uint32_t stream, const void* payload, size_t len) {
+    uint8_t* p = outReserve(s, H2_FRAME_HEADER + len);
+    outFrameHeader(p, len, type, flags, stream);
+    if (len > 0) {
+        memcpy(p + H2_FRAME_HEADER, payload, len);
+    }
+}
+
+// DATA payload is referenced, not copied: it must stay put until the flush
+static void outData(H2Session* s, uint32_t stream, const uint8_t* data, size_t len, int flags) {
+    outFrameHeader(outReserve(s, H2_FRAME_HEADER), len, H2_DATA, flags, stream);
+    if (len > 0) {
+        s->iov[s->niov].iov_base = (void*)data;
+        s->iov[s->niov].iov_len = len;
+        s->niov++;
+    }
+}
+
+static void outRstStream(H2Session* s, uint32_t stream, uint32_t code) {
+    uint8_t payload[4];
+    put32(payload, code);
+    outFrame(s, H2_RST_STREAM, 0, stream, payload, sizeof(payload));
+}
+
+static void outWindowUpdate(H2Session* s, uint32_t stream, uint32_t increment) {
+    uint8_t payload[4];
+    put32(payload, increment);
+    outFrame(s, H2_WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+static void outGoaway(H2Session* s, uint32_t code) {
+    uint8_t payload[8];
+    put32(payload, s->last_stream);
+    put32(payload + 4, code);
+    outFrame(s, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    s->goaway = 1;
+}
+
+/**********************************
+ * Streams
+ **********************************/
+
+static H2Stream* streamFind(H2Session* s, uint32_t id) {
+    for (int i = 0; i < s->nstreams; i++) {
+        if (s->streams[i].id == id && !s->streams[i].done) {
+            return &s->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static void streamFinish(H2Stream* st) {
+    if (st->fd >= 0) {
+        close(st->fd);
+        st->fd = -1;
+    }
+    st->done = 1;
+}
+
+// The client no longer wants the response; keep reading so the worker is
+// never stuck writing to (or signalled by) a closed socketpair, nor waiting
+// for body bytes that will not come
+static void streamReset(H2Stream* st) {
+    st->reset = 1;
+    st->chunk_len = 0;
+    st->body_len = 0;
+    if (st->fd >= 0 && st->body_end != 2) {
+        shutdown(st->fd, SHUT_WR);
+        st->body_end = 2;
+    }
+    if (st->eof) {
+        streamFinish(st);
+    }
+}
+
+// Drops finished streams; only after a flush, DATA frames point into chunks
+static void streamsCompact(H2Session* s) {
+    int kept = 0;
+    for (int i = 0; i < s->nstreams; i++) {
+        H2Stream* st = &s->streams[i];
+        if (st->done) {
+            free(st->head);
+            free(st->chunk);
+            free(st->body);
+            continue;
+        }
+        s->streams[kept++] = *st;
+    }
+    s->nstreams = kept;
+}
+
+//
+// Passes request body bytes on as the socketpair takes them, crediting the
+// client's stream window for exactly those. Only the window bounds what
+// waits here, so a worker slow to read cannot make the session block.
+//
+static void streamWriteBody(H2Session* s, H2Stream* st) {
+    while (st->body_len > 0) {
+        ssize_t n = send(st->fd, st->body, st->body_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n < 0) {
+            // The worker is done with the request, whatever the client sends
+            st->body_len = 0;
+            break;
+        }
+        memmove(st->body, st->body + n, st->body_len - n);
+        st->body_len -= n;
+        if (!st->body_end) {
+            outWindowUpdate(s, st->id, n);
+        }
+    }
+    if (st->body_end == 1) {
+        shutdown(st->fd, SHUT_WR);
+        st->body_end = 2;
+    }
+}
+
+//
+// Queues the stream as an HTTP/1.0 connection for the workers. With
+// end_stream the request has no body; otherwise DATA frames follow.
+//
+static void streamOpen(H2Session* s, uint32_t id, const char* request, size_t len, int end_stream) {
+    H2Stream* st;
+    int sv[2];
+
+    if (s->nstreams == H2_MAX_STREAMS) {
+        outRstStream(s, id, H2_REFUSED_STREAM);
+        return;
+    }
+    char* head = malloc(H2_HEAD_MAX);
+    uint8_t* chunk = malloc(H2_MAX_FRAME);
+    if (head == NULL || chunk == NULL) {
+        metricsIoError(IO_READ, ENOMEM);
+        free(head);
+        free(chunk);
+        outRstStream(s, id, H2_REFUSED_STREAM);
+        return;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        metricsIoError(IO_ACCEPT, errno);
+        free(head);
+        free(chunk);
+        outRstStream(s, id, H2_REFUSED_STREAM);
+        return;
+    }
+    // Like accepted sockets, so big responses go through the writer thread
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    if (write(sv[0], request, len) != (ssize_t)len) {
+        close(sv[0]);
+        close(sv[1]);
+        free(head);
+        free(chunk);
+        outRstStream(s, id, H2_INTERNAL_ERROR);
+        return;
+    }
+
+    st = &s->streams[s->nstreams++];
+    memset(st, 0, sizeof(*st));
+    st->id = id;
+    st->fd = sv[0];
+    st->window = s->initial_window;
+    st->body_end = end_stream;
+    st->head = head;
+    st->chunk = chunk;
+
+    Request req = { .connfd = sv[1] };
+    traceStamp(&req.trace, STAGE_ACCEPT);
+    requestClassifyLine(request, &req);
+    traceStamp(&req.trace, STAGE_CLASSIFY);
+    traceStamp(&req.trace, STAGE_ENQUEUE);
+    // Never waits for room: the session (or, for an upgrade, the worker
+    // running h2Start) is what drains the queue. A dropped request closes
+    // sv[1]; the stream then sees EOF and is refused.
+    if (submit(&req) < 0) {
+        close(sv[1]);
+        free(st->head);
+        free(st->chunk);
+        close(st->fd);
+        s->nstreams--;
+        outRstStream(s, id, H2_REFUSED_STREAM);
+        return;
+    }
+    streamWriteBody(s, st);
+}
+
+static void streamSendHeaders(H2Session* s, H2Stream* st) {
+    uint8_t block[H2_HEAD_MAX + 64];
+    size_t len = 0;
+    char* save, * line;
+    int n;
+
+    if (s->encoder_resized) {
+        len += hpackEncodeSizeUpdate(block, sizeof(block), s->encoder.max_size);
+        s->encoder_resized = 0;
+    }
+
+    // "HTTP/1.0 200 OK" becomes :status, the header lines follow lower-cased
+    line = strtok_r(st->head, "\r\n", &save);
+    char* status = line ? strchr(line, ' ') : NULL;
+    char code[4] = "502";
+    if (status != NULL && strlen(status + 1) >= 3) {
+        memcpy(code, status + 1, 3);
+    }
+    n = hpackEncode(&s->encoder, block + len, sizeof(block) - len, ":status", code, 0);
+    len += n > 0 ? n : 0;
+
+    while ((line = strtok_r(NULL, "\r\n", &save)) != NULL) {
+        char* value = strchr(line, ':');
+        if (value == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+        value += strspn(value, " \t");
+        for (char* c = line; *c; c++) {
+            *c = tolower((unsigned char)*c);
+        }
+        // Connection-specific fields are not allowed in HTTP/2 (8.1.2.2)
+        if (strcmp(line, "connection") == 0 || strcmp(line, "keep-alive") == 0 ||
+            strcmp(line, "transfer-encoding") == 0 || strcmp(line, "upgrade") == 0) {
+            continue;
+        }
+        int index = strcmp(line, "server") == 0 || strcmp(line, "content-type") == 0;
+        n = hpackEncode(&s->encoder, block + len, sizeof(block) - len, line, value, index);
+        if (n < 0) {
+            break;
+        }
+        len += n;
+    }
+
+    outFrame(s, H2_HEADERS, H2_FLAG_END_HEADERS, st->id, block, len);
+    st->head_sent = 1;
+}
+
+// Sends buffered response bytes as far as the windows allow
+static void streamSend(H2Session* s, H2Stream* st) {
+    while (st->chunk_len > 0 && st->window > 0 && s->window > 0) {
+        size_t n = st->chunk_len;
+        if (n > (size_t)st->window) n = st->window;
+        if (n > (size_t)s->window) n = s->window;
+        if (n > s->max_frame) n = s->max_frame;
+        outData(s, st->id, st->chunk + st->chunk_off, n, 0);
+        st->chunk_off += n;
+        st->chunk_len -= n;
+        st->window -= n;
+        s->window -= n;
+    }
+    if (st->eof && st->chunk_len == 0 && !st->done) {
+        outData(s, st->id, NULL, 0, H2_FLAG_END_STREAM);
+        streamFinish(st);
+    }
+}
+
+static void streamRead(H2Session* s, H2Stream* st) {
+    ssize_t n;
+
+    if (st->reset) {
+        if ((n = read(st->fd, st->chunk, H2_MAX_FRAME)) <= 0) {
+            st->eof = 1;
+            streamFinish(st);
+        }
+        return;
+    }
+
+    if (!st->head_sent) {
+        n = read(st->fd, st->head + st->head_len, H2_HEAD_MAX - 1 - st->head_len);
+        if (n <= 0) {
+            // Nothing at all means the queue dropped the request
+            outRstStream(s, st->id, st->head_len == 0 ? H2_REFUSED_STREAM : H2_INTERNAL_ERROR);
+            st->eof = 1;
+            streamFinish(st);
+            return;
+        }
+        st->head_len += n;
+        st->head[st->head_len] = '\0';
+        char* end = strstr(st->head, "\r\n\r\n");
+        size_t skip = 4;
+        if (end == NULL && (end = strstr(st->head, "\n\n")) != NULL) {
+            skip = 2;
+        }
+        if (end == NULL) {
+            if (st->head_len == H2_HEAD_MAX - 1) {
+                outRstStream(s, st->id, H2_INTERNAL_ERROR);
+                streamReset(st);
+            }
+            return;
+        }
+        // Body bytes read along with the head become the first DATA
+        size_t body = st->head + st->head_len - (end + skip);
+        memcpy(st->chunk, end + skip, body);
+        st->chunk_off = 0;
+        st->chunk_len = body;
+        end[2] = '\0';
+        streamSendHeaders(s, st);
+        streamSend(s, st);
+        return;
+    }
+
+    size_t cap = H2_MAX_FRAME;
+    if (cap > (size_t)st->window) cap = st->window;
+    if (cap > (size_t)s->window) cap = s->window;
+    st->chunk_off = 0;
+    n = read(st->fd, st->chunk, cap);
+    if (n <= 0) {
+        st->eof = 1;
+    }
+    else {
+        st->chunk_len = n;
+    }
+    streamSend(s, st);
+}
+
+/**********************************
+ * Input
+ **********************************/
+
+static void collectField(void* arg, const char* name, size_t name_len, const char* value, size_t value_len) {
+    H2Request* r = (H2Request*)arg;
+
+    if (name_len > 0 && name[0] == ':') {
+        char** slot = NULL;
+        if (name_len == 7 && memcmp(name, ":method", 7) == 0) slot = &r->method;
+        else if (name_len == 5 && memcmp(name, ":path", 5) == 0) slot = &r->path;
+        else if (name_len == 10 && memcmp(name, ":authority", 10) == 0) slot = &r->authority;
+        if (slot != NULL && *slot == NULL) {
+            *slot = strndup(value, value_len);
+        }
+        return;
+    }
+    // Connection-specific fields are not allowed (8.1.2.2); a chunked
+    // Transfer-Encoding would also have the worker parse DATA as chunks
+    if ((name_len == 10 && memcmp(name, "connection", 10) == 0) ||
+        (name_len == 10 && memcmp(name, "keep-alive", 10) == 0) ||
+        (name_len == 17 && memcmp(name, "transfer-encoding", 17) == 0) ||
+        (name_len == 7 && memcmp(name, "upgrade", 7) == 0)) {
+        return;
+    }
+    if (r->len + name_len + value_len + 4 >= sizeof(r->headers)) {
+        r->overflow = 1;
+        return;
+    }
+    r->len += sprintf(r->headers + r->len, "%.*s: %.*s\r\n", (int)name_len, name, (int)value_len, value);
+}
+
+static int sessionHeaderBlock(H2Session* s) {
+    H2Request r;
+    char request[H2_REQUEST_MAX + 512];
+    uint32_t id = s->block_stream;
+    int rc = 0;
+
+    memset(&r, 0, sizeof(r));
+    if (hpackDecode(&s->decoder, s->block, s->block_len, collectField, &r) < 0) {
+        outGoaway(s, H2_COMPRESSION_ERROR);
+        rc = -1;
+    }
+    else if (id <= s->last_stream || s->goaway) {
+        // Trailers, or a stream we will not start: decoded only to keep HPACK state
+    }
+    else if (r.method == NULL || r.path == NULL || r.overflow) {
+        s->last_stream = id;
+        outRstStream(s, id, H2_PROTOCOL_ERROR);
+    }
+    else {
+        s->last_stream = id;
+        int len = snprintf(request, sizeof(request), "%s %s HTTP/1.0\r\n%s%s%s%s\r\n", r.method, r.path,
+                           r.authority ? "Host: " : "", r.authority ? r.authority : "", r.authority ? "\r\n" : "",
+                           r.headers);
+        if (len >= (int)sizeof(request)) {
+            outRstStream(s, id, H2_REFUSED_STREAM);
+        }
+        else {
+            streamOpen(s, id, request, len, s->block_end);
+        }
+    }
+    free(r.method);
+    free(r.path);
+    free(r.authority);
+    s->block_len = 0;
+    s->block_stream = 0;
+    return rc;
+}
+
+static int sessionSettings(H2Session* s, const uint8_t* p, size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t id = (p[i] << 8) | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+
+        switch (id) {
+        case H2_SETTINGS_HEADER_TABLE_SIZE:
+            if (value > HPACK_TABLE_SIZE) value = HPACK_TABLE_SIZE;
+            if (value != s->encoder.max_size) {
+                hpackResize(&s->encoder, value);
+                s->encoder_resized = 1;
+            }
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > 0x7fffffff) {
+                outGoaway(s, H2_FLOW_CONTROL_ERROR);
+                return -1;
+            }
+            for (int j = 0; j < s->nstreams; j++) {
+                s->streams[j].window += (int64_t)value - s->initial_window;
+            }
+            s->initial_window = value;
+            break;
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < 16384 || value > 0xffffff) {
+                outGoaway(s, H2_PROTOCOL_ERROR);
+                return -1;
+            }
+            s->max_frame = value < H2_MAX_FRAME ? value : H2_MAX_FRAME;
+            break;
+        default:
+            break;
+        }
+    }
+    return 0;
+}
+
+//
+// Handles one frame. Returns -1 once the connection has failed (GOAWAY sent).
+//
+static int sessionFrame(H2Session* s, int type, int flags, uint32_t stream, const uint8_t* p, size_t len) {
+    H2Stream* st;
+
+    if (s->block_stream != 0 && (type != H2_CONTINUATION || stream != s->block_stream)) {
+        outGoaway(s, H2_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    switch (type) {
+    case H2_DATA: {
+        size_t pad = 0;
+        if (stream == 0) {
+            outGoaway(s, H2_PROTOCOL_ERROR);
+            return -1;
+        }
+        if (flags & H2_FLAG_PADDED) {
+            if (len < 1 || (size_t)p[0] >= len) {
+                outGoaway(s, H2_PROTOCOL_ERROR);
+                return -1;
+            }
+            pad = 1 + p[0];
+        }
+        // The connection window is credited at once, a stream's padding too;
+        // the rest of a stream's window as its body reaches the worker
+        if (len > 0) {
+            outWindowUpdate(s, 0, len);
+        }
+        st = streamFind(s, stream);
+        if (st == NULL || st->reset || st->body_end) {
+            break;      // Nothing reads it any more
+        }
+        if (pad > 0 && !(flags & H2_FLAG_END_STREAM)) {
+            outWindowUpdate(s, stream, pad);
+        }
+        p += pad > 0 ? 1 : 0;
+        len -= pad;
+        if (st->body == NULL && len > 0 && (st->body = malloc(H2_DEFAULT_WINDOW)) == NULL) {
+            outRstStream(s, stream, H2_INTERNAL_ERROR);
+            streamReset(st);
+            break;
+        }
+        // Our window is the default one, which the body cannot outgrow
+        if (st->body_len + len > H2_DEFAULT_WINDOW) {
+            outRstStream(s, stream, H2_FLOW_CONTROL_ERROR);
+            streamReset(st);
+            break;
+        }
+        if (len > 0) {
+            memcpy(st->body + st->body_len, p, len);
+            st->body_len += len;
+        }
+        if (flags & H2_FLAG_END_STREAM) {
+            st->body_end = 1;
+        }
+        streamWriteBody(s, st);
+        break;
+    }
+
+    case H2_HEADERS:
+    case H2_CONTINUATION: {
+        size_t pad = 0;
+        if (stream == 0 || (type == H2_CONTINUATION && s->block_stream == 0)) {
+            outGoaway(s, H2_PROTOCOL_ERROR);
+            return -1;
+        }
+        if (type == H2_HEADERS) {
+            if (flags & H2_FLAG_PADDED) {
+                if (len < 1) break;
+                pad = p[0];
+                p++;
+                len--;
+            }
+            if (flags & H2_FLAG_PRIORITY) {
+                if (len < 5) break;
+                p += 5;
+                len -= 5;
+            }
+            if (pad > len) {
+                outGoaway(s, H2_PROTOCOL_ERROR);
+                return -1;
+            }
+            len -= pad;
+            s->block_stream = stream;
+            s->block_end = (flags & H2_FLAG_END_STREAM) != 0;
+        }
+        if (s->block_len + len > H2_REQUEST_MAX * 2) {
+            outGoaway(s, H2_ENHANCE_YOUR_CALM);
+            return -1;
+        }
+        uint8_t* block = realloc(s->block, s->block_len + len + 1);
+        if (block == NULL) {
+            // HPACK state is lost with the block, so the connection is too
+            metricsIoError(IO_READ, ENOMEM);
+            outGoaway(s, H2_INTERNAL_ERROR);
+            return -1;
+        }
+        s->block = block;
+        memcpy(s->block + s->block_len, p, len);
+        s->block_len += len;
+        if (flags & H2_FLAG_END_HEADERS) {
+            return sessionHeaderBlock(s);
+        }
+        break;
+    }
+
+    case H2_RST_STREAM:
+        if ((st = streamFind(s, stream)) != NULL) {
+            streamReset(st);
+        }
+        break;
+
+    case H2_SETTINGS:
+        if (flags & H2_FLAG_ACK) {
+            break;
+        }
+        if (len % 6 != 0) {
+            outGoaway(s, H2_FRAME_SIZE_ERROR);
+            return -1;
+        }
+        if (sessionSettings(s, p, len) < 0) {
+            return -1;
+        }
+        outFrame(s, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+        // A larger initial window may unblock streams
+        for (int i = 0; i < s->nstreams; i++) {
+            if (s->streams[i].head_sent && !s->streams[i].done && !s->streams[i].reset) {
+                streamSend(s, &s->streams[i]);
+            }
+        }
+        break;
+
+    case H2_PUSH_PROMISE:
+        outGoaway(s, H2_PROTOCOL_ERROR);
+        return -1;
+
+    case H2_PING:
+        if (len != 8) {
+            outGoaway(s, H2_FRAME_SIZE_ERROR);
+            return -1;
+        }
+        if (!(flags & H2_FLAG_ACK)) {
+            outFrame(s, H2_PING, H2_FLAG_ACK, 0, p, len);
+        }
+        break;
+
+    case H2_GOAWAY:
+        s->goaway = 1;
+        break;
+
+    case H2_WINDOW_UPDATE: {
+        if (len != 4) {
+            outGoaway(s, H2_FRAME_SIZE_ERROR);
+            return -1;
+        }
+        uint32_t increment = get32(p) & 0x7fffffff;
+        if (stream == 0) {
+            s->window += increment;
+            if (s->window > 0x7fffffff) {
+                outGoaway(s, H2_FLOW_CONTROL_ERROR);
+                return -1;
+            }
+            for (int i = 0; i < s->nstreams; i++) {
+                if (s->streams[i].head_sent && !s->streams[i].done && !s->streams[i].reset) {
+                    streamSend(s, &s->streams[i]);
+                }
+            }
+        }
+        else if ((st = streamFind(s, stream)) != NULL) {
+            st->window += increment;
+            if (st->head_sent && !st->reset) {
+                streamSend(s, st);
+            }
+        }
+        break;
+    }
+
+    default:
+        break;      // PRIORITY and unknown frame types are ignored
+    }
+    return 0;
+}
+
+// Consumes the preface and every complete frame in the input buffer
+static int sessionInput(H2Session* s) {
+    size_t off = 0;
+    int rc = 0;
+
+    while (s->preface_seen < sizeof(H2_CLIENT_PREFACE) - 1 && off < s->in_len) {
+        if (s->in[off++] != (uint8_t)H2_CLIENT_PREFACE[s->preface_seen++]) {
+            outGoaway(s, H2_PROTOCOL_ERROR);
+            return -1;
+        }
+    }
+
+    while (rc == 0 && s->in_len - off >= H2_FRAME_HEADER) {
+        const uint8_t* h = s->in + off;
+        size_t len = ((size_t)h[0] << 16) | (h[1] << 8) | h[2];
+        if (len > H2_MAX_FRAME) {
+            outGoaway(s, H2_FRAME_SIZE_ERROR);
+            return -1;
+        }
+        if (s->in_len - off < H2_FRAME_HEADER + len) {
+            break;
+        }
+        rc = sessionFrame(s, h[3], h[4], get32(h + 5) & 0x7fffffff, h + H2_FRAME_HEADER, len);
+        off += H2_FRAME_HEADER + len;
+    }
+    memmove(s->in, s->in + off, s->in_len - off);
+    s->in_len -= off;
+    return rc;
+}
+
+/**********************************
+ * Session
+ **********************************/
+
+// Stops reading the client and lets every stream drain
+static void sessionStop(H2Session* s) {
+    s->failed = 1;
+    for (int i = 0; i < s->nstreams; i++) {
+        streamReset(&s->streams[i]);
+    }
+}
+
+static void sessionFree(H2Session* s) {
+    for (int i = 0; i < s->nstreams; i++) {
+        if (s->streams[i].fd >= 0) close(s->streams[i].fd);
+        free(s->streams[i].head);
+        free(s->streams[i].chunk);
+        free(s->streams[i].body);
+    }
+    hpackFree(&s->decoder);
+    hpackFree(&s->encoder);
+    if (s->fd >= 0) close(s->fd);
+    free(s->block);
+    free(s->in);
+    free(s);
+    atomic_fetch_sub_explicit(&sessions, 1, memory_order_relaxed);
+}
+
+static void* sessionLoop(void* arg) {
+    H2Session* s = (H2Session*)arg;
+    struct pollfd pfds[H2_MAX_STREAMS + 1];
+    H2Stream* polled[H2_MAX_STREAMS + 1];
+
+    if (s->in_len > 0 && sessionInput(s) < 0) {
+        sessionStop(s);
+    }
+    outFlush(s);
+
+    while (1) {
+        int n = 0;
+        int reading_client = !s->client_closed && !s->failed && !(s->goaway && s->nstreams == 0);
+
+        if (!reading_client && s->nstreams == 0) {
+            break;
+        }
+        if (reading_client) {
+            pfds[n].fd = s->fd;
+            pfds[n].events = POLLIN;
+            polled[n++] = NULL;
+        }
+        for (int i = 0; i < s->nstreams; i++) {
+            H2Stream* st = &s->streams[i];
+            int want = st->reset || !st->head_sent ||
+                       (st->chunk_len == 0 && !st->eof && st->window > 0 && s->window > 0);
+            if (!st->done && (want || st->body_len > 0)) {
+                pfds[n].fd = st->fd;
+                pfds[n].events = (want ? POLLIN : 0) | (st->body_len > 0 ? POLLOUT : 0);
+                polled[n++] = st;
+            }
+        }
+        if (n == 0) {
+            // Only finished streams, or ones waiting for a WINDOW_UPDATE that cannot come
+            sessionStop(s);
+            streamsCompact(s);
+            continue;
+        }
+        if (poll(pfds, n, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (polled[i] != NULL && polled[i]->body_len > 0 && (pfds[i].revents & (POLLOUT | POLLHUP | POLLERR))) {
+                streamWriteBody(s, polled[i]);
+            }
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) || !(pfds[i].events & POLLIN)) {
+                continue;
+            }
+            if (polled[i] == NULL) {
+                ssize_t got = read(s->fd, s->in + s->in_len, H2_INPUT - s->in_len);
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (got <= 0) {
+                    s->client_closed = 1;
+                    sessionStop(s);
+                }
+                else {
+                    s->in_len += got;
+                    if (sessionInput(s) < 0) {
+                        sessionStop(s);
+                    }
+                }
+            }
+            else {
+                streamRead(s, polled[i]);
+            }
+        }
+
+        outFlush(s);
+        streamsCompact(s);
+    }
+
+    sessionFree(s);
+    return NULL;
+}
+
+// Decodes the base64url HTTP2-Settings header into a SETTINGS payload
+static size_t decodeSettingsHeader(const char* in, uint8_t* out, size_t cap) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+
+    for (; *in && n < cap; in++) {
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        const char* c = strchr(alphabet, *in);
+        if (*in == '=' || c == NULL) {
+            break;
+        }
+        acc = (acc << 6) | (c - alphabet);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+int h2Detect(RequestHead* head) {
+    char value[MAXLINE];
+
+    if (strcmp(head->method, H2_PREFACE_METHOD) == 0 && strcmp(head->uri, "*") == 0 &&
+        strcmp(head->version, H2_PREFACE_VERSION) == 0) {
+        return 1;
+    }
+    // Upgrades carry their request as stream 1, which has no way to pass a body here
+    if (requestGetHeader(head, "Upgrade", value, sizeof(value)) && strstr(value, "h2c") != NULL &&
+        requestGetHeader(head, "HTTP2-Settings", value, sizeof(value)) &&
+        !requestGetHeader(head, "Content-Length", value, sizeof(value)) &&
+        !requestGetHeader(head, "Transfer-Encoding", value, sizeof(value))) {
+        return 1;
+    }
+    return 0;
+}
+
+int h2Start(int fd, RequestHead* head, RequestTrace* trace) {
+    char request[H2_REQUEST_MAX], value[MAXLINE];
+    uint8_t settings[] = {
+        0, H2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS,
+    };
+    int upgrade = strcmp(head->method, H2_PREFACE_METHOD) != 0;
+    pthread_t tid;
+
+    // Every session is a thread holding a connection for as long as the
+    // client likes, so their number is capped
+    if (atomic_fetch_add_explicit(&sessions, 1, memory_order_relaxed) >= H2_MAX_SESSIONS) {
+        atomic_fetch_sub_explicit(&sessions, 1, memory_order_relaxed);
+        return -1;
+    }
+    H2Session* s = calloc(1, sizeof(H2Session));
+    if (s == NULL || (s->in = malloc(H2_INPUT)) == NULL || (s->fd = dup(fd)) < 0) {
+        // Nothing sent yet: the caller answers as it does over the cap
+        metricsIoError(IO_ACCEPT, s == NULL || s->in == NULL ? ENOMEM : errno);
+        if (s != NULL) {
+            free(s->in);
+            free(s);
+        }
+        atomic_fetch_sub_explicit(&sessions, 1, memory_order_relaxed);
+        return -1;
+    }
+    // The session blocks in poll and writes whole frames
+    fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) & ~O_NONBLOCK);
+    // Frames go out as soon as a stream has them, Nagle would hold them back
+    int one = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    hpackInit(&s->decoder, HPACK_TABLE_SIZE);
+    hpackInit(&s->encoder, HPACK_TABLE_SIZE);
+    s->window = H2_DEFAULT_WINDOW;
+    s->initial_window = H2_DEFAULT_WINDOW;
+    s->max_frame = H2_MAX_FRAME;
+
+    if (upgrade) {
+        static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        uint8_t payload[256];
+        if (requestGetHeader(head, "HTTP2-Settings", value, sizeof(value))) {
+            sessionSettings(s, payload, decodeSettingsHeader(value, payload, sizeof(payload)));
+        }
+        if (rio_writen(s->fd, (void*)switching, sizeof(switching) - 1) < 0) {
+            metricsIoError(IO_WRITE, errno);
+            s->client_closed = 1;
+        }
+        trace->status = 101;
+        trace->bytes = sizeof(switching) - 1;
+    }
+    else {
+        // The request line and empty line were the start of the preface
+        s->preface_seen = strlen("PRI * HTTP/2.0\r\n\r\n");
+        trace->status = 101;
+    }
+    outFrame(s, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+
+    if (upgrade) {
+        // The upgraded request is stream 1, half-closed by the client. Its
+        // hop-by-hop headers go, or the worker would see another upgrade.
+        int len = snprintf(request, sizeof(request), "%s %s HTTP/1.0\r\n", head->method, head->uri);
+        for (char* line = head->headers; len < (int)sizeof(request) && line != NULL && *line; ) {
+            char* eol = strchr(line, '\n');
+            int line_len = eol ? eol + 1 - line : (int)strlen(line);
+            if (strncasecmp(line, "Upgrade:", 8) != 0 && strncasecmp(line, "Connection:", 11) != 0 &&
+                strncasecmp(line, "HTTP2-Settings:", 15) != 0) {
+                len += snprintf(request + len, sizeof(request) - len, "%.*s", line_len, line);
+            }
+            line = eol ? eol + 1 : NULL;
+        }
+        if (len < (int)sizeof(request)) {
+            len += snprintf(request + len, sizeof(request) - len, "\r\n");
+        }
+        s->last_stream = 1;
+        if (len < (int)sizeof(request)) {
+            streamOpen(s, 1, request, len, 1);
+        }
+        else {
+            outRstStream(s, 1, H2_REFUSED_STREAM);
+        }
+    }
+
+    // Bytes that arrived with the head already belong to the session
+    size_t leftover = head->body_len < H2_INPUT ? head->body_len : H2_INPUT;
+    memcpy(s->in, head->body, leftover);
+    s->in_len = leftover;
+
+    if (pthread_create(&tid, NULL, sessionLoop, s) != 0) {
+        // Past the 101 there is no going back to HTTP/1: the client sees EOF
+        sessionFree(s);
+        return 0;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef H2_H
+#define H2_H
+
+#include "queue.h"
+#include "request.h"
+
+// Request line of the client connection preface (RFC 7540 3.5)
+#define H2_PREFACE_METHOD "PRI"
+#define H2_PREFACE_VERSION "HTTP/2.0"
+
+// Most HTTP/2 connections served at once, each has a session thread
+#define H2_MAX_SESSIONS 64
+
+// Queues a classified request for the workers without waiting: 1 if queued,
+// 0 if the overload policy dropped it (and closed it), -1 if the queue is full
+typedef int (*H2Submit)(Request* req);
+
+void h2Init(H2Submit fn);
+
+// Returns 1 if head opens an h2c connection: the prior-knowledge preface or
+// a bodiless request carrying "Upgrade: h2c"
+int h2Detect(RequestHead* head);
+
+// Hands the connection to an HTTP/2 session thread. Each stream is turned
+// into an HTTP/1.0 request on a socketpair and queued for the workers like
+// any other connection. fd is duplicated, the caller still closes its copy.
+// Returns -1, having sent nothing, when no session can be started (already
+// H2_MAX_SESSIONS, or out of memory or descriptors): the caller serves an
+// upgrade as plain HTTP/1.
+int h2Start(int fd, RequestHead* head, RequestTrace* trace);
+
+#endif
@@ -0,0 +1,484 @@
+//
+// hpack.c: HPACK header compression (RFC 7541) for the h2c front end.
+//
+// Decoding handles the full format, including Huffman coded strings. The
+// encoder emits raw strings and uses the dynamic table for fields that repeat
+// across responses (server, content-type).
+//
+
+#include "hpack.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define HPACK_ENTRY_OVERHEAD 32
+
+// RFC 7541 Appendix A
+static const HpackField hpack_static[HPACK_STATIC_COUNT] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// RFC 7541 Appendix B, symbol 256 (EOS) is only used for padding
+static const uint32_t huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t huffman_lengths[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+/**********************************
+ * Huffman decoding
+ **********************************/
+
+// Binary tree over the code bits; leaves hold -(symbol + 1)
+static int16_t huffman_tree[512][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffmanBuild(void) {
+    int nodes = 1;
+
+    for (int sym = 0; sym < 256; sym++) {
+        int node = 0;
+        for (int bit = huffman_lengths[sym] - 1; bit > 0; bit--) {
+            int b = (huffman_codes[sym] >> bit) & 1;
+            if (huffman_tree[node][b] == 0) {
+                huffman_tree[node][b] = nodes++;
+            }
+            node = huffman_tree[node][b];
+        }
+        huffman_tree[node][huffman_codes[sym] & 1] = -(sym + 1);
+    }
+}
+
+// Returns the decoded length, or -1 for invalid codes or padding
+static int huffmanDecode(const uint8_t* in, size_t len, char* out) {
+    int node = 0, depth = 0, all_ones = 1, n = 0;
+
+    pthread_once(&huffman_once, huffmanBuild);
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int b = (in[i] >> bit) & 1;
+            int next = huffman_tree[node][b];
+            all_ones &= b;
+            depth++;
+            if (next < 0) {
+                out[n++] = (char)(-next - 1);
+                node = depth = 0;
+                all_ones = 1;
+            }
+            else if (next == 0) {
+                return -1;      // EOS or a code that does not exist
+            }
+            else {
+                node = next;
+            }
+        }
+    }
+    // Leftover bits must be a prefix of EOS (all ones) and shorter than a byte
+    return depth < 8 && all_ones ? n : -1;
+}
+
+/**********************************
+ * Tables
+ **********************************/
+
+void hpackInit(HpackTable* t, size_t max_size) {
+    memset(t, 0, sizeof(*t));
+    t->max_size = max_size;
+}
+
+void hpackFree(HpackTable* t) {
+    for (int i = 0; i < t->count; i++) {
+        free(t->entries[i].name);
+        free(t->entries[i].value);
+    }
+    free(t->entries);
+    memset(t, 0, sizeof(*t));
+}
+
+static size_t entrySize(const HpackField* f) {
+    return strlen(f->name) + strlen(f->value) + HPACK_ENTRY_OVERHEAD;
+}
+
+static void evictTo(HpackTable* t, size_t max_size) {
+    while (t->count > 0 && t->size > max_size) {
+        HpackField* f = &t->entries[--t->count];
+        t->size -= entrySize(f);
+        free(f->name);
+        free(f->value);
+    }
+}
+
+void hpackResize(HpackTable* t, size_t max_size) {
+    t->max_size = max_size;
+    evictTo(t, max_size);
+}
+
+//
+// name may point into an entry this evicts (a literal with an indexed name),
+// so it is copied before anything is evicted
+//
+static void tableAdd(HpackTable* t, const char* name, size_t name_len, const char* value, size_t value_len) {
+    size_t size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+
+    if (size > t->max_size) {
+        evictTo(t, 0);          // Too big for the table: empties it (4.4)
+        return;
+    }
+    HpackField f = { strndup(name, name_len), strndup(value, value_len) };
+    if (f.name == NULL || f.value == NULL) {
+        free(f.name);
+        free(f.value);
+        return;
+    }
+    evictTo(t, t->max_size - size);
+    if (t->count == t->capacity) {
+        int capacity = t->capacity ? t->capacity * 2 : 16;
+        HpackField* entries = realloc(t->entries, sizeof(HpackField) * capacity);
+        if (entries == NULL) {
+            free(f.name);
+            free(f.value);
+            return;
+        }
+        t->entries = entries;
+        t->capacity = capacity;
+    }
+    memmove(t->entries + 1, t->entries, sizeof(HpackField) * t->count);
+    t->entries[0] = f;
+    t->count++;
+    t->size += size;
+}
+
+// Index 1..61 is the static table, the dynamic table follows newest first
+static const HpackField* tableGet(HpackTable* t, uint64_t index) {
+    if (index >= 1 && index <= HPACK_STATIC_COUNT) {
+        return &hpack_static[index - 1];
+    }
+    if (index > HPACK_STATIC_COUNT && index - HPACK_STATIC_COUNT <= (uint64_t)t->count) {
+        return &t->entries[index - HPACK_STATIC_COUNT - 1];
+    }
+    return NULL;
+}
+
+// Returns the index of name/value, or the negated index of a field with
+// that name only, or 0
+static int tableFind(HpackTable* t, const char* name, const char* value) {
+    int name_only = 0;
+
+    for (int i = 0; i < HPACK_STATIC_COUNT + t->count; i++) {
+        const HpackField* f = tableGet(t, i + 1);
+        if (strcmp(f->name, name) != 0) {
+            continue;
+        }
+        if (strcmp(f->value, value) == 0) {
+            return i + 1;
+        }
+        if (name_only == 0) {
+            name_only = -(i + 1);
+        }
+    }
+    return name_only;
+}
+
+/**********************************
+ * Decoding
+ **********************************/
+
+// Integer with an n-bit prefix (5.1)
+static int decodeInt(const uint8_t** p, const uint8_t* end, int prefix, uint64_t* value) {
+    uint64_t max = (1u << prefix) - 1;
+    int shift = 0;
+
+    if (*p >= end) {
+        return -1;
+    }
+    *value = *(*p)++ & max;
+    if (*value < max) {
+        return 0;
+    }
+    while (*p < end) {
+        uint8_t b = *(*p)++;
+        *value += (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return 0;
+        }
+        shift += 7;
+        if (shift > 28) {
+            break;
+        }
+    }
+    return -1;
+}
+
+// String literal (5.2), decoded into scratch when Huffman coded
+static int decodeString(const uint8_t** p, const uint8_t* end, char* scratch, const char** str, size_t* len) {
+    int huffman;
+    uint64_t n;
+
+    if (*p >= end) {
+        return -1;
+    }
+    huffman = **p & 0x80;
+    if (decodeInt(p, end, 7, &n) < 0 || n > (uint64_t)(end - *p)) {
+        return -1;
+    }
+    if (huffman) {
+        int decoded = huffmanDecode(*p, n, scratch);
+        if (decoded < 0) {
+            return -1;
+        }
+        *str = scratch;
+        *len = decoded;
+    }
+    else {
+        *str = (const char*)*p;
+        *len = n;
+    }
+    *p += n;
+    return 0;
+}
+
+int hpackDecode(HpackTable* t, const uint8_t* in, size_t len, HpackEmit emit, void* arg) {
+    const uint8_t* p = in, * end = in + len;
+    // Huffman codes are at least 5 bits, so a string grows by at most 8/5;
+    // names decode into the first half, values into the second
+    char* scratch = malloc(len * 4 + 2);
+    int rc = 0;
+
+    if (scratch == NULL) {
+        return -1;
+    }
+    while (p < end && rc == 0) {
+        const HpackField* f;
+        const char* name, * value;
+        size_t name_len, value_len;
+        uint64_t index;
+        uint8_t b = *p;
+
+        rc = -1;
+        if (b & 0x80) {
+            // Indexed field (6.1)
+            if (decodeInt(&p, end, 7, &index) < 0 || (f = tableGet(t, index)) == NULL) {
+                break;
+            }
+            emit(arg, f->name, strlen(f->name), f->value, strlen(f->value));
+            rc = 0;
+            continue;
+        }
+        if ((b & 0xe0) == 0x20) {
+            // Dynamic table size update (6.3)
+            if (decodeInt(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE) {
+                break;
+            }
+            hpackResize(t, index);
+            rc = 0;
+            continue;
+        }
+
+        // Literal, with incremental indexing (6.2.1) or without (6.2.2, 6.2.3)
+        int prefix = (b & 0x40) ? 6 : 4;
+        if (decodeInt(&p, end, prefix, &index) < 0) {
+            break;
+        }
+        if (index > 0) {
+            if ((f = tableGet(t, index)) == NULL) {
+                break;
+            }
+            name = f->name;
+            name_len = strlen(f->name);
+        }
+        else if (decodeString(&p, end, scratch, &name, &name_len) < 0) {
+            break;
+        }
+        if (decodeString(&p, end, scratch + len * 2 + 1, &value, &value_len) < 0) {
+            break;
+        }
+        emit(arg, name, name_len, value, value_len);
+        if (b & 0x40) {
+            tableAdd(t, name, name_len, value, value_len);
+        }
+        rc = 0;
+    }
+    free(scratch);
+    return rc;
+}
+
+/**********************************
+ * Encoding
+ **********************************/
+
+static int encodeInt(uint8_t* out, size_t cap, uint8_t first, int prefix, uint64_t value) {
+    uint64_t max = (1u << prefix) - 1;
+    size_t n = 0;
+
+    if (cap == 0) {
+        return -1;
+    }
+    if (value < max) {
+        out[n++] = first | value;
+        return n;
+    }
+    out[n++] = first | max;
+    value -= max;
+    while (value >= 0x80) {
+        if (n == cap) {
+            return -1;
+        }
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (n == cap) {
+        return -1;
+    }
+    out[n++] = value;
+    return n;
+}
+
+static int encodeString(uint8_t* out, size_t cap, const char* s) {
+    size_t len = strlen(s);
+    int n = encodeInt(out, cap, 0, 7, len);
+
+    if (n < 0 || n + len > cap) {
+        return -1;
+    }
+    memcpy(out + n, s, len);
+    return n + len;
+}
+
+int hpackEncode(HpackTable* t, uint8_t* out, size_t cap, const char* name, const char* value, int index) {
+    int found = tableFind(t, name, value);
+    int n, m;
+
+    if (found > 0) {
+        return encodeInt(out, cap, 0x80, 7, found);
+    }
+    index = index && t->max_size > 0;
+    n = encodeInt(out, cap, index ? 0x40 : 0x00, index ? 6 : 4, -found);
+    if (n < 0) {
+        return -1;
+    }
+    if (found == 0) {
+        if ((m = encodeString(out + n, cap - n, name)) < 0) {
+            return -1;
+        }
+        n += m;
+    }
+    if ((m = encodeString(out + n, cap - n, value)) < 0) {
+        return -1;
+    }
+    if (index) {
+        tableAdd(t, name, strlen(name), value, strlen(value));
+    }
+    return n + m;
+}
+
+int hpackEncodeSizeUpdate(uint8_t* out, size_t cap, size_t max_size) {
+    return encodeInt(out, cap, 0x20, 5, max_size);
+}
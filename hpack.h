@@ -0,0 +1,40 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_STATIC_COUNT 61
+#define HPACK_TABLE_SIZE 4096    // SETTINGS_HEADER_TABLE_SIZE default
+
+typedef struct HpackField {
+    char* name;
+    char* value;
+} HpackField;
+
+// Dynamic table of one direction of a connection (RFC 7541 2.3.2)
+typedef struct HpackTable {
+    HpackField* entries;    // Newest first
+    int count;
+    int capacity;
+    size_t size;            // Sum of name + value + 32 over the entries
+    size_t max_size;
+} HpackTable;
+
+// Called for every decoded field; strings are not NUL terminated
+typedef void (*HpackEmit)(void* arg, const char* name, size_t name_len, const char* value, size_t value_len);
+
+void hpackInit(HpackTable* t, size_t max_size);
+void hpackFree(HpackTable* t);
+void hpackResize(HpackTable* t, size_t max_size);
+
+// Decodes a complete header block. Returns 0, or -1 on a compression error.
+int hpackDecode(HpackTable* t, const uint8_t* in, size_t len, HpackEmit emit, void* arg);
+
+// Append one field (or a table size update) to out. With index set, a field
+// not found in the tables is added to the dynamic one. Return the bytes
+// written, or -1 when cap is too small.
+int hpackEncode(HpackTable* t, uint8_t* out, size_t cap, const char* name, const char* value, int index);
+int hpackEncodeSizeUpdate(uint8_t* out, size_t cap, size_t max_size);
+
+#endif
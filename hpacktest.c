@@ -0,0 +1,80 @@
+//
+// hpacktest.c: Regression checks for the HPACK decoder's dynamic table.
+//
+// Each check decodes a hand-built header block and compares the fields
+// emitted and the table left behind. Built with AddressSanitizer by
+// "make check", so a table entry read after eviction fails loudly.
+//
+// To run: make check
+//
+
+#include "segel.h"
+#include "hpack.h"
+
+static int failures;
+
+typedef struct Emitted {
+    char name[64];
+    char value[64];
+    int count;
+} Emitted;
+
+static void collect(void* arg, const char* name, size_t name_len, const char* value, size_t value_len) {
+    Emitted* e = (Emitted*)arg;
+
+    snprintf(e->name, sizeof(e->name), "%.*s", (int)name_len, name);
+    snprintf(e->value, sizeof(e->value), "%.*s", (int)value_len, value);
+    e->count++;
+}
+
+static void expect(int ok, const char* what) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+    if (!ok) {
+        failures++;
+    }
+}
+
+// Appends a raw (not Huffman coded) string literal, shorter than 127 bytes
+static size_t putString(uint8_t* out, const char* s) {
+    size_t n = strlen(s);
+
+    out[0] = n;
+    memcpy(out + 1, s, n);
+    return n + 1;
+}
+
+//
+// A literal with incremental indexing whose name is the oldest entry of a
+// full table: adding it evicts that entry, whose name must be copied first
+//
+static void checkIndexedNameOfEvicted(void) {
+    HpackTable t;
+    Emitted e = { { 0 }, { 0 }, 0 };
+    uint8_t block[256];
+    size_t len = 0;
+
+    // Room for exactly one entry of 8 + 20 + 32 bytes
+    hpackInit(&t, 100);
+    block[len++] = 0x40;                            // New name, indexed (6.2.1)
+    len += putString(block + len, "x-oldest");
+    len += putString(block + len, "aaaaaaaaaaaaaaaaaaaa");
+    block[len++] = 0x40 | (HPACK_STATIC_COUNT + 1); // Name of dynamic entry 1
+    len += putString(block + len, "bbbbbbbbbbbbbbbbbbbb");
+
+    expect(hpackDecode(&t, block, len, collect, &e) == 0, "block with an evicting literal decodes");
+    expect(e.count == 2 && strcmp(e.name, "x-oldest") == 0 && strcmp(e.value, "bbbbbbbbbbbbbbbbbbbb") == 0,
+           "literal emitted with the evicted entry's name");
+    expect(t.count == 1 && strcmp(t.entries[0].name, "x-oldest") == 0 && strcmp(t.entries[0].value, "bbbbbbbbbbbbbbbbbbbb") == 0,
+           "table holds only the new entry, under the old name");
+    expect(t.size == 60, "table size accounts for the one entry");
+    hpackFree(&t);
+}
+
+int main(void) {
+    checkIndexedNameOfEvicted();
+    if (failures > 0) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
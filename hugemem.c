@@ -0,0 +1,301 @@
+//
+// hugemem.c: Huge-page backed, optionally locked memory for the hot data:
+// cached file contents, queue rings and the stats segment.
+//
+// MAP_HUGETLB only succeeds with pages reserved in vm.nr_hugepages, so the
+// fallback maps huge-page aligned regular memory and asks for transparent
+// huge pages. Either way the memory is faulted in on allocation, so with a
+// process bound to a NUMA node it lands on that node (first touch).
+//
+
+// sched_setaffinity
+#define _GNU_SOURCE
+#include "segel.h"
+#include "hugemem.h"
+#include <sched.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+
+atomic_ulong mem_bytes[MEM_KIND_COUNT][MEM_BACKING_COUNT];
+atomic_ulong mem_locked[MEM_KIND_COUNT];
+
+static int flags;
+static atomic_int lock_warned;
+
+// In front of every hugememAlloc block, so hugememFree needs only the pointer
+typedef struct MemRegion {
+    size_t span;                     // Bytes mapped (or allocated), region included
+    MemBacking backing;
+    int locked;
+} __attribute__((aligned(HUGEMEM_ALIGN))) MemRegion;
+
+// Huge-page chunk hugememCarve is cutting blocks from
+static char* chunk;
+static size_t chunk_used;
+static size_t chunk_size;
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Small blocks given back with hugememUncarve, kept in the blocks themselves
+typedef struct FreeBlock {
+    size_t size;
+    struct FreeBlock* next;
+} FreeBlock;
+static FreeBlock* free_blocks;
+
+int hugememFlagsFromList(const char* list) {
+    char copy[64], *save = NULL;
+    int f = 0;
+
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (char* word = strtok_r(copy, ",", &save); word != NULL; word = strtok_r(NULL, ",", &save)) {
+        if (strcmp(word, "huge") == 0) f |= HUGEMEM_HUGE;
+        else if (strcmp(word, "lock") == 0) f |= HUGEMEM_LOCK;
+        else if (strcmp(word, "numa") == 0) f |= HUGEMEM_NUMA;
+        else return -1;
+    }
+    return f;
+}
+
+void hugememInit(int f) {
+    flags = f;
+}
+
+int hugememFlags(void) {
+    return flags;
+}
+
+static void account(MemKind kind, MemBacking backing, long bytes, int locked) {
+    atomic_fetch_add_explicit(&mem_bytes[kind][backing], bytes, memory_order_relaxed);
+    if (locked) {
+        atomic_fetch_add_explicit(&mem_locked[kind], bytes, memory_order_relaxed);
+    }
+}
+
+// RLIMIT_MEMLOCK is the usual reason; the memory works all the same
+static int lockRange(void* p, size_t size) {
+    if (mlock(p, size) == 0) {
+        return 1;
+    }
+    if (atomic_exchange(&lock_warned, 1) == 0) {
+        fprintf(stderr, "hugemem: cannot lock memory: %s (raise ulimit -l)\n", strerror(errno));
+    }
+    return 0;
+}
+
+//
+// Maps span bytes (a multiple of HUGEMEM_PAGE): reserved huge pages if there
+// are any, else a huge-page aligned range of regular ones hinted for THP.
+// The kernel only builds a transparent huge page from an aligned 2 MB range,
+// hence the over-map and trim.
+//
+static void* mapHuge(size_t span, MemBacking* backing) {
+    char* p = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (p != MAP_FAILED) {
+        *backing = MEM_HUGETLB;
+        return p;
+    }
+    char* raw = mmap(NULL, span + HUGEMEM_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    p = (char*)(((uintptr_t)raw + HUGEMEM_PAGE - 1) & ~(uintptr_t)(HUGEMEM_PAGE - 1));
+    if (p > raw) {
+        munmap(raw, p - raw);
+    }
+    munmap(p + span, raw + HUGEMEM_PAGE - p);
+    *backing = madvise(p, span, MADV_HUGEPAGE) == 0 ? MEM_THP : MEM_PAGES;
+    return p;
+}
+
+// Faults in every page from this thread, so first touch decides the node
+static void touch(char* p, size_t size) {
+    long page = sysconf(_SC_PAGESIZE);
+
+    for (size_t off = 0; off < size; off += page) {
+        ((volatile char*)p)[off] = 0;
+    }
+}
+
+void* hugememAlloc(MemKind kind, size_t size) {
+    MemRegion* r;
+    MemBacking backing = MEM_PAGES;
+    size_t span = (sizeof(MemRegion) + size + HUGEMEM_ALIGN - 1) & ~(size_t)(HUGEMEM_ALIGN - 1);
+
+    if (flags & HUGEMEM_HUGE) {
+        span = (span + HUGEMEM_PAGE - 1) & ~(HUGEMEM_PAGE - 1);
+        if ((r = mapHuge(span, &backing)) == NULL) {
+            return NULL;
+        }
+        touch((char*)r, span);
+    }
+    else {
+        if ((r = aligned_alloc(HUGEMEM_ALIGN, span)) == NULL) {
+            return NULL;
+        }
+        memset(r, 0, span);
+    }
+    r->span = span;
+    r->backing = backing;
+    r->locked = (flags & HUGEMEM_LOCK) && lockRange(r, span);
+    account(kind, backing, span, r->locked);
+    return r + 1;
+}
+
+void hugememFree(MemKind kind, void* p) {
+    MemRegion* r;
+
+    if (p == NULL) {
+        return;
+    }
+    r = (MemRegion*)p - 1;
+    account(kind, r->backing, -(long)r->span, 0);
+    if (r->locked) {
+        atomic_fetch_sub_explicit(&mem_locked[kind], r->span, memory_order_relaxed);
+    }
+    if (flags & HUGEMEM_HUGE) {
+        munmap(r, r->span);
+    }
+    else {
+        free(r);
+    }
+}
+
+void* hugememCarve(MemKind kind, size_t size) {
+    void* p;
+
+    size = (size + HUGEMEM_ALIGN - 1) & ~(size_t)(HUGEMEM_ALIGN - 1);
+    if (size > HUGEMEM_PAGE / 2) {
+        return hugememAlloc(kind, size);
+    }
+    pthread_mutex_lock(&chunk_lock);
+    // First fit among the blocks given back; the rest of a bigger one goes with it
+    for (FreeBlock** b = &free_blocks; *b != NULL; b = &(*b)->next) {
+        if ((*b)->size >= size) {
+            p = *b;
+            *b = (*b)->next;
+            pthread_mutex_unlock(&chunk_lock);
+            memset(p, 0, size);
+            return p;
+        }
+    }
+    if (chunk == NULL || chunk_used + size > chunk_size) {
+        // The rest of the old chunk is given up, at most half a page
+        chunk = hugememAlloc(kind, HUGEMEM_PAGE - sizeof(MemRegion));
+        chunk_used = 0;
+        chunk_size = HUGEMEM_PAGE - sizeof(MemRegion);
+    }
+    p = chunk != NULL ? chunk + chunk_used : NULL;
+    chunk_used += size;
+    pthread_mutex_unlock(&chunk_lock);
+    return p;
+}
+
+void hugememUncarve(MemKind kind, void* p, size_t size) {
+    if (p == NULL) {
+        return;
+    }
+    size = (size + HUGEMEM_ALIGN - 1) & ~(size_t)(HUGEMEM_ALIGN - 1);
+    if (size > HUGEMEM_PAGE / 2) {
+        hugememFree(kind, p);
+        return;
+    }
+    pthread_mutex_lock(&chunk_lock);
+    if ((char*)p + size == chunk + chunk_used) {
+        chunk_used -= size;     // The last block carved, as after a failed load
+    }
+    else {
+        FreeBlock* b = p;
+        b->size = size;
+        b->next = free_blocks;
+        free_blocks = b;
+    }
+    pthread_mutex_unlock(&chunk_lock);
+}
+
+void hugememAdvise(MemKind kind, void* p, size_t size) {
+    MemBacking backing = MEM_PAGES;
+    int locked = 0;
+
+    // Shared memory takes the hint when shmem_enabled allows it
+    if ((flags & HUGEMEM_HUGE) && madvise(p, size, MADV_HUGEPAGE) == 0) {
+        backing = MEM_THP;
+    }
+    if (flags & HUGEMEM_LOCK) {
+        locked = lockRange(p, size);
+    }
+    account(kind, backing, size, locked);
+}
+
+void hugememAccount(MemKind kind, long bytes, int locked) {
+    account(kind, MEM_PAGES, bytes, locked);
+}
+
+/**********************************
+ * NUMA placement
+ **********************************/
+
+// Reads a sysfs list like "0-3,8-11" into set; returns how many it holds
+static int readList(const char* path, cpu_set_t* set) {
+    FILE* f = fopen(path, "r");
+    char line[4096];
+    char* s = line;
+
+    CPU_ZERO(set);
+    if (f == NULL) {
+        return 0;
+    }
+    if (fgets(line, sizeof(line), f) == NULL) {
+        line[0] = '\0';
+    }
+    fclose(f);
+    while (*s >= '0' && *s <= '9') {
+        long lo = strtol(s, &s, 10), hi = lo;
+        if (*s == '-') {
+            hi = strtol(s + 1, &s, 10);
+        }
+        for (long i = lo; i <= hi && i < CPU_SETSIZE; i++) {
+            CPU_SET(i, set);
+        }
+        if (*s == ',') {
+            s++;
+        }
+    }
+    return CPU_COUNT(set);
+}
+
+//
+// No libnuma: the node's CPUs come from sysfs and the memory policy is set
+// with the raw syscall. MPOL_PREFERRED rather than MPOL_BIND, so a full node
+// spills over instead of failing allocations.
+//
+int hugememBindNode(int index) {
+    cpu_set_t nodes, cpus;
+    char path[64];
+    int count = readList(NODE_DIR "/has_memory", &nodes);
+    int node = -1;
+
+    if (count <= 1) {
+        return -1;
+    }
+    for (int i = 0, seen = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &nodes) && seen++ == index % count) {
+            node = i;
+            break;
+        }
+    }
+    snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", node);
+    if (readList(path, &cpus) > 0 && sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+        fprintf(stderr, "hugemem: cannot run on node %d: %s\n", node, strerror(errno));
+    }
+
+    unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = { 0 };
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, CPU_SETSIZE) < 0) {
+        fprintf(stderr, "hugemem: cannot prefer node %d: %s\n", node, strerror(errno));
+    }
+    return node;
+}
@@ -0,0 +1,57 @@
+#ifndef HUGEMEM_H
+#define HUGEMEM_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define HUGEMEM_PAGE (2UL << 20)     // Huge page size on x86-64
+#define HUGEMEM_ALIGN 64             // Carved blocks start on a cache line
+
+// -H flags, see hugememFlagsFromList
+#define HUGEMEM_HUGE 1               // Back the cache and queue rings with huge pages
+#define HUGEMEM_LOCK 2               // mlock them, and the stats segment
+#define HUGEMEM_NUMA 4               // Keep each pre-forked process on one NUMA node
+
+// What the memory is for, and what ended up backing it: reserved huge pages
+// (MAP_HUGETLB), regular pages hinted for transparent huge pages, or plain
+// pages (without -H, or when the hint is refused)
+typedef enum { MEM_CACHE, MEM_QUEUE, MEM_STATS, MEM_KIND_COUNT } MemKind;
+typedef enum { MEM_PAGES, MEM_THP, MEM_HUGETLB, MEM_BACKING_COUNT } MemBacking;
+
+extern atomic_ulong mem_bytes[MEM_KIND_COUNT][MEM_BACKING_COUNT];
+extern atomic_ulong mem_locked[MEM_KIND_COUNT];
+
+// "huge", "lock" and "numa" separated by commas; -1 on anything else
+int hugememFlagsFromList(const char* list);
+
+// Before anything is allocated; without it memory comes from the C heap
+void hugememInit(int flags);
+int hugememFlags(void);
+
+// Zeroed, faulted in by the caller's thread, NULL on failure. With -H huge
+// the size is rounded up to whole huge pages, so small rings cost one each.
+void* hugememAlloc(MemKind kind, size_t size);
+void hugememFree(MemKind kind, void* p);
+
+// Carves size bytes off shared huge-page chunks; blocks beyond half a page
+// get their own. Meant for cache entries, which live as long as the server.
+void* hugememCarve(MemKind kind, size_t size);
+
+// Gives back a block hugememCarve returned for size bytes, like the copy of
+// a cache entry that lost its insert. A block of its own is unmapped; a
+// small one is reused by later carves, the chunks themselves stay.
+void hugememUncarve(MemKind kind, void* p, size_t size);
+
+// Hints and locks a shared mapping made elsewhere, like the stats segment
+void hugememAdvise(MemKind kind, void* p, size_t size);
+
+// Accounts memory hugemem did not allocate, like mmap'ed files (negative
+// bytes to give it back)
+void hugememAccount(MemKind kind, long bytes, int locked);
+
+// Moves the calling process, before it starts any threads, onto NUMA node
+// index modulo the node count: its CPUs for scheduling, its memory for
+// allocations. Returns the node, or -1 with a single node.
+int hugememBindNode(int index);
+
+#endif
@@ -0,0 +1,121 @@
+//
+// iopool.c: Reads cold static files in on I/O threads so workers never wait on storage.
+//
+// A worker that dequeues a static request whose file is not in memory parks
+// it here instead of serving it. An I/O thread opens the file, reads it
+// ahead, loads it into the cache and resumes the request through the same
+// submit path the acceptor uses; the queue gives it back the key and seq it
+// first had, so it goes back in ahead of anything that arrived since. Files
+// loaded here are revalidated on every hit, as nothing reloads them.
+//
+
+#include "segel.h"
+#include "request.h"
+#include "cache.h"
+#include "bundle.h"
+#include "iopool.h"
+
+typedef struct IoJob {
+    Request req;
+    char filename[MAXLINE + 32];
+    struct IoJob* next;
+} IoJob;
+
+atomic_int iopool_parked;
+atomic_ulong iopool_loads;
+
+static IoJob* head;
+static IoJob** tail = &head;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static IoResume resume;
+
+static void iopoolLoad(const char* filename) {
+    struct stat sbuf;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        return;         // The worker answers 404
+    }
+    if (fstat(fd, &sbuf) == 0 && S_ISREG(sbuf.st_mode)) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        if (sbuf.st_size <= IOPOOL_CACHE_MAX) {
+            // Maps it with MAP_POPULATE, so the pages are resident once it returns
+            cacheLoad(filename, CACHE_REVALIDATE);
+        }
+    }
+    close(fd);
+}
+
+static void* iopoolLoop(void* arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (head == NULL) {
+            pthread_cond_wait(&ready, &lock);
+        }
+        IoJob* job = head;
+        head = job->next;
+        if (head == NULL) {
+            tail = &head;
+        }
+        pthread_mutex_unlock(&lock);
+
+        // Another job may have loaded the same file meanwhile
+        if (cacheLookup(job->filename) == NULL) {
+            iopoolLoad(job->filename);
+        }
+        atomic_fetch_sub_explicit(&iopool_parked, 1, memory_order_relaxed);
+        resume(&job->req, 1);
+        free(job);
+    }
+    return NULL;
+}
+
+void iopoolStart(int nthreads, IoResume fn) {
+    pthread_t tid;
+
+    resume = fn;
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&tid, NULL, iopoolLoop, NULL) != 0) {
+            unix_error("pthread_create error");
+        }
+        pthread_detach(tid);
+    }
+}
+
+int iopoolPark(Request* req) {
+    char filename[MAXLINE + 32];
+
+    // Resumed requests are served whatever happened to their file
+    if (resume == NULL || !req->is_static || req->parked) {
+        return 0;
+    }
+    if (requestPeekFilename(req->connfd, filename, sizeof(filename)) < 0 ||
+        bundleLookup(filename) != NULL || cacheLookup(filename) != NULL) {
+        return 0;
+    }
+    if (atomic_fetch_add_explicit(&iopool_parked, 1, memory_order_relaxed) >= IOPOOL_MAX_PARKED) {
+        atomic_fetch_sub_explicit(&iopool_parked, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    IoJob* job = malloc(sizeof(IoJob));
+    if (job == NULL) {
+        atomic_fetch_sub_explicit(&iopool_parked, 1, memory_order_relaxed);
+        return 0;
+    }
+    job->req = *req;
+    job->req.parked = 1;
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    job->next = NULL;
+    atomic_fetch_add_explicit(&iopool_loads, 1, memory_order_relaxed);
+
+    pthread_mutex_lock(&lock);
+    *tail = job;
+    tail = &job->next;
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+    return 1;
+}
@@ -0,0 +1,24 @@
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <stdatomic.h>
+#include "queue.h"
+
+#define IOPOOL_MAX_PARKED 1024       // Beyond this, workers read cold files themselves
+#define IOPOOL_CACHE_MAX (16 << 20)  // Larger files are only read ahead, not cached
+
+extern atomic_int iopool_parked;            // Requests waiting for their file
+extern atomic_ulong iopool_loads;           // Cold files handed to the I/O threads so far
+
+// Queues a request again once its file is in, like the acceptor does
+typedef int (*IoResume)(Request* reqs, int n);
+
+void iopoolStart(int nthreads, IoResume resume);
+
+// Called before serving: if req is for a static file that is neither in the
+// bundle nor in the cache, parks it with the I/O threads, which open and read
+// the file into the cache and then resume it. Returns 1 if it was parked.
+// The request line is only peeked, so the resumed request reads it as usual.
+int iopoolPark(Request* req);
+
+#endif
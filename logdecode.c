@@ -0,0 +1,48 @@
+/*
+ * logdecode.c: Prints a binary access log written by "server -l <file>".
+ *
+ * To run: ./logdecode access.log
+ *
+ * One line per request:
+ *   <wall time> <thread> <fd> <vip> <status> <bytes> <wait us> <total us> <uri hash> <uri prefix>
+ */
+
+#include "segel.h"
+#include "accesslog.h"
+
+int main(int argc, char* argv[]) {
+    AccessLogHeader header;
+    AccessRecord rec;
+    FILE* f;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <access log>\n", argv[0]);
+        exit(1);
+    }
+    if ((f = fopen(argv[1], "rb")) == NULL) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        exit(1);
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != ACCESSLOG_MAGIC) {
+        fprintf(stderr, "%s: not an access log\n", argv[1]);
+        exit(1);
+    }
+    if (header.version != ACCESSLOG_VERSION || header.record_size != sizeof(AccessRecord)) {
+        fprintf(stderr, "%s: unsupported version %u (record size %u)\n", argv[1], header.version, header.record_size);
+        exit(1);
+    }
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        uint64_t wall = header.wall_ns + (rec.accept_ns - header.mono_ns);
+        char uri[ACCESSLOG_URI + 1];
+
+        memcpy(uri, rec.uri, ACCESSLOG_URI);
+        uri[ACCESSLOG_URI] = '\0';
+        printf("%lu.%06lu %d %d %s %d %lu %.1f %.1f %08x %s\n",
+               (unsigned long)(wall / 1000000000ull), (unsigned long)(wall % 1000000000ull) / 1000,
+               rec.thread_id, rec.fd, rec.vip ? "vip" : "-", rec.status, (unsigned long)rec.bytes,
+               rec.wait_ns / 1000.0, rec.total_ns / 1000.0, rec.uri_hash, uri[0] ? uri : "-");
+    }
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,224 @@
+//
+// metrics.c: Renders the Prometheus text exposition served at /metrics.
+//
+// Everything here is read without locks: per-thread counters through
+// seqlock snapshots and queue fields with relaxed atomic loads.
+//
+
+#include "segel.h"
+#include <stdarg.h>
+#include "metrics.h"
+#include "stats.h"
+#include "accesslog.h"
+#include "cgicache.h"
+#include "writer.h"
+#include "iopool.h"
+#include "hugemem.h"
+
+atomic_int cgi_inflight;
+atomic_ulong io_errors[IO_OP_COUNT][IO_ERR_COUNT];
+
+static const char* io_op_names[IO_OP_COUNT] = { "read", "write", "open", "close", "accept", "cgi" };
+static const char* io_error_names[IO_ERR_COUNT] = { "reset", "missing", "denied", "limit", "other" };
+static const char* mem_kind_names[MEM_KIND_COUNT] = { "cache", "queue", "stats" };
+static const char* mem_backing_names[MEM_BACKING_COUNT] = { "pages", "thp", "hugetlb" };
+static Pool* pools[POOL_MAX];
+static int npools;
+
+typedef struct MetricsBuf {
+    char* data;
+    size_t len;
+    size_t cap;
+} MetricsBuf;
+
+// Out of memory, b->data becomes NULL and the rest of the page is skipped
+static void put(MetricsBuf* b, const char* fmt, ...) {
+    va_list ap;
+    int n;
+
+    while (b->data != NULL) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && b->len + n < b->cap) {
+            b->len += n;
+            return;
+        }
+        b->cap *= 2;
+        char* grown = realloc(b->data, b->cap);
+        if (grown == NULL) {
+            free(b->data);
+        }
+        b->data = grown;
+    }
+}
+
+static void putHistogram(MetricsBuf* b, const char* name, const char* help, StatsSnapshot* s, int span) {
+    unsigned long cumulative = 0;
+
+    put(b, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        cumulative += s->span_hist[span][i];
+        put(b, "%s_bucket{le=\"%.9g\"} %lu\n", name, traceBucketBound(i) / 1e9, cumulative);
+    }
+    cumulative += s->span_hist[span][HIST_BUCKETS - 1];
+    put(b, "%s_bucket{le=\"+Inf\"} %lu\n", name, cumulative);
+    put(b, "%s_sum %.9f\n", name, s->span_sum[span] / 1e9);
+    put(b, "%s_count %lu\n", name, cumulative);
+}
+
+// Called before the server starts listening
+void metricsIoError(IoOp op, int err) {
+    IoErrorClass c;
+
+    switch (err) {
+    case EPIPE:
+    case ECONNRESET:
+    case ECONNABORTED:
+    case ENOTCONN:
+    case ETIMEDOUT:
+        c = IO_ERR_RESET;
+        break;
+    case ENOENT:
+    case ENOTDIR:
+        c = IO_ERR_MISSING;
+        break;
+    case EACCES:
+    case EPERM:
+        c = IO_ERR_DENIED;
+        break;
+    case EMFILE:
+    case ENFILE:
+    case ENOMEM:
+    case ENOSPC:
+    case EAGAIN:
+        c = IO_ERR_LIMIT;
+        break;
+    default:
+        c = IO_ERR_OTHER;
+    }
+    atomic_fetch_add_explicit(&io_errors[op][c], 1, memory_order_relaxed);
+}
+
+void metricsAddPool(Pool* pool) {
+    if (npools < POOL_MAX) {
+        pools[npools++] = pool;
+    }
+}
+
+//
+// Returns a malloc'ed body; the caller frees it. NULL when out of memory.
+//
+char* metricsRender(size_t* len) {
+    MetricsBuf b = { malloc(16384), 0, 16384 };
+    StatsSnapshot* s = malloc(sizeof(StatsSnapshot));
+
+    if (b.data == NULL || s == NULL) {
+        free(b.data);
+        free(s);
+        return NULL;
+    }
+    statsAggregate(s);
+
+    put(&b, "# HELP server_requests_total Requests handled, by class.\n# TYPE server_requests_total counter\n");
+    put(&b, "server_requests_total{class=\"static\"} %lu\n", s->stat_req);
+    put(&b, "server_requests_total{class=\"dynamic\"} %lu\n", s->dynm_req);
+    put(&b, "server_requests_total{class=\"vip\"} %lu\n", s->vip_req);
+    put(&b, "server_requests_total{class=\"error\"} %lu\n", s->err_req);
+
+    // Queue families, one sample per pool that owns its queue
+    put(&b, "# HELP server_queue_depth Requests waiting in the queue.\n# TYPE server_queue_depth gauge\n");
+    for (int i = 0; i < npools; i++) {
+        Queue* q = pools[i]->queue;
+        if (pools[i]->vip) continue;
+        put(&b, "server_queue_depth{pool=\"%s\",queue=\"regular\"} %d\n", pools[i]->name, __atomic_load_n(&q->size, __ATOMIC_RELAXED));
+        put(&b, "server_queue_depth{pool=\"%s\",queue=\"vip\"} %d\n", pools[i]->name, __atomic_load_n(&q->vip_size, __ATOMIC_RELAXED));
+    }
+    put(&b, "# HELP server_queue_capacity Queue capacity.\n# TYPE server_queue_capacity gauge\n");
+    for (int i = 0; i < npools; i++) {
+        if (pools[i]->vip) continue;
+        put(&b, "server_queue_capacity{pool=\"%s\"} %d\n", pools[i]->name, __atomic_load_n(&pools[i]->queue->capacity, __ATOMIC_RELAXED));
+    }
+    put(&b, "# HELP server_queue_cost_seconds Estimated work waiting in the regular queue.\n# TYPE server_queue_cost_seconds gauge\n");
+    for (int i = 0; i < npools; i++) {
+        if (pools[i]->vip) continue;
+        put(&b, "server_queue_cost_seconds{pool=\"%s\"} %.6f\n", pools[i]->name, __atomic_load_n(&pools[i]->queue->cost, __ATOMIC_RELAXED) / 1e6);
+    }
+    put(&b, "# HELP server_queue_cost_capacity_seconds Estimated work the regular queue admits (0 = unlimited).\n# TYPE server_queue_cost_capacity_seconds gauge\n");
+    for (int i = 0; i < npools; i++) {
+        if (pools[i]->vip) continue;
+        put(&b, "server_queue_cost_capacity_seconds{pool=\"%s\"} %.6f\n", pools[i]->name, __atomic_load_n(&pools[i]->queue->cost_capacity, __ATOMIC_RELAXED) / 1e6);
+    }
+    put(&b, "# HELP server_queue_aging Shortest-job-first aging factor (0 = FIFO).\n# TYPE server_queue_aging gauge\n");
+    for (int i = 0; i < npools; i++) {
+        if (pools[i]->vip) continue;
+        put(&b, "server_queue_aging{pool=\"%s\"} %d\n", pools[i]->name, __atomic_load_n(&pools[i]->queue->aging, __ATOMIC_RELAXED));
+    }
+    put(&b, "# HELP server_dropped_total Requests dropped by the overload policy.\n# TYPE server_dropped_total counter\n");
+    for (int i = 0; i < npools; i++) {
+        Queue* q = pools[i]->queue;
+        if (pools[i]->vip) continue;
+        put(&b, "server_dropped_total{pool=\"%s\",policy=\"%s\"} %lu\n", pools[i]->name,
+            policy_names[__atomic_load_n(&q->policy, __ATOMIC_RELAXED)], __atomic_load_n(&q->dropped, __ATOMIC_RELAXED));
+    }
+
+    put(&b, "# HELP server_workers Worker threads, by state.\n# TYPE server_workers gauge\n");
+    put(&b, "server_workers{state=\"busy\"} %d\n", s->busy);
+    put(&b, "server_workers{state=\"idle\"} %d\n", s->threads - s->busy);
+    put(&b, "# HELP server_pool_threads Configured thread pool sizes; running threads converge to them.\n# TYPE server_pool_threads gauge\n");
+    for (int i = 0; i < npools; i++) {
+        put(&b, "server_pool_threads{pool=\"%s\"} %d\n", pools[i]->name, atomic_load_explicit(&pools[i]->threads, memory_order_relaxed));
+    }
+    put(&b, "# HELP server_pool_idle Workers of the pool waiting for a request.\n# TYPE server_pool_idle gauge\n");
+    for (int i = 0; i < npools; i++) {
+        if (pools[i]->vip) continue;
+        put(&b, "server_pool_idle{pool=\"%s\"} %d\n", pools[i]->name, __atomic_load_n(&pools[i]->queue->waiting, __ATOMIC_RELAXED));
+    }
+    put(&b, "# HELP server_cgi_inflight CGI children currently running.\n# TYPE server_cgi_inflight gauge\n");
+    put(&b, "server_cgi_inflight %d\n", atomic_load_explicit(&cgi_inflight, memory_order_relaxed));
+    put(&b, "# HELP server_writer_inflight Responses the writer thread is finishing for slow clients.\n# TYPE server_writer_inflight gauge\n");
+    put(&b, "server_writer_inflight %d\n", atomic_load_explicit(&writer_inflight, memory_order_relaxed));
+    put(&b, "# HELP server_writer_handoffs_total Responses handed from workers to the writer thread.\n# TYPE server_writer_handoffs_total counter\n");
+    put(&b, "server_writer_handoffs_total %lu\n", atomic_load_explicit(&writer_handoffs, memory_order_relaxed));
+    put(&b, "# HELP server_writer_timeouts_total Writer transfers closed after the client stopped reading.\n# TYPE server_writer_timeouts_total counter\n");
+    put(&b, "server_writer_timeouts_total %lu\n", atomic_load_explicit(&writer_timeouts, memory_order_relaxed));
+    put(&b, "# HELP server_iopool_parked Requests parked while an I/O thread reads their file in.\n# TYPE server_iopool_parked gauge\n");
+    put(&b, "server_iopool_parked %d\n", atomic_load_explicit(&iopool_parked, memory_order_relaxed));
+    put(&b, "# HELP server_iopool_loads_total Cold static files handed to the I/O threads.\n# TYPE server_iopool_loads_total counter\n");
+    put(&b, "server_iopool_loads_total %lu\n", atomic_load_explicit(&iopool_loads, memory_order_relaxed));
+    put(&b, "# HELP server_io_errors_total Failed request-path I/O, by operation and error class.\n# TYPE server_io_errors_total counter\n");
+    for (int op = 0; op < IO_OP_COUNT; op++) {
+        for (int e = 0; e < IO_ERR_COUNT; e++) {
+            unsigned long n = atomic_load_explicit(&io_errors[op][e], memory_order_relaxed);
+            if (n > 0) {
+                put(&b, "server_io_errors_total{op=\"%s\",error=\"%s\"} %lu\n", io_op_names[op], io_error_names[e], n);
+            }
+        }
+    }
+    put(&b, "# HELP server_memory_bytes Memory held for the cache, queue rings and stats, by what backs it.\n# TYPE server_memory_bytes gauge\n");
+    for (int k = 0; k < MEM_KIND_COUNT; k++) {
+        for (int m = 0; m < MEM_BACKING_COUNT; m++) {
+            unsigned long n = atomic_load_explicit(&mem_bytes[k][m], memory_order_relaxed);
+            if (n > 0) {
+                put(&b, "server_memory_bytes{kind=\"%s\",backing=\"%s\"} %lu\n", mem_kind_names[k], mem_backing_names[m], n);
+            }
+        }
+    }
+    put(&b, "# HELP server_memory_locked_bytes Memory of each kind held with mlock.\n# TYPE server_memory_locked_bytes gauge\n");
+    for (int k = 0; k < MEM_KIND_COUNT; k++) {
+        put(&b, "server_memory_locked_bytes{kind=\"%s\"} %lu\n", mem_kind_names[k], atomic_load_explicit(&mem_locked[k], memory_order_relaxed));
+    }
+    put(&b, "# HELP server_cgi_cache_total Cacheable CGI requests, by outcome.\n# TYPE server_cgi_cache_total counter\n");
+    put(&b, "server_cgi_cache_total{result=\"hit\"} %lu\n", atomic_load_explicit(&cgi_cache_results[CGI_CACHE_HIT], memory_order_relaxed));
+    put(&b, "server_cgi_cache_total{result=\"miss\"} %lu\n", atomic_load_explicit(&cgi_cache_results[CGI_CACHE_MISS], memory_order_relaxed));
+    put(&b, "server_cgi_cache_total{result=\"coalesced\"} %lu\n", atomic_load_explicit(&cgi_cache_results[CGI_CACHE_COALESCED], memory_order_relaxed));
+    put(&b, "# HELP server_access_log_dropped_total Access log records dropped on full rings or failed writes.\n# TYPE server_access_log_dropped_total counter\n");
+    put(&b, "server_access_log_dropped_total %lu\n", accesslogDropped());
+
+    putHistogram(&b, "server_queue_wait_seconds", "Time from enqueue to dequeue.", s, TRACE_SPAN_QUEUE_WAIT);
+    putHistogram(&b, "server_service_seconds", "Time from dequeue to close.", s, TRACE_SPAN_SERVICE);
+
+    free(s);
+    *len = b.len;
+    return b.data;      // NULL if a put ran out of memory
+}
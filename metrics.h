@@ -0,0 +1,23 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include "pool.h"
+
+#define METRICS_URI "/metrics"
+
+extern atomic_int cgi_inflight;
+
+// Failed I/O on the request path, which costs that request only: by
+// operation, and by errno folded into a few classes
+typedef enum { IO_READ, IO_WRITE, IO_OPEN, IO_CLOSE, IO_ACCEPT, IO_CGI, IO_OP_COUNT } IoOp;
+typedef enum { IO_ERR_RESET, IO_ERR_MISSING, IO_ERR_DENIED, IO_ERR_LIMIT, IO_ERR_OTHER, IO_ERR_COUNT } IoErrorClass;
+
+extern atomic_ulong io_errors[IO_OP_COUNT][IO_ERR_COUNT];
+
+void metricsIoError(IoOp op, int err);
+
+void metricsAddPool(Pool* pool);
+char* metricsRender(size_t* len);
+
+#endif
@@ -0,0 +1,235 @@
+/*
+ * pack.c: Packs a directory of static assets into one bundle for "server -P".
+ *
+ * To run: ./pack public.pack public
+ *
+ * Every regular, non-executable file below the directory gets an index
+ * entry with its content type and ETag. Text files that shrink by at least
+ * a tenth also get a gzip variant. Executables are left out: they are CGI
+ * programs and still run from the directory.
+ */
+
+#include "segel.h"
+#include "bundle.h"
+#include "filetype.h"
+#include <zlib.h>
+#include <dirent.h>
+
+#define PACK_GZIP_MIN 256            // Smaller files are not worth compressing
+
+typedef struct PackFile {
+    char* path;                      // Relative to the packed directory
+    char* source;
+} PackFile;
+
+static PackFile* files;
+static int nfiles, cap_files;
+
+static char* strings;
+static size_t strings_size, strings_cap;
+
+static uint32_t addString(const char* s) {
+    size_t len = strlen(s) + 1;
+    uint32_t offset = strings_size;
+
+    if (strings_size + len > strings_cap) {
+        strings_cap = (strings_size + len) * 2;
+        strings = realloc(strings, strings_cap);
+        if (strings == NULL) {
+            exit(1);
+        }
+    }
+    memcpy(strings + strings_size, s, len);
+    strings_size += len;
+    return offset;
+}
+
+static void walk(const char* dir, const char* rel) {
+    DIR* d = opendir(dir);
+    struct dirent* ent;
+    char path[MAXLINE], sub[MAXLINE];
+    struct stat sbuf;
+
+    if (d == NULL) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        exit(1);
+    }
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        snprintf(sub, sizeof(sub), "%s%s%s", rel, rel[0] ? "/" : "", ent->d_name);
+        if (stat(path, &sbuf) < 0) {
+            continue;
+        }
+        if (S_ISDIR(sbuf.st_mode)) {
+            walk(path, sub);
+        }
+        else if (S_ISREG(sbuf.st_mode) && !(sbuf.st_mode & S_IXUSR)) {
+            if (nfiles == cap_files) {
+                cap_files = cap_files ? cap_files * 2 : 64;
+                files = realloc(files, sizeof(PackFile) * cap_files);
+                if (files == NULL) {
+                    exit(1);
+                }
+            }
+            files[nfiles].path = strdup(sub);
+            files[nfiles].source = strdup(path);
+            nfiles++;
+        }
+    }
+    closedir(d);
+}
+
+static int comparePaths(const void* a, const void* b) {
+    return strcmp(((const PackFile*)a)->path, ((const PackFile*)b)->path);
+}
+
+static char* readFile(const char* path, size_t* size) {
+    struct stat sbuf;
+    int fd = open(path, O_RDONLY);
+    char* data;
+
+    if (fd < 0 || fstat(fd, &sbuf) < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    data = malloc(sbuf.st_size + 1);
+    if (data == NULL || rio_readn(fd, data, sbuf.st_size) != sbuf.st_size) {
+        fprintf(stderr, "%s: read failed\n", path);
+        exit(1);
+    }
+    close(fd);
+    *size = sbuf.st_size;
+    return data;
+}
+
+// Returns a malloc'ed gzip stream of data, or NULL if it does not pay off
+static char* gzipData(const char* data, size_t size, size_t* out_size) {
+    z_stream z;
+    uLong bound;
+    char* out;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    bound = deflateBound(&z, size);
+    out = malloc(bound);
+    if (out == NULL) {
+        exit(1);
+    }
+    z.next_in = (Bytef*)data;
+    z.avail_in = size;
+    z.next_out = (Bytef*)out;
+    z.avail_out = bound;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END || z.total_out > size - size / 10) {
+        deflateEnd(&z);
+        free(out);
+        return NULL;
+    }
+    *out_size = z.total_out;
+    deflateEnd(&z);
+    return out;
+}
+
+static uint64_t hashData(const char* data, size_t size) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+// Pads the output to the payload alignment and returns the new offset
+static uint64_t writeAligned(FILE* out, uint64_t offset, const char* data, size_t size) {
+    static const char zeros[BUNDLE_ALIGN];
+    size_t pad = (BUNDLE_ALIGN - offset % BUNDLE_ALIGN) % BUNDLE_ALIGN;
+
+    if (fwrite(zeros, 1, pad, out) != pad || fwrite(data, 1, size, out) != size) {
+        fprintf(stderr, "write failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    return offset + pad;
+}
+
+int main(int argc, char* argv[]) {
+    BundleHeader header;
+    BundleEntry* entries;
+    FILE* out;
+    uint64_t offset;
+    size_t packed = 0, compressed = 0;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <bundle> <directory>\n", argv[0]);
+        exit(1);
+    }
+    walk(argv[2], "");
+    qsort(files, nfiles, sizeof(PackFile), comparePaths);
+
+    entries = calloc(nfiles ? nfiles : 1, sizeof(BundleEntry));
+    out = fopen(argv[1], "wb");
+    if (entries == NULL || out == NULL) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        exit(1);
+    }
+
+    // Header and index are written last, once the offsets are known
+    memset(&header, 0, sizeof(header));
+    offset = sizeof(BundleHeader) + sizeof(BundleEntry) * nfiles;
+    if (fseek(out, offset, SEEK_SET) < 0) {
+        exit(1);
+    }
+
+    for (int i = 0; i < nfiles; i++) {
+        BundleEntry* e = &entries[i];
+        const char* type = filetypeOf(files[i].path);
+        char etag[32];
+        size_t size, gz_size;
+        char* data = readFile(files[i].source, &size);
+        char* gz = NULL;
+
+        snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)hashData(data, size));
+        e->path = addString(files[i].path);
+        e->type = addString(type);
+        e->etag = addString(etag);
+
+        e->offset = writeAligned(out, offset, data, size);
+        e->size = size;
+        offset = e->offset + size;
+        packed += size;
+
+        if (strncmp(type, "text/", 5) == 0 && size >= PACK_GZIP_MIN && (gz = gzipData(data, size, &gz_size)) != NULL) {
+            e->gzip_offset = writeAligned(out, offset, gz, gz_size);
+            e->gzip_size = gz_size;
+            offset = e->gzip_offset + gz_size;
+            compressed++;
+            free(gz);
+        }
+        free(data);
+    }
+
+    header.strings_offset = offset;
+    header.strings_size = strings_size ? strings_size : 1;
+    if (strings_size == 0) {
+        addString("");
+    }
+    if (fwrite(strings, 1, strings_size, out) != strings_size) {
+        exit(1);
+    }
+    header.magic = BUNDLE_MAGIC;
+    header.version = BUNDLE_VERSION;
+    header.entry_size = sizeof(BundleEntry);
+    header.count = nfiles;
+    header.index_offset = sizeof(BundleHeader);
+    header.size = offset + strings_size;
+
+    if (fseek(out, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(entries, sizeof(BundleEntry), nfiles, out) != (size_t)nfiles || fclose(out) != 0) {
+        fprintf(stderr, "%s: write failed\n", argv[1]);
+        exit(1);
+    }
+    printf("%s: %d files, %zu bytes, %zu gzip variants\n", argv[1], nfiles, packed, compressed);
+    return 0;
+}
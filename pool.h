@@ -0,0 +1,19 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdatomic.h>
+#include "queue.h"
+
+#define POOL_MAX 4
+
+// A set of worker threads serving one queue, as the admin socket and
+// /metrics see it
+typedef struct Pool {
+    const char* name;
+    Queue* queue;
+    int vip;                     // Serves the queue's VIP ring; its settings belong to the regular pool
+    atomic_int threads;          // Configured size; running threads converge to it
+    int (*resize)(struct Pool* pool, int n);   // Returns -1 if refused
+} Pool;
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// Static USDT probes under the "oshw3" provider. With <sys/sdt.h> (systemtap-sdt-dev)
+// each is a nop plus an ELF note that perf, bpftrace and stap can attach to
+// at run time; without it, or with -DPROBES_DISABLE, they compile to nothing
+// and their arguments are not evaluated. Times are in ns, tid is the
+// thread's stats id (as in ./serverstat), fd the client connection.
+//
+//   accept        fd, listener fd
+//   enqueue       fd, vip, estimated cost (us), regular queue depth
+//   drop          fd, vip, ns since it was submitted
+//   dequeue       fd, tid, ns queued
+//   parse         fd, tid, uri, ns from dequeue
+//   serve__start  fd, tid, static
+//   serve__end    fd, tid, HTTP status, service ns, bytes written
+//   cgi__spawn    fd, pid, program
+//   cgi__reap     fd, pid, wait status (pair with cgi__spawn by pid for run times)
+//
+// For example:
+//   bpftrace -e 'usdt:./server:oshw3:serve__end { @[arg2] = hist(arg3); }'
+//
+// Every probe has an SDT semaphore, a counter the tracer raises while it is
+// attached, and its arguments (clock reads among them) are only evaluated
+// when it is non-zero. Untraced, a probe costs one load and a branch.
+
+#if !defined(PROBES_DISABLE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+// Weak, so every file using a probe can define its semaphore and the
+// programs linking only some of them (./sim, ./bench) still link
+#define PROBE_SEMAPHORE(name) \
+    __attribute__((weak, section(".probes"))) volatile unsigned short oshw3_##name##_semaphore;
+PROBE_SEMAPHORE(accept)
+PROBE_SEMAPHORE(enqueue)
+PROBE_SEMAPHORE(drop)
+PROBE_SEMAPHORE(dequeue)
+PROBE_SEMAPHORE(parse)
+PROBE_SEMAPHORE(serve__start)
+PROBE_SEMAPHORE(serve__end)
+PROBE_SEMAPHORE(cgi__spawn)
+PROBE_SEMAPHORE(cgi__reap)
+
+#define PROBE_ACTIVE(name) __builtin_expect(oshw3_##name##_semaphore != 0, 0)
+#define PROBE2(name, a, b) do { if (PROBE_ACTIVE(name)) STAP_PROBE2(oshw3, name, a, b); } while (0)
+#define PROBE3(name, a, b, c) do { if (PROBE_ACTIVE(name)) STAP_PROBE3(oshw3, name, a, b, c); } while (0)
+#define PROBE4(name, a, b, c, d) do { if (PROBE_ACTIVE(name)) STAP_PROBE4(oshw3, name, a, b, c, d); } while (0)
+#define PROBE5(name, a, b, c, d, e) do { if (PROBE_ACTIVE(name)) STAP_PROBE5(oshw3, name, a, b, c, d, e); } while (0)
+#else
+#define PROBE_ACTIVE(name) 0
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#define PROBE5(name, a, b, c, d, e) do { } while (0)
+#endif
+
+#endif
@@ -1,23 +1,51 @@
 #include "queue.h"
+#include "probes.h"
+#include "hugemem.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <stdint.h>
 
-void initQueue(Queue* q, int capacity) {
+const char* policy_names[POLICY_COUNT] = { "block", "drop_tail", "drop_head", "drop_random" };
+
+int policyFromName(const char* name) {
+    for (int i = 0; i < POLICY_COUNT; i++) {
+        if (strcmp(name, policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void closeDropped(Request req) {
+    close(req.connfd);
+}
+
+void initQueue(Queue* q, int capacity, OverloadPolicy policy) {
     q->capacity = capacity;
     q->size = 0;
-    q->front = 0;
-    q->rear = 0;
     q->vip_size = 0;
     q->vip_front = 0;
     q->vip_rear = 0;
+    q->policy = policy;
+    q->aging = 0;
+    q->cost = 0;
+    q->cost_capacity = 0;
+    q->seq = 0;
+    q->dropped = 0;
+    q->on_drop = closeDropped;
+    q->notify_fd = -1;
+    q->waiting = 0;
+    q->retire = 0;
+    q->vip_retire = 0;
 
-    q->buffer = malloc(sizeof(Request) * capacity);
+    // Rings are walked by every producer and worker; -H huge keeps them on huge pages
+    q->buffer = hugememAlloc(MEM_QUEUE, sizeof(Request) * capacity);
     if (q->buffer == NULL) {
         exit(1);
     }
 
-    q->vip_buffer = malloc(sizeof(Request) * capacity);
+    q->vip_buffer = hugememAlloc(MEM_QUEUE, sizeof(Request) * capacity);
     if (q->vip_buffer == NULL) {
         exit(1);
     }
@@ -25,58 +53,406 @@ void initQueue(Queue* q, int capacity) {
     pthread_mutex_init(&q->lock, NULL);
     pthread_cond_init(&q->not_empty, NULL);
     pthread_cond_init(&q->not_full, NULL);
+    pthread_cond_init(&q->vip_not_empty, NULL);
 }
 
-void enqueue(Queue* q, Request req, int is_vip) {
-    pthread_mutex_lock(&q->lock);
+// Caller holds the lock
+static void dropRequest(Queue* q, Request req) {
+    PROBE3(drop, req.connfd, req.is_vip, clockToNs(clockNow() - req.trace.stamp[STAGE_ENQUEUE]));
+    q->on_drop(req);
+    __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+}
 
-    if (isQueueFull(q)) {
-        pthread_mutex_unlock(&q->lock);
-        return;
+/**********************************
+ * Regular queue heap
+ **********************************/
+
+static int servedBefore(const Request* a, const Request* b) {
+    return a->key != b->key ? a->key < b->key : a->seq < b->seq;
+}
+
+static void heapUp(Queue* q, int i) {
+    Request req = q->buffer[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!servedBefore(&req, &q->buffer[parent])) {
+            break;
+        }
+        q->buffer[i] = q->buffer[parent];
+        i = parent;
+    }
+    q->buffer[i] = req;
+}
+
+static void heapDown(Queue* q, int i) {
+    Request req = q->buffer[i];
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= q->size) {
+            break;
+        }
+        if (child + 1 < q->size && servedBefore(&q->buffer[child + 1], &q->buffer[child])) {
+            child++;
+        }
+        if (!servedBefore(&q->buffer[child], &req)) {
+            break;
+        }
+        q->buffer[i] = q->buffer[child];
+        i = child;
     }
+    q->buffer[i] = req;
+}
 
-    if (is_vip) {
+//
+// Caller holds the lock. Without aging every key is 0 and requests leave in
+// arrival order. With it the key is the enqueue time in us plus aging times
+// the estimated cost: cheap requests overtake expensive ones, but only those
+// that arrived less than aging x (cost difference) earlier, so nothing waits
+// forever behind a stream of cheap requests. The enqueue time is the one the
+// caller stamped, so ./sim can run the queue on its virtual clock. A request
+// back from the I/O pool keeps the key and seq it was first queued with, and
+// so its place ahead of everything that arrived while it was parked.
+//
+static void pushRegular(Queue* q, Request req) {
+    if (!req.parked) {
+        req.seq = q->seq++;
+        req.key = 0;
+        if (q->aging > 0) {
+            req.key = clockToNs(req.trace.stamp[STAGE_ENQUEUE]) / 1000 + (unsigned long)q->aging * req.cost;
+        }
+    }
+    q->cost += req.cost;
+    q->buffer[q->size++] = req;
+    heapUp(q, q->size - 1);
+}
+
+// Caller holds the lock
+static Request removeRegular(Queue* q, int i) {
+    Request req = q->buffer[i];
+
+    q->cost -= req.cost;
+    q->size--;
+    if (i < q->size) {
+        q->buffer[i] = q->buffer[q->size];
+        heapDown(q, i);
+        heapUp(q, i);
+    }
+    return req;
+}
+
+// Caller holds the lock. Also full when req would push the estimated cost
+// past cost_capacity, unless the queue is empty.
+static int regularFull(Queue* q, Request* req) {
+    if (q->size == q->capacity) {
+        return 1;
+    }
+    return q->cost_capacity > 0 && q->size > 0 && q->cost + req->cost > q->cost_capacity;
+}
+
+// Caller holds the lock. Wakes consumers for requests added so far: one
+// signal for a single request, a broadcast for several.
+static void wakeConsumers(Queue* q, int* regular, int* vip) {
+    if (*regular == 1) {
+        pthread_cond_signal(&q->not_empty);
+    }
+    else if (*regular > 1) {
+        pthread_cond_broadcast(&q->not_empty);
+    }
+    if (*vip == 1) {
+        pthread_cond_signal(&q->vip_not_empty);
+    }
+    else if (*vip > 1) {
+        pthread_cond_broadcast(&q->vip_not_empty);
+    }
+    if (*regular > 0 && q->notify_fd >= 0) {
+        // Wake coroutine schedulers; a failed write only means plenty are due
+        uint64_t tokens = *regular;
+        ssize_t rc = write(q->notify_fd, &tokens, sizeof(tokens));
+        (void)rc;
+    }
+    *regular = *vip = 0;
+}
+
+//
+// Caller holds the lock. Adds one request, applying the overload policy
+// when the queue is full; regular and vip count requests added but not yet
+// signalled, they are flushed before blocking. Returns 0 if the request
+// itself was dropped (its connection is closed).
+//
+static int enqueueLocked(Queue* q, Request req, int* regular, int* vip) {
+    if (req.is_vip) {
+        // VIP requests are never traded for others: wait or drop the new one
+        while (q->vip_size == q->capacity && q->policy == POLICY_BLOCK) {
+            wakeConsumers(q, regular, vip);
+            pthread_cond_wait(&q->not_full, &q->lock);
+        }
+        if (q->vip_size == q->capacity) {
+            dropRequest(q, req);
+            return 0;
+        }
+    }
+    else if (regularFull(q, &req)) {
+        switch (q->policy) {
+        case POLICY_BLOCK:
+            while (regularFull(q, &req)) {
+                wakeConsumers(q, regular, vip);
+                pthread_cond_wait(&q->not_full, &q->lock);
+            }
+            break;
+        case POLICY_DROP_TAIL:
+            dropRequest(q, req);
+            return 0;
+        case POLICY_DROP_HEAD:
+            // The head is the request that would be served next
+            while (regularFull(q, &req)) {
+                dropRequest(q, removeRegular(q, 0));
+            }
+            break;
+        case POLICY_DROP_RANDOM:
+            dropRandomRequests(q, 50);
+            if (regularFull(q, &req)) {
+                dropRequest(q, req);
+                return 0;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (req.is_vip) {
         q->vip_buffer[q->vip_rear] = req;
         q->vip_rear = (q->vip_rear + 1) % q->capacity;
         q->vip_size++;
+        (*vip)++;
     }
     else {
-        q->buffer[q->rear] = req;
-        q->rear = (q->rear + 1) % q->capacity;
-        q->size++;
+        pushRegular(q, req);
+        (*regular)++;
     }
+    PROBE4(enqueue, req.connfd, req.is_vip, req.cost, q->size);
+    return 1;
+}
+
+//
+// Adds a request, applying the overload policy when the queue is full.
+// Returns 0 if the request itself was dropped (its connection is closed).
+//
+int enqueue(Queue* q, Request req, int is_vip) {
+    req.is_vip = is_vip;
+    return enqueueBatch(q, &req, 1);
+}
+
+//
+// Adds n requests (each to the queue its is_vip selects) under one lock
+// acquisition. Returns how many were queued rather than dropped.
+//
+int enqueueBatch(Queue* q, Request* reqs, int n) {
+    int regular = 0, vip = 0, queued = 0;
 
-    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_lock(&q->lock);
+    for (int i = 0; i < n; i++) {
+        queued += enqueueLocked(q, reqs[i], &regular, &vip);
+    }
+    wakeConsumers(q, &regular, &vip);
     pthread_mutex_unlock(&q->lock);
+    return queued;
+}
+
+//
+// Adds a request without ever waiting: a queue that is full under the block
+// policy refuses it (-1) and leaves its connection to the caller. The drop
+// policies apply as in enqueue, so 0 means it was dropped and closed.
+//
+int tryEnqueue(Queue* q, Request req) {
+    int regular = 0, vip = 0, queued = -1;
+
+    pthread_mutex_lock(&q->lock);
+    int full = req.is_vip ? q->vip_size == q->capacity : regularFull(q, &req);
+    if (!full || q->policy != POLICY_BLOCK) {
+        queued = enqueueLocked(q, req, &regular, &vip);
+        wakeConsumers(q, &regular, &vip);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return queued;
+}
+
+// Caller holds the lock
+static int takeRequests(Queue* q, Request* out, int max, int is_vip) {
+    int n = 0;
+
+    if (is_vip) {
+        for (; n < max && q->vip_size > 0; n++) {
+            out[n] = q->vip_buffer[q->vip_front];
+            q->vip_front = (q->vip_front + 1) % q->capacity;
+            q->vip_size--;
+        }
+    }
+    // The VIP thread helps out with regular requests when it has none
+    if (n == 0) {
+        for (; n < max && !isQueueEmpty(q); n++) {
+            out[n] = removeRegular(q, 0);
+        }
+    }
+    if (n > 0) {
+        pthread_cond_broadcast(&q->not_full);
+    }
+    return n;
 }
 
 Request dequeue(Queue* q, int is_vip) {
-    Request req;
+    Request req = { .connfd = -1 };
 
     pthread_mutex_lock(&q->lock);
+    takeRequests(q, &req, 1, is_vip);
+    pthread_mutex_unlock(&q->lock);
+    return req;
+}
+
+//
+// Waits until there is a request for the caller (a VIP one when vip is set)
+// and takes up to max of them under the same lock acquisition. Returns 0
+// when the caller has been retired by queueRetire and should exit.
+//
+int dequeueBatch(Queue* q, Request* out, int max, int is_vip) {
+    int* retire = is_vip ? &q->vip_retire : &q->retire;
+    int n;
 
-    if (isQueueEmpty(q)) {
+    pthread_mutex_lock(&q->lock);
+    if (is_vip) {
+        while (q->vip_size == 0 && *retire == 0) {
+            pthread_cond_wait(&q->vip_not_empty, &q->lock);
+        }
+    }
+    else {
+        __atomic_store_n(&q->waiting, q->waiting + 1, __ATOMIC_RELAXED);
+        while (isQueueEmpty(q) && *retire == 0) {
+            pthread_cond_wait(&q->not_empty, &q->lock);
+        }
+        __atomic_store_n(&q->waiting, q->waiting - 1, __ATOMIC_RELAXED);
+    }
+    if (*retire > 0) {
+        (*retire)--;
         pthread_mutex_unlock(&q->lock);
-        return (Request) { -1, { 0, 0 } };
+        return 0;
     }
+    n = takeRequests(q, out, max, is_vip);
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
 
-    if (is_vip && q->vip_size > 0) {
-        req = q->vip_buffer[q->vip_front];
-        q->vip_front = (q->vip_front + 1) % q->capacity;
-        q->vip_size--;
+/**********************************
+ * Runtime reconfiguration
+ **********************************/
+
+static Request* migrateRing(Request* old, int old_capacity, int front, int size, int capacity) {
+    Request* ring = hugememAlloc(MEM_QUEUE, sizeof(Request) * capacity);
+    if (ring == NULL) {
+        return NULL;
     }
-    else {
-        req = q->buffer[q->front];
-        q->front = (q->front + 1) % q->capacity;
-        q->size--;
+    for (int i = 0; i < size; i++) {
+        ring[i] = old[(front + i) % old_capacity];
+    }
+    return ring;
+}
+
+//
+// Reallocates both rings to the new capacity, keeping queued requests in
+// order. Refused (-1) when the queued requests would not fit.
+//
+int resizeQueue(Queue* q, int capacity) {
+    Request *buffer, *vip_buffer;
+
+    if (capacity < 1) {
+        return -1;
+    }
+    pthread_mutex_lock(&q->lock);
+    if (capacity < q->size || capacity < q->vip_size) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
     }
+    // The heap keeps its layout, only the VIP ring is unrolled
+    buffer = migrateRing(q->buffer, q->capacity, 0, q->size, capacity);
+    vip_buffer = migrateRing(q->vip_buffer, q->capacity, q->vip_front, q->vip_size, capacity);
+    if (buffer == NULL || vip_buffer == NULL) {
+        pthread_mutex_unlock(&q->lock);
+        hugememFree(MEM_QUEUE, buffer);
+        hugememFree(MEM_QUEUE, vip_buffer);
+        return -1;
+    }
+    hugememFree(MEM_QUEUE, q->buffer);
+    hugememFree(MEM_QUEUE, q->vip_buffer);
+    q->buffer = buffer;
+    q->vip_buffer = vip_buffer;
+    q->vip_front = 0;
+    q->vip_rear = q->vip_size % capacity;
+    __atomic_store_n(&q->capacity, capacity, __ATOMIC_RELAXED);
+    // Producers blocked on a full queue may fit now
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
 
+void setQueuePolicy(Queue* q, OverloadPolicy policy) {
+    pthread_mutex_lock(&q->lock);
+    __atomic_store_n(&q->policy, policy, __ATOMIC_RELAXED);
+    // Blocked producers re-check the queue under the new policy
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+//
+// Switches between FIFO (0) and shortest-job-first with the given aging
+// factor. Requests already queued keep their place.
+//
+void setQueueAging(Queue* q, int aging) {
+    pthread_mutex_lock(&q->lock);
+    q->aging = aging > 0 ? aging : 0;
+    pthread_mutex_unlock(&q->lock);
+}
+
+void setQueueCostCapacity(Queue* q, unsigned long cost_capacity) {
+    pthread_mutex_lock(&q->lock);
+    q->cost_capacity = cost_capacity;
+    pthread_cond_broadcast(&q->not_full);
     pthread_mutex_unlock(&q->lock);
-    return req;
+}
+
+//
+// Asks that many workers and VIP threads to exit. Each consumes one token
+// at its next dequeue, so busy threads finish their current request first.
+//
+void queueRetire(Queue* q, int workers, int vip) {
+    pthread_mutex_lock(&q->lock);
+    q->retire += workers;
+    q->vip_retire += vip;
+    if (workers > 0) {
+        pthread_cond_broadcast(&q->not_empty);
+    }
+    if (vip > 0) {
+        pthread_cond_broadcast(&q->vip_not_empty);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+//
+// Takes back up to n retirements not yet picked up, for a pool that grows
+// again before its threads noticed the shrink. Returns how many it took.
+//
+int queueCancelRetire(Queue* q, int n, int vip) {
+    int* retire = vip ? &q->vip_retire : &q->retire;
+
+    pthread_mutex_lock(&q->lock);
+    if (n > *retire) {
+        n = *retire;
+    }
+    *retire -= n;
+    pthread_mutex_unlock(&q->lock);
+    return n;
 }
 
 int isQueueFull(Queue* q) {
-    return q->size == q->capacity;
+    return q->size == q->capacity || (q->cost_capacity > 0 && q->cost >= q->cost_capacity);
 }
 
 int isQueueEmpty(Queue* q) {
@@ -84,22 +460,18 @@ int isQueueEmpty(Queue* q) {
 }
 
 void destroyQueue(Queue* q) {
-    free(q->buffer);
+    hugememFree(MEM_QUEUE, q->buffer);
+    hugememFree(MEM_QUEUE, q->vip_buffer);
     pthread_mutex_destroy(&q->lock);
     pthread_cond_destroy(&q->not_empty);
     pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->vip_not_empty);
 }
 
+// Caller holds the lock
 void dropRandomRequests(Queue* q, int percentage) {
     int to_remove = (q->size * percentage) / 100;
     for (int i = 0; i < to_remove; i++) {
-        int rand_index = (q->front + rand() % q->size) % q->capacity;
-        for (int j = rand_index; j != q->rear; j = (j + 1) % q->capacity) {
-            q->buffer[j] = q->buffer[(j + 1) % q->capacity];
-        }
-        q->rear = (q->rear - 1 + q->capacity) % q->capacity;
-        q->size--;
+        dropRequest(q, removeRegular(q, rand() % q->size));
     }
 }
-
-
@@ -3,29 +3,67 @@
 
 #include <pthread.h>
 #include "segel.h"
+#include "trace.h"
 
 typedef struct Request {
     int connfd;
-    struct timeval arrival;
+    int is_vip;
+    int is_static;           // Classified like isStaticRequest, picks the pool
+    unsigned long cost;      // Estimated service time in us, see cost.h (0 = unknown)
+    int parked;              // Came back from the I/O pool, see iopool.h
+    unsigned long key;       // Set by the queue: serve order, then arrival order
+    unsigned long seq;
+    RequestTrace trace;
 } Request;
 
+// Overload policies, selected by the schedalg argument
+typedef enum {
+    POLICY_BLOCK,
+    POLICY_DROP_TAIL,
+    POLICY_DROP_HEAD,
+    POLICY_DROP_RANDOM,
+    POLICY_COUNT
+} OverloadPolicy;
+
+extern const char* policy_names[POLICY_COUNT];
+
 typedef struct Queue {
-    Request* buffer;     // Regular queue
+    Request* buffer;     // Regular queue, a binary heap on (key, seq)
     Request* vip_buffer; // VIP queue
     int capacity;
     int size;
     int vip_size;        // Number of VIP requests
-    int front, rear;
     int vip_front, vip_rear;
+    OverloadPolicy policy;
+    int aging;           // 0 = FIFO, otherwise shortest estimated job first, see enqueue
+    unsigned long cost;          // Estimated cost of the regular requests queued, us
+    unsigned long cost_capacity; // Full once cost reaches this (0 = count only)
+    unsigned long seq;   // Regular requests ever queued
+    unsigned long dropped;   // Requests dropped by the policy, read without the lock
+    void (*on_drop)(Request req);  // Disposes of a dropped request, closes it by default
+    int notify_fd;       // eventfd bumped per regular request for coroutine workers (-1 = none)
+    int waiting;         // Regular consumers blocked in dequeueBatch, read without the lock
+    int retire;          // Workers asked to exit at their next dequeue
+    int vip_retire;      // Same for VIP threads
     pthread_mutex_t lock;
     pthread_cond_t not_empty;
     pthread_cond_t not_full;
     pthread_cond_t vip_not_empty; 
 } Queue;
 
-void initQueue(Queue* q, int capacity);
-void enqueue(Queue* q, Request req, int is_vip);
+int policyFromName(const char* name);
+void initQueue(Queue* q, int capacity, OverloadPolicy policy);
+int enqueue(Queue* q, Request req, int is_vip);
+int enqueueBatch(Queue* q, Request* reqs, int n);
+int tryEnqueue(Queue* q, Request req);
 Request dequeue(Queue* q, int vip);
+int dequeueBatch(Queue* q, Request* out, int max, int vip);
+int resizeQueue(Queue* q, int capacity);
+void setQueuePolicy(Queue* q, OverloadPolicy policy);
+void setQueueAging(Queue* q, int aging);
+void setQueueCostCapacity(Queue* q, unsigned long cost_capacity);
+void queueRetire(Queue* q, int workers, int vip);
+int queueCancelRetire(Queue* q, int n, int vip);
 int isQueueEmpty(Queue* q);
 int isQueueFull(Queue* q);
 void dropRandomRequests(Queue* q, int percentage);
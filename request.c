@@ -2,29 +2,62 @@
 // request.c: Does the bulk of the work for the web server.
 //
 
+// splice
+#define _GNU_SOURCE
 #include "segel.h"
 #include "request.h"
+#include "cache.h"
+#include "metrics.h"
+#include "arena.h"
+#include "coro.h"
+#include "cgicache.h"
+#include "h2.h"
+#include "writer.h"
+#include "cost.h"
+#include "bundle.h"
+#include "filetype.h"
+#include "probes.h"
 
-pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+//
+// Writes all of buf to the client. A client that went away or reset the
+// connection fails only its own request: the error is counted and the
+// caller stops sending.
+//
+static int requestWrite(int fd, const void* buf, size_t len) {
+    if (rio_writen(fd, (void*)buf, len) < 0) {
+        metricsIoError(IO_WRITE, errno);
+        return -1;
+    }
+    return 0;
+}
 
 //
 // Handles errors and sends error response to the client
 //
-void requestError(int fd, char* cause, char* errnum, char* shortmsg, char* longmsg, struct timeval arrival, struct timeval dispatch, threads_stats t_stats) {
-    char buf[MAXLINE], body[MAXBUF];
-
-    sprintf(body, "<html><title>OS-HW3 Error</title>");
-    sprintf(body, "%s<body bgcolor=\"ffffff\">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr>OS-HW3 Web Server\r\n", body);
-
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    sprintf(buf, "%sContent-Type: text/html\r\n", buf);
-    sprintf(buf, "%sContent-Length: %lu\r\n\r\n", buf, strlen(body));
-
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+void requestError(int fd, char* cause, char* errnum, char* shortmsg, char* longmsg, RequestTrace* trace, threads_stats t_stats) {
+    char buf[REQUEST_HEADER_MAX], body[REQUEST_ERROR_MAX];
+
+    // The cause is client controlled (the URI), so it is truncated
+    snprintf(body, sizeof(body),
+             "<html><title>OS-HW3 Error</title><body bgcolor=\"ffffff\">\r\n"
+             "%s: %s\r\n"
+             "<p>%s: %.256s\r\n"
+             "<hr>OS-HW3 Web Server\r\n",
+             errnum, shortmsg, longmsg, cause);
+
+    snprintf(buf, sizeof(buf),
+             "HTTP/1.0 %s %s\r\n"
+             "Content-Type: text/html\r\n"
+             "Content-Length: %lu\r\n\r\n",
+             errnum, shortmsg, strlen(body));
+
+    traceStamp(trace, STAGE_FIRST_BYTE);
+    if (requestWrite(fd, buf, strlen(buf)) == 0) {
+        requestWrite(fd, body, strlen(body));
+    }
+    traceStamp(trace, STAGE_LAST_BYTE);
+    trace->status = atoi(errnum);
+    trace->bytes = strlen(buf) + strlen(body);
 }
 
 //
@@ -33,10 +66,123 @@ void requestError(int fd, char* cause, char* errnum, char* shortmsg, char* longm
 void requestReadhdrs(rio_t* rp) {
     char buf[MAXLINE];
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    while (strcmp(buf, "\r\n")) {
-        Rio_readlineb(rp, buf, MAXLINE);
+    do {
+        if (rio_readlineb(rp, buf, MAXLINE) <= 0) {
+            return;     // The client closed or reset first
+        }
+    } while (strcmp(buf, "\r\n"));
+}
+
+//
+// Reads the request head (request line and headers) into an arena that is
+// grown as needed. Bytes read past the head stay in the arena as the start of
+// the body. Returns 1 on success, 0 if the client sent nothing, -1 if the
+// head is malformed and -2 if it does not fit in ARENA_MAX.
+//
+int requestReadHead(int fd, Arena** ap, RequestHead* head) {
+    Arena* a = *ap;
+    size_t scanned = 0;
+    ssize_t n;
+
+    while (1) {
+        // Look for the empty line that ends the head
+        for (; scanned < a->used; scanned++) {
+            if (a->data[scanned] != '\n') {
+                continue;
+            }
+            size_t end = 0;
+            if (scanned + 1 < a->used && a->data[scanned + 1] == '\n') {
+                end = scanned + 2;
+            }
+            else if (scanned + 2 < a->used && a->data[scanned + 1] == '\r' && a->data[scanned + 2] == '\n') {
+                end = scanned + 3;
+            }
+            else if (scanned + 2 >= a->used) {
+                break;    // Need more bytes to tell
+            }
+            if (end) {
+                a->data[scanned + 1] = '\0';
+                head->body = a->data + end;
+                head->body_len = a->used - end;
+                goto parse;
+            }
+        }
+
+        if (a->used == a->size) {
+            if (a->size >= ARENA_MAX) {
+                return -2;
+            }
+            Arena* bigger = arenaGrow(a, a->size * 2);
+            if (bigger == NULL) {
+                return -2;
+            }
+            *ap = a = bigger;
+        }
+        n = read(fd, a->data + a->used, a->size - a->used);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (rio_wait(fd, POLLIN) < 0) {
+                return a->used ? -1 : 0;
+            }
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0) {
+                metricsIoError(IO_READ, errno);
+            }
+            if (a->used == 0) {
+                return 0;
+            }
+            if (memchr(a->data, '\n', a->used) == NULL || a->used == a->size) {
+                return -1;
+            }
+            // Client closed before the empty line, take what we have
+            a->data[a->used] = '\0';
+            head->body = a->data + a->used;
+            head->body_len = 0;
+            goto parse;
+        }
+        a->used += n;
+    }
+
+parse:
+    head->method = a->data;
+    head->headers = strchr(a->data, '\n');
+    *head->headers++ = '\0';
+    if (head->headers - a->data >= 2 && head->headers[-2] == '\r') {
+        head->headers[-2] = '\0';
+    }
+
+    char* save;
+    head->method = strtok_r(head->method, " \t", &save);
+    head->uri = strtok_r(NULL, " \t", &save);
+    head->version = strtok_r(NULL, " \t", &save);
+    return head->version != NULL ? 1 : -1;
+}
+
+//
+// Copies the value of header name (case-insensitive) into value, trimmed.
+// Returns 1 if the header is present.
+//
+int requestGetHeader(RequestHead* head, const char* name, char* value, size_t cap) {
+    size_t name_len = strlen(name);
+    const char* line = head->headers;
+
+    while (line != NULL && *line != '\0') {
+        const char* eol = strchr(line, '\n');
+        const char* end = eol ? eol : line + strlen(line);
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char* v = line + name_len + 1;
+            while (v < end && (*v == ' ' || *v == '\t')) v++;
+            while (end > v && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) end--;
+            snprintf(value, cap, "%.*s", (int)(end - v), v);
+            return 1;
+        }
+        line = eol ? eol + 1 : NULL;
     }
+    return 0;
 }
 
 //
@@ -52,7 +198,7 @@ int requestParseURI(char* uri, char* filename, char* cgiargs) {
 
     if (!strstr(uri, "cgi")) {
         strcpy(cgiargs, "");
-        sprintf(filename, "./public/%s", uri);
+        sprintf(filename, "./public/%s", uri[0] == '/' ? uri + 1 : uri);
         if (uri[strlen(uri) - 1] == '/') {
             strcat(filename, "home.html");
         }
@@ -67,7 +213,7 @@ int requestParseURI(char* uri, char* filename, char* cgiargs) {
         else {
             strcpy(cgiargs, "");
         }
-        sprintf(filename, "./public/%s", uri);
+        sprintf(filename, "./public/%s", uri[0] == '/' ? uri + 1 : uri);
         return 0;
     }
 }
@@ -75,61 +221,582 @@ int requestParseURI(char* uri, char* filename, char* cgiargs) {
 //
 // Determines file type based on filename
 //
-void requestGetFiletype(char* filename, char* filetype) {
-    if (strstr(filename, ".html"))
-        strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif"))
-        strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".jpg"))
-        strcpy(filetype, "image/jpeg");
-    else
-        strcpy(filetype, "text/plain");
+const char* requestGetFiletype(const char* filename) {
+    return filetypeOf(filename);
 }
 
 //
 // Serves static content (HTML, images, etc.)
 //
-void requestServeStatic(int fd, char* filename, int filesize, struct timeval arrival, struct timeval dispatch, threads_stats t_stats) {
+void requestServeStatic(int fd, char* filename, int filesize, RequestTrace* trace, threads_stats t_stats) {
     int srcfd;
-    char* srcp, filetype[MAXLINE], buf[MAXBUF];
+    char buf[REQUEST_HEADER_MAX];
+    const char* filetype = requestGetFiletype(filename);
 
-    requestGetFiletype(filename, filetype);
-
-    srcfd = Open(filename, O_RDONLY, 0);
+    srcfd = open(filename, O_RDONLY);
+    traceStamp(trace, STAGE_LOOKUP);
     if (srcfd < 0) {
-        requestError(fd, filename, "404", "Not Found", "File not found", arrival, dispatch, t_stats);
+        metricsIoError(IO_OPEN, errno);
+        if (errno == EACCES) {
+            requestError(fd, filename, "403", "Forbidden", "Server could not read the file", trace, t_stats);
+        }
+        else {
+            requestError(fd, filename, "404", "Not Found", "File not found", trace, t_stats);
+        }
         return;
     }
 
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    Close(srcfd);
+    snprintf(buf, sizeof(buf),
+             "HTTP/1.0 200 OK\r\n"
+             "Server: OS-HW3 Web Server\r\n"
+             "Content-Length: %d\r\n"
+             "Content-Type: %s\r\n\r\n",
+             filesize, filetype);
+
+    traceStamp(trace, STAGE_FIRST_BYTE);
+    if (requestWrite(fd, buf, strlen(buf)) == 0) {
+        writerSend(fd, srcfd, 0, NULL, filesize);
+    }
+    else {
+        close(srcfd);
+    }
+    traceStamp(trace, STAGE_LAST_BYTE);
+    trace->status = 200;
+    trace->bytes = strlen(buf) + filesize;
+}
 
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: OS-HW3 Web Server\r\n", buf);
-    sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-Type: %s\r\n\r\n", buf, filetype);
+//
+// Serves a static file straight from the warm-up cache
+//
+void requestServeCached(int fd, CacheEntry* entry, RequestTrace* trace) {
+    traceStamp(trace, STAGE_FIRST_BYTE);
+    if (requestWrite(fd, entry->header, entry->header_len) == 0 && entry->size > 0) {
+        writerSend(fd, -1, 0, entry->data, entry->size);
+    }
+    traceStamp(trace, STAGE_LAST_BYTE);
+    trace->status = 200;
+    trace->bytes = entry->header_len + entry->size;
+}
 
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, srcp, filesize);
-    Munmap(srcp, filesize);
+//
+// Whether an Accept-Encoding list takes coding: named with a non-zero
+// q-value, or not named while "*" has one. "gzip;q=0" is a refusal.
+//
+static int requestAcceptsEncoding(const char* list, const char* coding) {
+    size_t len = strlen(coding);
+    int star = 0;
+
+    while (*list != '\0') {
+        const char* end = list + strcspn(list, ",");
+        const char* name = list + strspn(list, " \t");
+        size_t name_len = strcspn(name, " \t;,");
+        double q = 1.0;
+
+        // The only parameter that matters is q, e.g. "gzip; q=0.5"
+        for (const char* param = memchr(name, ';', end - name); param != NULL && param < end;
+             param = memchr(param + 1, ';', end - param - 1)) {
+            const char* p = param + 1 + strspn(param + 1, " \t");
+            if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                q = strtod(p + 2, NULL);
+            }
+        }
+        if (name_len == len && strncasecmp(name, coding, len) == 0) {
+            return q > 0;
+        }
+        if (name_len == 1 && name[0] == '*') {
+            star = q > 0;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return star;
 }
 
 //
-// Serves dynamic content (CGI execution)
+// Serves a static file out of the asset bundle. The gzip variant goes to
+// clients that accept it, and a matching If-None-Match gets a 304.
 //
-void requestServeDynamic(int fd, char* filename, char* cgiargs) {
-    char buf[MAXLINE], * emptylist[] = { NULL };
+void requestServeBundle(int fd, RequestHead* head, const BundleEntry* entry, RequestTrace* trace) {
+    char buf[REQUEST_HEADER_MAX], value[REQUEST_HEADER_MAX], etag[64];
+    const char* tag = bundleString(entry->etag);
+    int gzip = 0;
+    uint64_t offset = entry->offset, size = entry->size;
+
+    if (entry->gzip_size > 0 && requestGetHeader(head, "Accept-Encoding", value, sizeof(value)) &&
+        requestAcceptsEncoding(value, "gzip")) {
+        gzip = 1;
+        offset = entry->gzip_offset;
+        size = entry->gzip_size;
+    }
+    // Variants are different representations, so they get different tags
+    snprintf(etag, sizeof(etag), "%.*s%s\"", (int)strlen(tag) - 1, tag, gzip ? "-gz" : "");
+
+    if (requestGetHeader(head, "If-None-Match", value, sizeof(value)) && (strstr(value, etag) || strcmp(value, "*") == 0)) {
+        snprintf(buf, sizeof(buf),
+                 "HTTP/1.0 304 Not Modified\r\n"
+                 "Server: OS-HW3 Web Server\r\n"
+                 "ETag: %s\r\n"
+                 "%s\r\n",
+                 etag, entry->gzip_size > 0 ? "Vary: Accept-Encoding\r\n" : "");
+        traceStamp(trace, STAGE_FIRST_BYTE);
+        requestWrite(fd, buf, strlen(buf));
+        traceStamp(trace, STAGE_LAST_BYTE);
+        trace->status = 304;
+        trace->bytes = strlen(buf);
+        return;
+    }
 
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: OS-HW3 Web Server\r\n\r\n", buf);
-    Rio_writen(fd, buf, strlen(buf));
+    snprintf(buf, sizeof(buf),
+             "HTTP/1.0 200 OK\r\n"
+             "Server: OS-HW3 Web Server\r\n"
+             "Content-Length: %lu\r\n"
+             "Content-Type: %s\r\n"
+             "ETag: %s\r\n"
+             "%s%s\r\n",
+             (unsigned long)size, bundleString(entry->type), etag,
+             gzip ? "Content-Encoding: gzip\r\n" : "",
+             entry->gzip_size > 0 ? "Vary: Accept-Encoding\r\n" : "");
+
+    traceStamp(trace, STAGE_FIRST_BYTE);
+    if (requestWrite(fd, buf, strlen(buf)) == 0 && size > 0) {
+        writerSend(fd, -1, 0, bundleData(offset), size);
+    }
+    traceStamp(trace, STAGE_LAST_BYTE);
+    trace->status = 200;
+    trace->bytes = strlen(buf) + size;
+}
 
-    if (fork() == 0) {
+//
+// Serves the Prometheus metrics page
+//
+void requestServeMetrics(int fd, RequestTrace* trace) {
+    char buf[REQUEST_HEADER_MAX];
+    size_t len;
+    char* body = metricsRender(&len);
+
+    if (body == NULL) {
+        requestError(fd, METRICS_URI, "503", "Service Unavailable", "Server could not allocate the metrics page", trace, NULL);
+        return;
+    }
+    snprintf(buf, sizeof(buf),
+             "HTTP/1.0 200 OK\r\n"
+             "Server: OS-HW3 Web Server\r\n"
+             "Content-Length: %lu\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n\r\n",
+             len);
+
+    traceStamp(trace, STAGE_FIRST_BYTE);
+    if (requestWrite(fd, buf, strlen(buf)) == 0) {
+        requestWrite(fd, body, len);
+    }
+    traceStamp(trace, STAGE_LAST_BYTE);
+    trace->status = 200;
+    trace->bytes = strlen(buf) + len;
+    free(body);
+}
+
+//
+// Runs a CGI program with stdout on the client socket, or on out_fd when
+// it is not -1. Returns the child's pid (-1 if fork failed).
+//
+static pid_t requestSpawnCgi(int fd, RequestHead* head, char* filename, char* cgiargs, long body, int in_fd, int out_fd) {
+    char* emptylist[] = { NULL };
+    char value[REQUEST_HEADER_MAX];
+    pid_t pid;
+
+    if ((pid = fork()) == 0) {
+        sigset_t none;
+
+        // The server ignores SIGPIPE and blocks SIGUSR1 for the trace
+        // reporter; the program gets the usual defaults
+        signal(SIGPIPE, SIG_DFL);
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
         setenv("QUERY_STRING", cgiargs, 1);
-        dup2(fd, STDOUT_FILENO);
+        setenv("REQUEST_METHOD", head->method ? head->method : "GET", 1);
+        if (body >= 0) {
+            snprintf(value, sizeof(value), "%ld", body);
+            setenv("CONTENT_LENGTH", value, 1);
+        }
+        if (requestGetHeader(head, "Content-Type", value, sizeof(value))) {
+            setenv("CONTENT_TYPE", value, 1);
+        }
+        if (out_fd < 0) {
+            // The program expects a blocking stdout (coroutine mode sets O_NONBLOCK)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            out_fd = fd;
+        }
+        if (in_fd >= 0) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        dup2(out_fd, STDOUT_FILENO);
         execve(filename, emptylist, environ);
+        _exit(1);
+    }
+    if (pid < 0) {
+        metricsIoError(IO_CGI, errno);
+    }
+    else {
+        PROBE3(cgi__spawn, fd, pid, filename);
+    }
+    return pid;
+}
+
+// Reaps only our own child; other workers have CGI programs running too
+static int requestWaitCgi(int fd, pid_t pid, int* status) {
+    int local = 0;
+    int rc = coroWaitChild(pid, &local);
+
+    PROBE3(cgi__reap, fd, pid, local);
+    if (status != NULL) {
+        *status = local;
+    }
+    return rc;
+}
+
+//
+// Runs the program for a cache leader: forwards its output to the client as
+// it arrives and keeps a copy for the cache. Returns 1 if the copy is complete
+// and the program exited successfully.
+//
+static int requestRunCgiCached(int fd, RequestHead* head, char* filename, char* cgiargs, char** data, size_t* size) {
+    size_t cap = 0, len = 0, max = cgiCacheLimit();
+    char chunk[MAXBUF], * copy = NULL;
+    int pipefd[2], status, ok = 1, sent = 1;
+    ssize_t n;
+    pid_t pid;
+
+    *data = NULL;
+    *size = 0;
+    if (pipe(pipefd) < 0) {
+        metricsIoError(IO_CGI, errno);
+        return 0;
+    }
+    // Keep other workers' CGI children from holding the write end open
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+    pid = requestSpawnCgi(fd, head, filename, cgiargs, REQUEST_BODY_NONE, -1, pipefd[1]);
+    close(pipefd[1]);
+    if (pid < 0) {
+        close(pipefd[0]);
+        return 0;
+    }
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+
+    while ((n = read(pipefd[0], chunk, sizeof(chunk))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && rio_wait(pipefd[0], POLLIN) == 0) {
+                continue;
+            }
+            ok = 0;
+            break;
+        }
+        // Without the client the output is still worth caching for the others
+        if (sent && requestWrite(fd, chunk, n) < 0) {
+            sent = 0;
+        }
+        if (ok && len + n > max) {
+            ok = 0;         // Too big to cache, keep forwarding
+        }
+        if (ok && len + n > cap) {
+            cap = cap ? cap * 2 : sizeof(chunk);
+            while (cap < len + n) cap *= 2;
+            char* bigger = realloc(copy, cap);
+            if (bigger == NULL) {
+                ok = 0;
+            }
+            else {
+                copy = bigger;
+            }
+        }
+        if (ok) {
+            memcpy(copy + len, chunk, n);
+            len += n;
+        }
+    }
+    close(pipefd[0]);
+
+    if (requestWaitCgi(fd, pid, &status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        free(copy);
+        return 0;
+    }
+    *data = copy;
+    *size = len;
+    return 1;
+}
+
+/**********************************
+ * Request bodies
+ **********************************/
+
+static size_t body_limit = REQUEST_BODY_MAX;
+
+void requestSetBodyLimit(size_t limit) {
+    body_limit = limit;
+}
+
+//
+// Works out how the body is framed: returns its Content-Length,
+// REQUEST_BODY_NONE or REQUEST_BODY_CHUNKED, or else REQUEST_BODY_TOO_LARGE
+// or REQUEST_BODY_MALFORMED
+//
+long requestBodyLength(RequestHead* head) {
+    char value[REQUEST_HEADER_MAX], *end;
+
+    if (requestGetHeader(head, "Transfer-Encoding", value, sizeof(value))) {
+        return strcasecmp(value, "chunked") == 0 ? REQUEST_BODY_CHUNKED : REQUEST_BODY_MALFORMED;
+    }
+    if (!requestGetHeader(head, "Content-Length", value, sizeof(value))) {
+        return REQUEST_BODY_NONE;
+    }
+    errno = 0;
+    long length = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || length < 0 || errno != 0) {
+        return REQUEST_BODY_MALFORMED;
+    }
+    return (size_t)length > body_limit ? REQUEST_BODY_TOO_LARGE : length;
+}
+
+// The body bytes read along with the head or while reading chunk sizes, then the socket
+typedef struct BodyReader {
+    int fd;
+    const char* buf;
+    size_t len;
+    int discard;        // The program stopped reading, the rest is dropped
+    char stash[MAXLINE];
+} BodyReader;
+
+// Waits until the pipe to the program takes more, or else the client sends more
+static int bodyWait(BodyReader* r, int pipe_fd) {
+    struct pollfd pfd = { pipe_fd, POLLOUT, 0 };
+
+    if (poll(&pfd, 1, 0) == 0) {
+        return rio_wait(pipe_fd, POLLOUT);
+    }
+    return rio_wait(r->fd, POLLIN);
+}
+
+//
+// Moves n body bytes into the pipe: buffered ones with write, the rest with
+// splice straight from the socket. A full pipe holds the client back.
+//
+static int bodyMove(BodyReader* r, int pipe_fd, size_t n) {
+    while (n > 0) {
+        ssize_t moved;
+        if (r->discard && r->len > 0) {
+            moved = r->len < n ? r->len : n;
+            r->buf += moved;
+            r->len -= moved;
+        }
+        else if (r->discard) {
+            moved = recv(r->fd, r->stash, n < sizeof(r->stash) ? n : sizeof(r->stash), 0);
+            if (moved == 0) {
+                return -1;
+            }
+            if (moved < 0 && errno != EINTR && ((errno != EAGAIN && errno != EWOULDBLOCK) || rio_wait(r->fd, POLLIN) < 0)) {
+                return -1;
+            }
+        }
+        else if (r->len > 0) {
+            moved = write(pipe_fd, r->buf, r->len < n ? r->len : n);
+            if (moved > 0) {
+                r->buf += moved;
+                r->len -= moved;
+            }
+        }
+        else {
+            moved = splice(r->fd, NULL, pipe_fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved == 0) {
+                return -1;      // The client closed early
+            }
+        }
+        if (moved > 0) {
+            n -= moved;
+            continue;
+        }
+        if (r->discard || errno == EINTR) {
+            continue;
+        }
+        if (errno == EPIPE) {
+            // Read the rest anyway: closing on unread bytes would reset the
+            // connection under the program's response
+            r->discard = 1;
+            continue;
+        }
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || bodyWait(r, pipe_fd) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Reads one line of chunk framing
+static int bodyLine(BodyReader* r, char* line, size_t cap) {
+    size_t len = 0;
+
+    while (1) {
+        if (r->len == 0) {
+            ssize_t n = recv(r->fd, r->stash, sizeof(r->stash), 0);
+            if (n == 0) {
+                return -1;
+            }
+            if (n < 0) {
+                if (errno != EINTR && ((errno != EAGAIN && errno != EWOULDBLOCK) || rio_wait(r->fd, POLLIN) < 0)) {
+                    return -1;
+                }
+                continue;
+            }
+            r->buf = r->stash;
+            r->len = n;
+        }
+        char c = *r->buf++;
+        r->len--;
+        if (c == '\n') {
+            line[len] = '\0';
+            return 0;
+        }
+        if (len + 1 == cap) {
+            return -1;
+        }
+        line[len++] = c;
+    }
+}
+
+//
+// Streams the request body into the program's stdin, de-chunking it if
+// needed. Returns -1 if the client broke off, the framing is malformed or a
+// chunked body grew past the limit.
+//
+static int requestForwardBody(int fd, RequestHead* head, long body, int pipe_fd) {
+    BodyReader r = { .fd = fd, .buf = head->body, .len = head->body_len };
+    char line[MAXLINE], *end;
+    size_t total = 0;
+
+    if (body >= 0) {
+        return bodyMove(&r, pipe_fd, body);
+    }
+    while (1) {
+        if (bodyLine(&r, line, sizeof(line)) < 0) {
+            return -1;
+        }
+        unsigned long size = strtoul(line, &end, 16);
+        if (end == line) {
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        total += size;
+        if (total > body_limit || bodyMove(&r, pipe_fd, size) < 0 || bodyLine(&r, line, sizeof(line)) < 0) {
+            return -1;
+        }
+    }
+    // Trailers, up to the empty line
+    do {
+        if (bodyLine(&r, line, sizeof(line)) < 0) {
+            return -1;
+        }
+    } while (line[0] != '\0' && strcmp(line, "\r") != 0);
+    return 0;
+}
+
+//
+// Runs the program with the request body streaming into its stdin. Such
+// output is never cached: it depends on more than the query string.
+//
+static void requestRunCgiBody(int fd, RequestHead* head, char* filename, char* cgiargs, long body) {
+    int pipefd[2], rc;
+    pid_t pid;
+
+    if (pipe(pipefd) < 0) {
+        metricsIoError(IO_CGI, errno);
+        return;
+    }
+    // Keep other workers' CGI children from holding the write end open
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+    pid = requestSpawnCgi(fd, head, filename, cgiargs, body, pipefd[0], -1);
+    close(pipefd[0]);
+    if (pid < 0) {
+        close(pipefd[1]);
+        return;
+    }
+    fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+
+    // A program that exits without reading its input shows up as EPIPE
+    rc = requestForwardBody(fd, head, body, pipefd[1]);
+    close(pipefd[1]);
+
+    if (rc < 0) {
+        kill(pid, SIGKILL);     // Half a body
+    }
+    requestWaitCgi(fd, pid, NULL);
+}
+
+//
+// Serves dynamic content (CGI execution); body is what requestBodyLength
+// returned
+//
+void requestServeDynamic(int fd, RequestHead* head, char* filename, char* cgiargs, long body, RequestTrace* trace) {
+    char buf[REQUEST_HEADER_MAX];
+    size_t header_len;
+    CgiEntry* cached;
+    int leader;
+    pid_t pid;
+
+    snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\nServer: OS-HW3 Web Server\r\n\r\n");
+    header_len = strlen(buf);
+    traceStamp(trace, STAGE_FIRST_BYTE);
+    if (requestWrite(fd, buf, header_len) < 0) {
+        traceStamp(trace, STAGE_LAST_BYTE);
+        return;     // No one left to run the program for
+    }
+    trace->status = 200;
+    trace->bytes = header_len;
+
+    if (body != REQUEST_BODY_NONE) {
+        atomic_fetch_add_explicit(&cgi_inflight, 1, memory_order_relaxed);
+        requestRunCgiBody(fd, head, filename, cgiargs, body);
+        atomic_fetch_sub_explicit(&cgi_inflight, 1, memory_order_relaxed);
+        traceStamp(trace, STAGE_LAST_BYTE);
+        costObserve(filename, clockToNs(trace->stamp[STAGE_LAST_BYTE] - trace->stamp[STAGE_DEQUEUE]));
+        return;
+    }
+
+    cached = cgiCacheAcquire(filename, cgiargs, &leader);
+    if (cached != NULL && !leader) {
+        cgiCacheWait(cached);
+        if (cached->ready && !cached->failed) {
+            requestWrite(fd, cached->data, cached->size);
+            trace->bytes += cached->size;
+            cgiCacheRelease(cached);
+            traceStamp(trace, STAGE_LAST_BYTE);
+            return;
+        }
+        // The leader failed, run the program ourselves
+        cgiCacheRelease(cached);
+        cached = NULL;
+    }
+
+    atomic_fetch_add_explicit(&cgi_inflight, 1, memory_order_relaxed);
+    if (cached != NULL) {
+        char* data;
+        size_t size;
+        int ok = requestRunCgiCached(fd, head, filename, cgiargs, &data, &size);
+        cgiCacheComplete(cached, data, size, ok);
+        cgiCacheRelease(cached);
+    }
+    else if ((pid = requestSpawnCgi(fd, head, filename, cgiargs, REQUEST_BODY_NONE, -1, -1)) > 0) {
+        requestWaitCgi(fd, pid, NULL);
     }
-    wait(NULL);
+    atomic_fetch_sub_explicit(&cgi_inflight, 1, memory_order_relaxed);
+    traceStamp(trace, STAGE_LAST_BYTE);
+    costObserve(filename, clockToNs(trace->stamp[STAGE_LAST_BYTE] - trace->stamp[STAGE_DEQUEUE]));
 }
 
 int isStaticRequest(char* uri) {
@@ -141,52 +808,189 @@ int isStaticRequest(char* uri) {
 }
 
 //
-// Determines if a request is VIP
+// Classifies a request by its request line: VIP or not, static or dynamic
+// (which pool serves it) and its estimated cost
 //
-int getRequestType(int fd) {
-    rio_t rio;
-    char buf[MAXLINE];
+void requestClassifyLine(const char* line, Request* req) {
+    char buf[MAXLINE], uri[MAXLINE];
 
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
+    snprintf(buf, sizeof(buf), "%s", line);
+    char* eol = strchr(buf, '\n');
+    if (eol) *eol = '\0';
 
-    return (strstr(buf, "REAL") != NULL) ? 1 : 0;
+    req->is_vip = strstr(buf, "REAL") != NULL;
+    req->is_static = sscanf(buf, "%*s %8191s", uri) != 1 || isStaticRequest(uri);
+    req->cost = costEstimate(buf);
 }
 
 //
-// Handles HTTP requests, updates statistics, and serves content
+// Peeks at the start of the request without consuming it. Accepted sockets
+// are non-blocking: with wait set it waits for the first bytes, otherwise
+// it returns -2 when there are none yet. Returns the length, 0 at EOF or -1
+// on error.
 //
-void requestHandle(int fd, struct timeval arrival, struct timeval dispatch, threads_stats t_stats) {
-    if (t_stats == NULL) return;
-    if (fd <= 0) return;
+static ssize_t requestPeek(int fd, char* buf, size_t cap, int wait) {
+    ssize_t n;
 
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    while ((n = recv(fd, buf, cap - 1, MSG_PEEK)) < 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        if (!wait) {
+            return -2;
+        }
+        if (rio_wait(fd, POLLIN) < 0) {
+            return -1;
+        }
+    }
+    buf[n] = '\0';
+    return n;
+}
 
-    Rio_readinitb(&rio, fd);
-    if (Rio_readlineb(&rio, buf, MAXLINE) <= 0) return;
+//
+// Classifies an accepted connection by peeking at its request line, without
+// waiting for it. Returns 0, leaving the defaults (static, not VIP), if the
+// client has sent nothing yet.
+//
+int requestClassify(int fd, Request* req) {
+    char buf[MAXLINE];
+    ssize_t n;
 
-    if (sscanf(buf, "%s %s %s", method, uri, version) != 3) {
-        requestError(fd, "Malformed request", "400", "Bad Request", "Server could not understand the request", arrival, dispatch, t_stats);
-        return;
+    req->is_vip = 0;
+    req->is_static = 1;
+    // Peek so the request line is still there for the worker
+    if ((n = requestPeek(fd, buf, sizeof(buf), 0)) > 0) {
+        requestClassifyLine(buf, req);
     }
+    return n != -2;
+}
+
+//
+// Maps the peeked request line to the file requestServe would open.
+// Returns -1 if there is no request line yet.
+//
+int requestPeekFilename(int fd, char* filename, size_t cap) {
+    char buf[MAXLINE], uri[MAXLINE], cgiargs[MAXLINE];
+    char path[MAXLINE + sizeof("./public/home.html")];
+
+    if (requestPeek(fd, buf, sizeof(buf), 1) <= 0 || sscanf(buf, "%*s %8191s", uri) != 1) {
+        return -1;
+    }
+    requestParseURI(uri, path, cgiargs);
+    snprintf(filename, cap, "%s", path);
+    return 0;
+}
+
+//
+// Serves a parsed request; strings it needs live in the request's arena
+//
+static void requestServe(int fd, Arena* arena, RequestHead* head, RequestTrace* trace, threads_stats t_stats) {
+    char* uri = head->uri;
 
-    requestReadhdrs(&rio);
+    traceSetUri(trace, uri);
+    traceStamp(trace, STAGE_PARSE);
+    PROBE4(parse, fd, t_stats->id, uri, clockToNs(trace->stamp[STAGE_PARSE] - trace->stamp[STAGE_DEQUEUE]));
+
+    if (strcmp(uri, METRICS_URI) == 0) {
+        traceStamp(trace, STAGE_LOOKUP);
+        statsRecord(t_stats, STAT_NONE);
+        requestServeMetrics(fd, trace);
+        return;
+    }
 
-    char filename[MAXLINE], cgiargs[MAXLINE];
+    size_t uri_len = strlen(uri);
+    char* filename = arenaAlloc(arena, uri_len + sizeof("./public/home.html"));
+    char* cgiargs = arenaAlloc(arena, uri_len + 1);
+    if (filename == NULL || cgiargs == NULL) {
+        statsRecord(t_stats, STAT_ERROR);
+        requestError(fd, "Out of memory", "503", "Service Unavailable", "Server could not allocate the request", trace, t_stats);
+        return;
+    }
     int is_static = isStaticRequest(uri);
     requestParseURI(uri, filename, cgiargs);
 
+    if (is_static) {
+        const BundleEntry* packed = bundleLookup(filename);
+        if (packed != NULL) {
+            traceStamp(trace, STAGE_LOOKUP);
+            statsRecord(t_stats, STAT_STATIC);
+            requestServeBundle(fd, head, packed, trace);
+            return;
+        }
+        CacheEntry* entry = cacheLookup(filename);
+        if (entry != NULL && cacheFresh(entry)) {
+            traceStamp(trace, STAGE_LOOKUP);
+            statsRecord(t_stats, STAT_STATIC);
+            requestServeCached(fd, entry, trace);
+            return;
+        }
+    }
+
     struct stat sbuf;
     if (stat(filename, &sbuf) < 0) {
-        requestError(fd, filename, "404", "Not Found", "File not found", arrival, dispatch, t_stats);
+        traceStamp(trace, STAGE_LOOKUP);
+        statsRecord(t_stats, STAT_ERROR);
+        requestError(fd, filename, "404", "Not Found", "File not found", trace, t_stats);
         return;
     }
 
+    long body = is_static ? REQUEST_BODY_NONE : requestBodyLength(head);
+    if (body == REQUEST_BODY_MALFORMED || body == REQUEST_BODY_TOO_LARGE) {
+        traceStamp(trace, STAGE_LOOKUP);
+        statsRecord(t_stats, STAT_ERROR);
+        if (body == REQUEST_BODY_TOO_LARGE) {
+            requestError(fd, filename, "413", "Payload Too Large", "Request body is over the limit", trace, t_stats);
+        }
+        else {
+            requestError(fd, filename, "400", "Bad Request", "Server could not understand the request body", trace, t_stats);
+        }
+        return;
+    }
+
+    statsRecord(t_stats, is_static ? STAT_STATIC : STAT_DYNAMIC);
     if (is_static) {
-        requestServeStatic(fd, filename, sbuf.st_size, arrival, dispatch, t_stats);
+        requestServeStatic(fd, filename, sbuf.st_size, trace, t_stats);
     }
     else {
-        requestServeDynamic(fd, filename, cgiargs);
+        traceStamp(trace, STAGE_LOOKUP);
+        requestServeDynamic(fd, head, filename, cgiargs, body, trace);
+    }
+}
+
+//
+// Handles HTTP requests, updates statistics, and serves content
+//
+void requestHandle(int fd, RequestTrace* trace, threads_stats t_stats) {
+    if (t_stats == NULL) return;
+    if (fd <= 0) return;
+
+    RequestHead head;
+    Arena* arena = arenaAcquire(ARENA_MIN);
+    if (arena == NULL) return;
+
+    int rc = requestReadHead(fd, &arena, &head);
+    int h2 = rc > 0 && h2Detect(&head);
+    if (h2 && h2Start(fd, &head, trace) == 0) {
+        // The session thread serves the connection from here on
+    }
+    else if (h2 && strcmp(head.method, H2_PREFACE_METHOD) == 0) {
+        // Prior knowledge leaves no HTTP/1 to fall back to
+        statsRecord(t_stats, STAT_ERROR);
+        requestError(fd, "HTTP/2", "503", "Service Unavailable", "Server has no room for another HTTP/2 connection", trace, t_stats);
+    }
+    else if (rc > 0) {
+        requestServe(fd, arena, &head, trace, t_stats);
+    }
+    else if (rc == -1) {
+        statsRecord(t_stats, STAT_ERROR);
+        requestError(fd, "Malformed request", "400", "Bad Request", "Server could not understand the request", trace, t_stats);
+    }
+    else if (rc == -2) {
+        statsRecord(t_stats, STAT_ERROR);
+        requestError(fd, "Request head", "431", "Request Header Fields Too Large", "Server could not read the request", trace, t_stats);
     }
+    arenaRelease(arena);
 }
@@ -2,23 +2,54 @@
 #define __REQUEST_H__
 
 #include <pthread.h>
+#include "segel.h"
+#include "cache.h"
+#include "stats.h"
+#include "trace.h"
+#include "arena.h"
+#include "queue.h"
+#include "bundle.h"
 
-typedef struct Threads_stats{
-	int id;
-	int stat_req;
-	int dynm_req;
-	int total_req;
-} * threads_stats;
+#define REQUEST_HEADER_MAX 512    // Response headers the server renders itself
+#define REQUEST_ERROR_MAX 1024    // Error page bodies
+#define REQUEST_BODY_MAX (64L << 20)  // Default limit on bodies streamed to CGI programs
 
-// Global mutex for statistics
-extern pthread_mutex_t stat_lock;
+// requestBodyLength results besides a Content-Length
+#define REQUEST_BODY_NONE -1
+#define REQUEST_BODY_CHUNKED -2
+#define REQUEST_BODY_MALFORMED -3
+#define REQUEST_BODY_TOO_LARGE -4
 
-void requestHandle(int fd, struct timeval arrival, struct timeval dispatch, threads_stats t_stats);
-int getRequestType(int fd);
+// A request head parsed in place inside its arena
+typedef struct RequestHead {
+    char* method;
+    char* uri;
+    char* version;
+    char* headers;      // Header lines after the request line, NUL terminated
+    char* body;         // Body bytes read along with the head
+    size_t body_len;
+} RequestHead;
+
+void requestHandle(int fd, RequestTrace* trace, threads_stats t_stats);
+// Sets is_vip, is_static and cost from a peek at the request line, without
+// waiting for it: returns 0, leaving a static non-VIP request, if nothing
+// has arrived yet
+int requestClassify(int fd, Request* req);
+int requestPeekFilename(int fd, char* filename, size_t cap);
+void requestClassifyLine(const char* line, Request* req);
+void requestReadhdrs(rio_t* rp);
+int requestReadHead(int fd, Arena** ap, RequestHead* head);
+int requestGetHeader(RequestHead* head, const char* name, char* value, size_t cap);
 int requestParseURI(char* uri, char* filename, char* cgiargs);
-void requestServeStatic(int fd, char* filename, int filesize, struct timeval arrival, struct timeval dispatch, threads_stats t_stats);
-void requestServeDynamic(int fd, char* filename, char* cgiargs);
-void requestError(int fd, char* cause, char* errnum, char* shortmsg, char* longmsg, struct timeval arrival, struct timeval dispatch, threads_stats t_stats);
+const char* requestGetFiletype(const char* filename);
+void requestServeCached(int fd, CacheEntry* entry, RequestTrace* trace);
+void requestServeBundle(int fd, RequestHead* head, const BundleEntry* entry, RequestTrace* trace);
+void requestServeStatic(int fd, char* filename, int filesize, RequestTrace* trace, threads_stats t_stats);
+void requestServeMetrics(int fd, RequestTrace* trace);
+void requestServeDynamic(int fd, RequestHead* head, char* filename, char* cgiargs, long body, RequestTrace* trace);
+long requestBodyLength(RequestHead* head);
+void requestSetBodyLimit(size_t limit);
+void requestError(int fd, char* cause, char* errnum, char* shortmsg, char* longmsg, RequestTrace* trace, threads_stats t_stats);
 int isStaticRequest(char* uri);  // Add this line
 
 #endif
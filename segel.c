@@ -268,6 +268,42 @@ struct hostent *Gethostbyaddr(const char *addr, int len, int type)
 /*********************************************************************
  * The Rio package - robust I/O functions
  **********************************************************************/
+/*
+ * rio_poll - block the calling thread until fd is ready
+ */
+int rio_poll(int fd, short events)
+{
+    struct pollfd pfd = { fd, events, 0 };
+
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * rio_wait - wait until a non-blocking fd is ready. The server's coroutine
+ *    scheduler installs a hook with rio_set_wait_hook to yield instead of
+ *    blocking. Threads already running may call rio_wait while it is being
+ *    installed, so the hook is published atomically.
+ */
+static int (*rio_wait_hook)(int fd, short events);
+
+void rio_set_wait_hook(int (*hook)(int fd, short events))
+{
+    __atomic_store_n(&rio_wait_hook, hook, __ATOMIC_RELEASE);
+}
+
+int rio_wait(int fd, short events)
+{
+    int (*hook)(int fd, short events) = __atomic_load_n(&rio_wait_hook, __ATOMIC_ACQUIRE);
+
+    if (hook != NULL)
+        return hook(fd, events);
+    return rio_poll(fd, events);
+}
+
 /*
  * rio_readn - robustly read n bytes (unbuffered)
  */
@@ -308,6 +344,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
         if ((nwritten = write(fd, bufp, nleft)) <= 0) {
             if (errno == EINTR)  /* interrupted by sig handler return */
                 nwritten = 0;    /* and call write() again */
+            else if ((errno == EAGAIN || errno == EWOULDBLOCK) && rio_wait(fd, POLLOUT) >= 0)
+                nwritten = 0;    /* non-blocking fd became writable */
             else
                 return -1;       /* errorno set by write() */
         }
@@ -336,6 +374,8 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
         rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
                            sizeof(rp->rio_buf));
         if (rp->rio_cnt < 0) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && rio_wait(rp->rio_fd, POLLIN) >= 0)
+                continue;       /* non-blocking fd became readable */
             if (errno != EINTR) /* interrupted by sig handler return */
                 return -1;
         }
@@ -541,6 +581,44 @@ int open_listenfd(int port)
 }
 /* $end open_listenfd */
 
+/*
+ * open_unixlistenfd - open and return a listening socket bound to a Unix
+ *     socket path with the given permissions. A socket file left there by
+ *     an earlier run is replaced; any other file is not.
+ */
+int open_unixlistenfd(char *path, mode_t mode, int backlog)
+{
+    int listenfd;
+    struct sockaddr_un addr;
+    struct stat sbuf;
+
+    bzero((char *) &addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "socket path too long: %s\n", path);
+      return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+      fprintf(stderr, "socket failed\n");
+      return -1;
+    }
+    if (lstat(path, &sbuf) == 0 && S_ISSOCK(sbuf.st_mode))
+      unlink(path);
+    if (bind(listenfd, (SA *)&addr, sizeof(addr)) < 0) {
+      fprintf(stderr, "bind failed\n");
+      close(listenfd);
+      return -1;
+    }
+    if (chmod(path, mode) < 0 || listen(listenfd, backlog) < 0) {
+      fprintf(stderr, "listen failed\n");
+      close(listenfd);
+      return -1;
+    }
+    return listenfd;
+}
+
 /******************************************
  * Wrappers for the client/server helper routines 
  ******************************************/
@@ -566,4 +644,13 @@ int Open_listenfd(int port)
     return rc;
 }
 
+int Open_unixlistenfd(char *path, mode_t mode, int backlog) 
+{
+    int rc;
+
+    if ((rc = open_unixlistenfd(path, mode, backlog)) < 0)
+        unix_error("Open_unixlistenfd error");
+    return rc;
+}
+
 
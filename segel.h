@@ -23,6 +23,8 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <poll.h>
 
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -101,6 +103,9 @@ struct hostent *Gethostbyname(const char *name);
 struct hostent *Gethostbyaddr(const char *addr, int len, int type);
 
 /* Rio (Robust I/O) package */
+void rio_set_wait_hook(int (*hook)(int fd, short events));
+int rio_wait(int fd, short events);
+int rio_poll(int fd, short events);
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
@@ -117,9 +122,11 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Client/server helper functions */
 int open_clientfd(char *hostname, int portno);
 int open_listenfd(int portno);
+int open_unixlistenfd(char *path, mode_t mode, int backlog);
 
 /* Wrappers for client/server helper functions */
 int Open_clientfd(char *hostname, int port);
 int Open_listenfd(int port); 
+int Open_unixlistenfd(char *path, mode_t mode, int backlog);
 
 #endif /* __CSAPP_H__ */
@@ -1,3 +1,5 @@
+// accept4
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,43 +11,101 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/prctl.h>
 
 #include "segel.h"
 #include "request.h"
 #include "queue.h"
+#include "cache.h"
+#include "stats.h"
+#include "trace.h"
+#include "accesslog.h"
+#include "metrics.h"
+#include "coro.h"
+#include "cgicache.h"
+#include "h2.h"
+#include "admin.h"
+#include "bundle.h"
+#include "iopool.h"
+#include "hugemem.h"
+#include "probes.h"
 
-// Global request queue
+// Global request queue: static requests, or all of them without -D
 Queue request_queue;
 
-void* vip_thread(void* arg) {
-    threads_stats t_stats = malloc(sizeof(struct Threads_stats));
-    if (t_stats == NULL) {
-        pthread_exit(NULL);
-    }
-    t_stats->id = -1;
-    t_stats->stat_req = 0;
-    t_stats->dynm_req = 0;
-    t_stats->total_req = 0;
+// Queue of the dynamic pool, used with -D
+Queue dynamic_queue;
 
-    while (1) {
-        pthread_mutex_lock(&request_queue.lock);
-        while (isQueueEmpty(&request_queue) || request_queue.vip_size == 0) {
-            pthread_cond_wait(&request_queue.vip_not_empty, &request_queue.lock);
-        }
-        Request req = dequeue(&request_queue, 1);
-        pthread_mutex_unlock(&request_queue.lock);
+// Most connections taken from the listen backlog per enqueueBatch
+#define ACCEPT_BATCH 64
+
+// Most accepted connections kept waiting for their request line
+#define ACCEPT_PENDING 1024
+
+// Stats slots kept for threads added at runtime, beyond the starting pools
+#define POOL_SPARE_SLOTS 256
 
-        struct timeval dispatch;
-        gettimeofday(&dispatch, NULL);
+// Optional settings given after the positional arguments
+typedef struct ServerOptions {
+    int warmup;              // -w: preload ./public before listening
+    char* warmup_manifest;   // -M <file>: preload (and pin) only the listed files
+    int warmup_deadline_ms;  // -d <ms>: start listening after this long regardless
+    int trace_sample;        // -t <n>: keep the full trace of every n-th request (0 = off)
+    char* access_log;        // -l <file>: binary access log, decode with ./logdecode
+    int stack_kb;            // -k <KB>: worker thread (or coroutine) stack size (0 = system default)
+    int coro_threads;        // -c <n>: run the workers as coroutines over n OS threads (0 = off)
+                             // -C <uri>[:<ms>]: cache that CGI program's output per query string
+                             // -B <KB>: byte limit for cached CGI output
+    char* admin_socket;      // -A <path>: control socket for resizing at runtime, see admin.h
+    int aging;               // -S <n>: serve shortest estimated job first with this aging factor (0 = FIFO)
+    int cost_capacity_ms;    // -Q <ms>: queue also full at this much estimated work (0 = off)
+    int dynamic_threads;     // -D <n>[:<queue size>[:<schedalg>]]: serve CGI requests from a pool of their own
+    int dynamic_queue_size;
+    int dynamic_policy;
+    int lend;                // -L: either pool takes the other's requests while it has idle workers
+    char* stats_shm;         // -m <name>: shared-memory stats segment for ./serverstat ("none" = off)
+    char* bundle;            // -P <file>: serve static files from this ./pack bundle first
+    int io_threads;          // -I <n>: read cold static files in on n I/O threads (0 = workers do it)
+                             // -b <KB>: largest request body streamed to a CGI program
+    char* unix_socket;       // -U <path>: also accept connections on this Unix socket
+    int processes;           // -F <n>: pre-fork n server processes sharing the listeners (0 = one process)
+                             // -H <huge,lock,numa>: huge pages and mlock for the cache, queues and
+                             // stats; numa spreads -F processes over the NUMA nodes
+} ServerOptions;
 
-        requestHandle(req.connfd, req.arrival, dispatch, t_stats);
-        Close(req.connfd);
+ServerOptions options = { .trace_sample = 64, .stack_kb = 64 };
+
+//
+// Everything after dequeue: serve, close, and account for the request
+//
+static void serveRequest(Request* req, threads_stats t_stats) {
+    RequestTrace* trace = &req->trace;
+
+    // A cold file is read in on an I/O thread, which queues the request
+    // again; it fires dequeue once, when it is finally served
+    if (iopoolPark(req)) {
+        return;
     }
+    PROBE3(dequeue, req->connfd, t_stats->id, clockToNs(clockNow() - trace->stamp[STAGE_ENQUEUE]));
+    traceStamp(trace, STAGE_DEQUEUE);
+    statsSetBusy(t_stats, 1);
 
-    free(t_stats);
+    PROBE3(serve__start, req->connfd, t_stats->id, req->is_static);
+    requestHandle(req->connfd, trace, t_stats);
+    PROBE5(serve__end, req->connfd, t_stats->id, trace->status, clockToNs(clockNow() - trace->stamp[STAGE_DEQUEUE]), trace->bytes);
+    if (close(req->connfd) < 0) {
+        metricsIoError(IO_CLOSE, errno);
+    }
+    traceStamp(trace, STAGE_CLOSE);
+    traceRecord(t_stats, trace);
+    accesslogAppend(statsIndex(t_stats), t_stats->id, req->connfd, req->is_vip, trace);
+    statsSetBusy(t_stats, 0);
 }
 
 void getargs(int* port, int* threads, int* queue_size, char** schedalg, int argc, char* argv[]) {
+    int opt;
+
     if (argc < 5) {
         exit(1);
     }
@@ -53,86 +113,632 @@ void getargs(int* port, int* threads, int* queue_size, char** schedalg, int argc
     *threads = atoi(argv[2]);
     *queue_size = atoi(argv[3]);
     *schedalg = argv[4];
+
+    // Options follow the positional arguments; argv[4] stands in for argv[0]
+    while ((opt = getopt(argc - 4, argv + 4, "wM:d:t:l:k:c:C:B:A:S:Q:D:Lm:P:I:b:U:F:H:")) != -1) {
+        switch (opt) {
+        case 'w':
+            options.warmup = 1;
+            break;
+        case 'M':
+            options.warmup = 1;
+            options.warmup_manifest = optarg;
+            break;
+        case 'd':
+            options.warmup_deadline_ms = atoi(optarg);
+            break;
+        case 't':
+            options.trace_sample = atoi(optarg);
+            break;
+        case 'l':
+            options.access_log = optarg;
+            break;
+        case 'k':
+            options.stack_kb = atoi(optarg);
+            break;
+        case 'c':
+            options.coro_threads = atoi(optarg);
+            break;
+        case 'C': {
+            char* ttl = strchr(optarg, ':');
+            if (ttl != NULL) {
+                *ttl++ = '\0';
+            }
+            cgiCacheAddRule(optarg, ttl != NULL ? atoi(ttl) : 1000);
+            break;
+        }
+        case 'B':
+            cgiCacheSetLimit((size_t)atol(optarg) * 1024);
+            break;
+        case 'A':
+            options.admin_socket = optarg;
+            break;
+        case 'S':
+            options.aging = atoi(optarg);
+            break;
+        case 'Q':
+            options.cost_capacity_ms = atoi(optarg);
+            break;
+        case 'D': {
+            char* size = strchr(optarg, ':');
+            char* policy = size != NULL ? strchr(size + 1, ':') : NULL;
+            if (size != NULL) *size++ = '\0';
+            if (policy != NULL) *policy++ = '\0';
+            options.dynamic_threads = atoi(optarg);
+            options.dynamic_queue_size = size != NULL ? atoi(size) : 0;
+            options.dynamic_policy = policy != NULL ? policyFromName(policy) : -1;
+            if (options.dynamic_threads < 1 || (policy != NULL && options.dynamic_policy < 0)) {
+                exit(1);
+            }
+            break;
+        }
+        case 'L':
+            options.lend = 1;
+            break;
+        case 'm':
+            options.stats_shm = optarg;
+            break;
+        case 'P':
+            options.bundle = optarg;
+            break;
+        case 'I':
+            options.io_threads = atoi(optarg);
+            break;
+        case 'b':
+            requestSetBodyLimit((size_t)atol(optarg) * 1024);
+            break;
+        case 'U':
+            options.unix_socket = optarg;
+            break;
+        case 'F':
+            options.processes = atoi(optarg);
+            if (options.processes < 1 || options.processes > STATS_SHM_PROCS) {
+                exit(1);
+            }
+            break;
+        case 'H': {
+            int flags = hugememFlagsFromList(optarg);
+            if (flags < 0) {
+                exit(1);
+            }
+            hugememInit(flags);
+            break;
+        }
+        default:
+            exit(1);
+        }
+    }
 }
 
+/**********************************
+ * Worker pools
+ **********************************/
+
+static int resizePool(Pool* pool, int n);
+static int resizeCoroPool(Pool* pool, int n);
+
+static Pool static_pool = { .name = "static", .queue = &request_queue, .resize = resizePool };
+static Pool vip_pool = { .name = "vip", .queue = &request_queue, .vip = 1, .resize = resizePool };
+static Pool dynamic_pool = { .name = "dynamic", .queue = &dynamic_queue, .resize = resizePool };
+
+static Pool* pools[POOL_MAX];
+static int npools;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_attr_t pool_attr;
+
+typedef struct Worker {
+    Pool* pool;
+    threads_stats t_stats;
+} Worker;
+
 void* worker_thread(void* arg) {
-    threads_stats t_stats = (threads_stats)arg;
+    Worker* w = (Worker*)arg;
 
     while (1) {
-        pthread_mutex_lock(&request_queue.lock);
-        while (isQueueEmpty(&request_queue)) {
-            pthread_cond_wait(&request_queue.not_empty, &request_queue.lock);
+        // One at a time: a worker holding several would delay the rest
+        Request req;
+        if (dequeueBatch(w->pool->queue, &req, 1, w->pool->vip) == 0) {
+            break;      // Retired by a pool shrink
         }
-        pthread_mutex_unlock(&request_queue.lock);
-
-        Request req = dequeue(&request_queue, 0);
 
         if (req.connfd <= 0) {
             continue;
         }
+        serveRequest(&req, w->t_stats);
+    }
+    statsRelease(w->t_stats);
+    free(w);
+    return NULL;
+}
 
-        struct timeval dispatch;
-        gettimeofday(&dispatch, NULL);
+//
+// Grows or shrinks a pool to n threads. Growing takes back pending
+// retirements first; shrinking lets the surplus exit after their current
+// request. Returns -1 if not every new thread could be started.
+//
+static int resizePool(Pool* pool, int n) {
+    int rc = 0;
 
-        requestHandle(req.connfd, req.arrival, dispatch, t_stats);
-        Close(req.connfd);
+    pthread_mutex_lock(&pool_lock);
+    int cur = atomic_load(&pool->threads);
+    if (n > cur) {
+        cur += queueCancelRetire(pool->queue, n - cur, pool->vip);
+    }
+    for (; cur < n; cur++) {
+        Worker* w = malloc(sizeof(Worker));
+        pthread_t tid;
+        if (w == NULL || (w->t_stats = statsAcquire(pool->vip)) == NULL) {
+            free(w);
+            rc = -1;    // Out of stats slots
+            break;
+        }
+        w->pool = pool;
+        if (pthread_create(&tid, &pool_attr, worker_thread, w) != 0) {
+            statsRelease(w->t_stats);
+            free(w);
+            rc = -1;
+            break;
+        }
+    }
+    if (cur > n) {
+        queueRetire(pool->queue, pool->vip ? 0 : cur - n, pool->vip ? cur - n : 0);
+        cur = n;
+    }
+    atomic_store(&pool->threads, cur);
+    pthread_mutex_unlock(&pool_lock);
+    return rc;
+}
+
+// Coroutine workers are fixed by coroStart
+static int resizeCoroPool(Pool* pool, int n) {
+    (void)pool;
+    (void)n;
+    return -1;
+}
+
+//
+// Copies the pool gauges and memory use into the stats segment every
+// STATS_PUBLISH_MS, so ./serverstat sees queue depths without taking any lock
+//
+static void* statsPublisher(void* arg) {
+    StatsPoolGauges gauges[STATS_SHM_POOLS];
+    StatsMemory memory[STATS_SHM_MEMORY];
+    struct timespec pause = { 0, STATS_PUBLISH_MS * 1000000L };
+
+    (void)arg;
+    while (1) {
+        int n = npools < STATS_SHM_POOLS ? npools : STATS_SHM_POOLS;
+        memset(gauges, 0, sizeof(gauges));
+        for (int i = 0; i < n; i++) {
+            Pool* p = pools[i];
+            Queue* q = p->queue;
+            StatsPoolGauges* g = &gauges[i];
+            snprintf(g->name, sizeof(g->name), "%s", p->name);
+            g->threads = atomic_load_explicit(&p->threads, memory_order_relaxed);
+            g->has_queue = !p->vip;
+            if (p->vip) {
+                g->depth = __atomic_load_n(&q->vip_size, __ATOMIC_RELAXED);
+                continue;
+            }
+            snprintf(g->policy, sizeof(g->policy), "%s", policy_names[__atomic_load_n(&q->policy, __ATOMIC_RELAXED)]);
+            g->idle = __atomic_load_n(&q->waiting, __ATOMIC_RELAXED);
+            g->depth = __atomic_load_n(&q->size, __ATOMIC_RELAXED);
+            g->vip_depth = __atomic_load_n(&q->vip_size, __ATOMIC_RELAXED);
+            g->capacity = __atomic_load_n(&q->capacity, __ATOMIC_RELAXED);
+            g->cost_us = __atomic_load_n(&q->cost, __ATOMIC_RELAXED);
+            g->dropped = __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+        }
+        for (int k = 0; k < STATS_SHM_MEMORY; k++) {
+            unsigned long pages = atomic_load_explicit(&mem_bytes[k][MEM_PAGES], memory_order_relaxed);
+            memory[k].huge = atomic_load_explicit(&mem_bytes[k][MEM_THP], memory_order_relaxed) +
+                             atomic_load_explicit(&mem_bytes[k][MEM_HUGETLB], memory_order_relaxed);
+            memory[k].total = pages + memory[k].huge;
+            memory[k].locked = atomic_load_explicit(&mem_locked[k], memory_order_relaxed);
+        }
+        statsPublishPools(gauges, n, memory);
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+// Idle workers q has beyond the requests already waiting for them
+static int spareWorkers(Queue* q, int pending) {
+    return __atomic_load_n(&q->waiting, __ATOMIC_RELAXED) - __atomic_load_n(&q->size, __ATOMIC_RELAXED) - pending;
+}
+
+//
+// Queues classified requests: VIP ones and, without a dynamic pool, all of
+// them on request_queue; otherwise static and dynamic requests each on their
+// own pool's queue. With lending on, a request whose pool has no idle worker
+// goes to the other pool when that one has a worker to spare.
+//
+// Index into queues of the one req goes to, given count requests already
+// picked for each but not yet queued
+static int queueFor(Request* req, Queue** queues, int* count) {
+    int k = req->is_vip || req->is_static ? 0 : 1;
+
+    if (options.lend && !req->is_vip && spareWorkers(queues[k], count[k]) <= 0
+        && spareWorkers(queues[!k], count[!k]) > 0) {
+        k = !k;
+    }
+    return k;
+}
+
+static int submitRequests(Request* reqs, int n) {
+    if (options.dynamic_threads == 0) {
+        return enqueueBatch(&request_queue, reqs, n);
+    }
+
+    Request to[2][n];
+    Queue* queues[2] = { &request_queue, &dynamic_queue };
+    int count[2] = { 0, 0 }, queued = 0;
+
+    for (int i = 0; i < n; i++) {
+        int k = queueFor(&reqs[i], queues, count);
+        to[k][count[k]++] = reqs[i];
+    }
+    for (int k = 0; k < 2; k++) {
+        if (count[k] > 0) {
+            queued += enqueueBatch(queues[k], to[k], count[k]);
+        }
+    }
+    return queued;
+}
+
+//
+// Queues one request like submitRequests, but for callers that must not
+// wait, like HTTP/2 sessions: -1 if its queue is full under the block policy
+//
+static int trySubmitRequest(Request* req) {
+    Queue* queues[2] = { &request_queue, &dynamic_queue };
+    int count[2] = { 0, 0 };
+
+    if (options.dynamic_threads == 0) {
+        return tryEnqueue(&request_queue, *req);
+    }
+    return tryEnqueue(queues[queueFor(req, queues, count)], *req);
+}
+
+// Accepted connections still waiting for their request line. The main
+// loop polls them with the listeners and queues each once it can be
+// classified, so a slow VIP client still reaches the VIP queue.
+static Request unclassified[ACCEPT_PENDING];
+static int nunclassified;
+
+//
+// Drains up to max connections from a listener's backlog, classifying each.
+// Connections that have not sent their request line yet are set aside in
+// unclassified rather than queued; accepting stops while that is full.
+//
+static int acceptBatch(int listenfd, Request* batch, int max) {
+    int n = 0, connfd;
+
+    while (n < max && nunclassified < ACCEPT_PENDING) {
+        connfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                metricsIoError(IO_ACCEPT, errno);
+                usleep(1000);   // Out of descriptors until workers close some
+            }
+            break;      // EAGAIN: backlog drained
+        }
+
+        PROBE2(accept, connfd, listenfd);
+        Request* req = &batch[n];
+        memset(req, 0, sizeof(*req));
+        req->connfd = connfd;
+        traceStamp(&req->trace, STAGE_ACCEPT);
+
+        if (!requestClassify(connfd, req)) {
+            unclassified[nunclassified++] = *req;
+            continue;
+        }
+        traceStamp(&req->trace, STAGE_CLASSIFY);
+        n++;
+    }
+    return n;
+}
+
+//
+// Moves up to max of the unclassified connections whose request line (or
+// EOF) poll reported in ready[i].revents into batch
+//
+static int classifyPending(struct pollfd* ready, Request* batch, int max) {
+    int n = 0;
+
+    // Backwards, so the last entry swapped into a freed place was seen already
+    for (int i = nunclassified - 1; i >= 0 && n < max; i--) {
+        if (ready[i].revents == 0 || !requestClassify(unclassified[i].connfd, &unclassified[i])) {
+            continue;
+        }
+        traceStamp(&unclassified[i].trace, STAGE_CLASSIFY);
+        batch[n++] = unclassified[i];
+        unclassified[i] = unclassified[--nunclassified];
+    }
+    return n;
+}
+
+/**********************************
+ * Pre-forked processes
+ **********************************/
+
+static pid_t children[STATS_SHM_PROCS];
+static volatile sig_atomic_t master_signal;
+
+static void masterSignal(int sig) {
+    master_signal = sig;
+}
+
+// A single server process stops here on SIGTERM or SIGINT, as it always did,
+// but without leaving its stats segment behind
+static void shutdownSignal(int sig) {
+    statsUnlinkShared();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// Returns 0 in the new child, which takes over slot range index
+static int spawnChild(int index) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        fprintf(stderr, "prefork: cannot fork process %d: %s\n", index, strerror(errno));
+        return -1;
+    }
+    if (pid > 0) {
+        children[index] = pid;
+        return pid;
+    }
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    // Nothing should keep serving once the master is gone
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1) {
+        _exit(0);
+    }
+    statsAttachProcess(index);
+    return 0;
+}
+
+//
+// Forks n server processes that share the listeners and the stats segment.
+// Returns the process index in each child. The master stays here for good:
+// it restarts any child that dies, dumps the aggregated traces on SIGUSR1,
+// and takes the children down with it on SIGTERM or SIGINT.
+//
+static int prefork(int n) {
+    struct sigaction sa;
+    int status;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = masterSignal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    for (int i = 0; i < n; i++) {
+        if (spawnChild(i) == 0) {
+            return i;
+        }
+    }
+
+    while (1) {
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (master_signal == SIGUSR1) {
+            master_signal = 0;
+            traceDump(stderr);
+        }
+        else if (master_signal != 0) {
+            for (int i = 0; i < n; i++) {
+                if (children[i] > 0) kill(children[i], SIGTERM);
+            }
+            while (wait(NULL) > 0 || errno == EINTR) {
+            }
+            exit(0);
+        }
+        if (pid <= 0) {
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (children[i] != pid) {
+                continue;
+            }
+            fprintf(stderr, "prefork: process %d (pid %d) %s %d, restarting\n", i, pid,
+                    WIFSIGNALED(status) ? "killed by signal" : "exited with", WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+            children[i] = 0;
+            usleep(100000);     // A child that dies at startup must not spin the master
+            if (spawnChild(i) == 0) {
+                return i;
+            }
+        }
+    }
+}
+
+// Per-process copy of a path option: "<path>.<index>"
+static char* processPath(const char* path, int index) {
+    size_t len = strlen(path) + 16;
+    char* copy = malloc(len);
+
+    if (copy == NULL) {
+        exit(1);
+    }
+    snprintf(copy, len, "%s.%d", path, index);
+    return copy;
+}
+
+//
+// Opens the TCP listener and, with -U, the Unix one
+//
+static void openListeners(int port, struct pollfd* listeners) {
+    listeners[0].fd = Open_listenfd(port);
+    fcntl(listeners[0].fd, F_SETFL, fcntl(listeners[0].fd, F_GETFL) | O_NONBLOCK);
+    // Local clients can skip loopback TCP; both listeners feed the same queues
+    if (options.unix_socket != NULL) {
+        listeners[1].fd = Open_unixlistenfd(options.unix_socket, 0666, LISTENQ);
+        fcntl(listeners[1].fd, F_SETFL, fcntl(listeners[1].fd, F_GETFL) | O_NONBLOCK);
     }
 }
 
 int main(int argc, char* argv[]) {
-    int listenfd, connfd, port, clientlen;
-    struct sockaddr_in clientaddr;
+    struct pollfd listeners[2] = { { -1, POLLIN, 0 }, { -1, POLLIN, 0 } };
+    int port;
 
     int threads, queue_size;
     char* schedalg;
 
     getargs(&port, &threads, &queue_size, &schedalg, argc, argv);
-    initQueue(&request_queue, queue_size);
-
-    pthread_t* worker_threads = malloc(sizeof(pthread_t) * threads);
-    if (worker_threads == NULL) {
+    int policy = policyFromName(schedalg);
+    if (policy < 0) {
         exit(1);
     }
+    // A client gone mid-response shows up as EPIPE on its own connection
+    signal(SIGPIPE, SIG_IGN);
+    clockInit();
+    traceInit(options.trace_sample);
+    // Before any worker can look into it; on failure ./public serves alone
+    if (options.bundle != NULL) {
+        bundleOpen(options.bundle);
+    }
 
-    for (int i = 0; i < threads; i++) {
-        threads_stats t_stats = malloc(sizeof(struct Threads_stats));
-        if (t_stats == NULL) {
-            exit(1);
-        }
-        t_stats->id = i;
-        t_stats->stat_req = 0;
-        t_stats->dynm_req = 0;
-        t_stats->total_req = 0;
+    // One slot per worker plus the VIP thread's, which keeps id -1, and
+    // room for the pools to grow at runtime; that many per process
+    char shm_name[64];
+    snprintf(shm_name, sizeof(shm_name), STATS_SHM_DEFAULT, port);
+    if (options.stats_shm != NULL) {
+        snprintf(shm_name, sizeof(shm_name), "%s", options.stats_shm);
+    }
+    statsInitShared(threads + 1 + options.dynamic_threads + POOL_SPARE_SLOTS, options.processes > 0 ? options.processes : 1,
+                    strcmp(shm_name, "none") == 0 ? NULL : shm_name);
+    // The pre-forked master exits through here too; its children are no owners
+    atexit(statsUnlinkShared);
+    if (options.processes == 0) {
+        signal(SIGTERM, shutdownSignal);
+        signal(SIGINT, shutdownSignal);
+    }
 
-        if (pthread_create(&worker_threads[i], NULL, worker_thread, (void*)t_stats) != 0) {
-            free(t_stats);
-            exit(1);
+    // Children inherit the listeners; everything with threads starts after the fork
+    if (options.processes > 0) {
+        openListeners(port, listeners);
+        int index = prefork(options.processes);
+        // Before any thread, so they all inherit the node's CPUs
+        if (hugememFlags() & HUGEMEM_NUMA) {
+            hugememBindNode(index);
+        }
+        if (options.admin_socket != NULL) {
+            options.admin_socket = processPath(options.admin_socket, index);
+        }
+        if (options.access_log != NULL) {
+            options.access_log = processPath(options.access_log, index);
         }
     }
+    traceStartReporter();
+    initQueue(&request_queue, queue_size, policy);
+    setQueueAging(&request_queue, options.aging);
+    setQueueCostCapacity(&request_queue, (unsigned long)options.cost_capacity_ms * 1000);
 
-    pthread_t vip_thread_id;
-    if (pthread_create(&vip_thread_id, NULL, vip_thread, NULL) != 0) {
-        exit(1);
+    pools[npools++] = &static_pool;
+    pools[npools++] = &vip_pool;
+    if (options.dynamic_threads > 0) {
+        initQueue(&dynamic_queue,
+                  options.dynamic_queue_size > 0 ? options.dynamic_queue_size : queue_size,
+                  options.dynamic_policy >= 0 ? options.dynamic_policy : policy);
+        setQueueAging(&dynamic_queue, options.aging);
+        setQueueCostCapacity(&dynamic_queue, (unsigned long)options.cost_capacity_ms * 1000);
+        pools[npools++] = &dynamic_pool;
+    }
+    for (int i = 0; i < npools; i++) {
+        metricsAddPool(pools[i]);
+    }
+    h2Init(trySubmitRequest);
+    if (options.io_threads > 0) {
+        iopoolStart(options.io_threads, submitRequests);
     }
 
-    listenfd = Open_listenfd(port);
+    if (options.access_log != NULL) {
+        accesslogInit(options.access_log, statsCapacity());
+    }
 
-    while (1) {
-        clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA*)&clientaddr, (socklen_t*)&clientlen);
+    // Requests keep their data in arenas, so workers get by with small stacks
+    pthread_attr_init(&pool_attr);
+    pthread_attr_setdetachstate(&pool_attr, PTHREAD_CREATE_DETACHED);
+    if (options.stack_kb > 0 && pthread_attr_setstacksize(&pool_attr, (size_t)options.stack_kb * 1024) != 0) {
+        fprintf(stderr, "invalid stack size %d KB\n", options.stack_kb);
+        exit(1);
+    }
+
+    if (options.coro_threads > 0) {
+        // threads workers multiplexed over a few OS threads, see coro.c
+        size_t stack = options.stack_kb > 0 ? (size_t)options.stack_kb * 1024 : 256 * 1024;
+        coroStart(&request_queue, options.coro_threads, threads, stack, serveRequest);
+        atomic_store(&static_pool.threads, threads);
+        static_pool.resize = resizeCoroPool;
+    }
+    else if (resizePool(&static_pool, threads) < 0) {
+        exit(1);
+    }
+    if (resizePool(&vip_pool, 1) < 0) {
+        exit(1);
+    }
+    if (options.dynamic_threads > 0 && resizePool(&dynamic_pool, options.dynamic_threads) < 0) {
+        exit(1);
+    }
+    if (options.admin_socket != NULL) {
+        adminStart(options.admin_socket, pools, npools);
+    }
+    pthread_t publisher;
+    if (pthread_create(&publisher, NULL, statsPublisher, NULL) == 0) {
+        pthread_detach(publisher);
+    }
 
-        struct timeval arrival;
-        gettimeofday(&arrival, NULL);
+    cacheInit();
+    if (options.warmup) {
+        warmupPublic(options.warmup_manifest, threads, options.warmup_deadline_ms);
+    }
 
-        int is_vip = getRequestType(connfd);
-        enqueue(&request_queue, (Request) { connfd, arrival }, is_vip);
+    if (listeners[0].fd < 0) {
+        openListeners(port, listeners);
     }
 
-    for (int i = 0; i < threads; i++) {
-        pthread_join(worker_threads[i], NULL);
+    Request batch[ACCEPT_BATCH];
+    struct pollfd fds[2 + ACCEPT_PENDING];
+    while (1) {
+        int n = 0, npending = nunclassified;
+
+        // The listeners, left out while there is no room for more
+        // unclassified connections, then those connections
+        for (int i = 0; i < 2; i++) {
+            fds[i] = listeners[i];
+            if (npending == ACCEPT_PENDING) {
+                fds[i].fd = -1;
+            }
+        }
+        for (int i = 0; i < npending; i++) {
+            fds[2 + i].fd = unclassified[i].connfd;
+            fds[2 + i].events = POLLIN;
+        }
+        if (poll(fds, 2 + npending, -1) < 0) {
+            continue;
+        }
+        // Drain the ready backlogs, then queue the whole burst under one lock
+        n = classifyPending(fds + 2, batch, ACCEPT_BATCH);
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].revents & POLLIN) {
+                n += acceptBatch(listeners[i].fd, batch + n, ACCEPT_BATCH - n);
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            traceStamp(&batch[i].trace, STAGE_ENQUEUE);
+        }
+        submitRequests(batch, n);
     }
-    pthread_join(vip_thread_id, NULL);
-    free(worker_threads);
+
     destroyQueue(&request_queue);
 
     return 0;
@@ -0,0 +1,341 @@
+/*
+ * serverstat.c: Live view of a running server's statistics.
+ *
+ * Reads the shared-memory segment the server publishes (see stats.h), so
+ * watching it costs the server nothing: no requests, no locks.
+ *
+ * Pre-forked server processes (server -F) share one segment; their pools
+ * and memory are summed and each thread row names its process.
+ *
+ * To run: ./serverstat 8080              (segment of the server on port 8080)
+ *         ./serverstat -i 0.5 /my-stats  (segment given with "server -m")
+ *         ./serverstat -n 1 8080         (print once, no screen clearing)
+ */
+
+#include "segel.h"
+#include "stats.h"
+
+typedef struct View {
+    StatsShmHeader* header;
+    size_t size;
+    struct Threads_stats* slots;
+} View;
+
+// One slot as last read
+typedef struct SlotCopy {
+    int id;
+    int active;
+    int busy;
+    unsigned long total_req;
+    unsigned long stat_req;
+    unsigned long dynm_req;
+    unsigned long err_req;
+    unsigned long span_hist[TRACE_SPANS][HIST_BUCKETS];
+} SlotCopy;
+
+static int attach(const char* name, View* v) {
+    struct stat sbuf;
+    int fd = shm_open(name, O_RDONLY, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &sbuf) < 0 || (size_t)sbuf.st_size < sizeof(StatsShmHeader)) {
+        close(fd);
+        return -1;
+    }
+    v->size = sbuf.st_size;
+    v->header = mmap(NULL, v->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (v->header == MAP_FAILED) {
+        return -1;
+    }
+
+    StatsShmHeader* h = v->header;
+    if (h->magic != STATS_SHM_MAGIC || h->version != STATS_SHM_VERSION || h->header_size != sizeof(StatsShmHeader) ||
+        h->slot_size != sizeof(struct Threads_stats) || h->trace_spans != TRACE_SPANS || h->hist_buckets != HIST_BUCKETS ||
+        h->slots_offset + (size_t)h->capacity * h->slot_size > v->size || h->nprocs < 1 || h->nprocs > STATS_SHM_PROCS ||
+        (size_t)h->nprocs * h->proc_slots != h->capacity) {
+        fprintf(stderr, "%s: not a stats segment of this server version\n", name);
+        exit(1);
+    }
+    v->slots = (struct Threads_stats*)((char*)h + h->slots_offset);
+    return 0;
+}
+
+static void detach(View* v) {
+    munmap(v->header, v->size);
+    v->header = NULL;
+}
+
+// Seqlock read; gives up on a slot whose writer died mid-update
+static void readSlot(struct Threads_stats* t, SlotCopy* out) {
+    for (int tries = 0; tries < 1000; tries++) {
+        unsigned int before = atomic_load_explicit(&t->seq, memory_order_acquire);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        out->id = t->id;
+        out->active = atomic_load_explicit(&t->active, memory_order_relaxed);
+        out->busy = atomic_load_explicit(&t->busy, memory_order_relaxed);
+        out->total_req = atomic_load_explicit(&t->total_req, memory_order_relaxed);
+        out->stat_req = atomic_load_explicit(&t->stat_req, memory_order_relaxed);
+        out->dynm_req = atomic_load_explicit(&t->dynm_req, memory_order_relaxed);
+        out->err_req = atomic_load_explicit(&t->err_req, memory_order_relaxed);
+        for (int i = 0; i < TRACE_SPANS; i++) {
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                out->span_hist[i][b] = atomic_load_explicit(&t->span_hist[i][b], memory_order_relaxed);
+            }
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&t->seq, memory_order_relaxed) == before) {
+            return;
+        }
+    }
+}
+
+static int readProcessPools(StatsProcess* p, StatsPoolGauges* out, StatsMemory* memory) {
+    for (int tries = 0; tries < 1000; tries++) {
+        unsigned int before = atomic_load_explicit(&p->pools_seq, memory_order_acquire);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        int n = p->npools < STATS_SHM_POOLS ? p->npools : STATS_SHM_POOLS;
+        memcpy(out, p->pools, sizeof(StatsPoolGauges) * n);
+        memcpy(memory, p->memory, sizeof(p->memory));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&p->pools_seq, memory_order_relaxed) == before) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+//
+// Sums the gauges of every process; pre-forked processes are configured
+// alike, so their pools line up. The segment itself is shared, and every
+// process reports it, so it counts once.
+//
+static int readPools(StatsShmHeader* h, StatsPoolGauges* out, StatsMemory* memory) {
+    StatsPoolGauges one[STATS_SHM_POOLS];
+    StatsMemory mem[STATS_SHM_MEMORY];
+    int npools = 0;
+
+    memset(memory, 0, sizeof(StatsMemory) * STATS_SHM_MEMORY);
+    for (uint32_t p = 0; p < h->nprocs; p++) {
+        memset(mem, 0, sizeof(mem));
+        int n = readProcessPools(&h->procs[p], one, mem);
+        for (int k = 0; k < STATS_SHM_MEMORY; k++) {
+            if (k == STATS_SHM_MEMORY - 1 && memory[k].total > 0) {
+                continue;
+            }
+            memory[k].total += mem[k].total;
+            memory[k].huge += mem[k].huge;
+            memory[k].locked += mem[k].locked;
+        }
+        for (int i = 0; i < n; i++) {
+            if (i >= npools) {
+                out[i] = one[i];
+                npools = i + 1;
+                continue;
+            }
+            out[i].threads += one[i].threads;
+            out[i].idle += one[i].idle;
+            out[i].depth += one[i].depth;
+            out[i].vip_depth += one[i].vip_depth;
+            out[i].capacity += one[i].capacity;
+            out[i].cost_us += one[i].cost_us;
+            out[i].dropped += one[i].dropped;
+        }
+    }
+    return npools;
+}
+
+static int alive(pid_t pid) {
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+// Upper bound of the bucket holding the p-th fraction of hist
+static double percentileUs(const unsigned long* hist, double p) {
+    unsigned long total = 0, seen = 0;
+
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        total += hist[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= p * total) {
+            return b == 0 ? 0 : ((1ull << b) - 1) / 1000.0;
+        }
+    }
+    return ((1ull << (HIST_BUCKETS - 1)) - 1) / 1000.0;
+}
+
+static void show(View* v, SlotCopy* prev, SlotCopy* cur, double interval, int clear) {
+    StatsShmHeader* h = v->header;
+    StatsPoolGauges pools[STATS_SHM_POOLS];
+    StatsMemory memory[STATS_SHM_MEMORY];
+    unsigned long delta_hist[TRACE_SPANS][HIST_BUCKETS];
+    unsigned long total = 0, delta = 0, stat = 0, dynm = 0, err = 0;
+    int n = atomic_load_explicit(&h->nslots, memory_order_acquire);
+    int running = 0, busy = 0, used = 0;
+
+    if (n > (int)h->capacity) {
+        n = h->capacity;
+    }
+    memset(delta_hist, 0, sizeof(delta_hist));
+    for (int i = 0; i < n; i++) {
+        readSlot(&v->slots[i], &cur[i]);
+        total += cur[i].total_req;
+        delta += cur[i].total_req - prev[i].total_req;
+        stat += cur[i].stat_req;
+        dynm += cur[i].dynm_req;
+        err += cur[i].err_req;
+        running += cur[i].active;
+        busy += cur[i].busy;
+        used += cur[i].active || cur[i].total_req > 0;
+        for (int s = 0; s < TRACE_SPANS; s++) {
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                delta_hist[s][b] += cur[i].span_hist[s][b] - prev[i].span_hist[s][b];
+            }
+        }
+    }
+
+    if (clear) {
+        printf("\033[H\033[J");
+    }
+    printf("server pid %d%s   threads %d running, %d busy   slots %d/%u\n",
+           h->pid, alive(h->pid) ? "" : " (exited)", running, busy, used, h->capacity);
+    if (h->nprocs > 1) {
+        printf("processes");
+        for (uint32_t p = 0; p < h->nprocs; p++) {
+            printf(" %d%s", h->procs[p].pid, alive(h->procs[p].pid) ? "" : "(down)");
+        }
+        printf("\n");
+    }
+    printf("requests %.1f/s   total %lu: static %lu dynamic %lu error %lu\n",
+           interval > 0 ? delta / interval : 0, total, stat, dynm, err);
+    printf("queue wait p50 %.1fus p99 %.1fus   service p50 %.1fus p99 %.1fus\n",
+           percentileUs(delta_hist[TRACE_SPAN_QUEUE_WAIT], 0.5), percentileUs(delta_hist[TRACE_SPAN_QUEUE_WAIT], 0.99),
+           percentileUs(delta_hist[TRACE_SPAN_SERVICE], 0.5), percentileUs(delta_hist[TRACE_SPAN_SERVICE], 0.99));
+
+    int npools = readPools(h, pools, memory);
+    static const char* kinds[STATS_SHM_MEMORY] = { "cache", "queues", "stats" };
+    printf("memory");
+    for (int k = 0; k < STATS_SHM_MEMORY; k++) {
+        printf("%s %s %.1f MB (huge %.1f, locked %.1f)", k > 0 ? "  " : "", kinds[k],
+               memory[k].total / 1048576.0, memory[k].huge / 1048576.0, memory[k].locked / 1048576.0);
+    }
+    printf("\n\n");
+    printf("%-10s %7s %5s %6s %5s %6s %10s %9s %s\n", "POOL", "THREADS", "IDLE", "DEPTH", "VIP", "CAP", "COST ms", "DROPPED", "POLICY");
+    for (int i = 0; i < npools; i++) {
+        StatsPoolGauges* g = &pools[i];
+        if (!g->has_queue) {
+            printf("%-10s %7d %5s %6d\n", g->name, g->threads, "-", g->depth);
+            continue;
+        }
+        printf("%-10s %7d %5d %6d %5d %6d %10.1f %9lu %s\n", g->name, g->threads, g->idle, g->depth,
+               g->vip_depth, g->capacity, g->cost_us / 1000.0, g->dropped, g->policy);
+    }
+
+    printf("\n%4s %6s %-6s %9s %10s %10s %10s %8s\n", "PROC", "ID", "STATE", "REQ/S", "TOTAL", "STATIC", "DYNAMIC", "ERROR");
+    for (int i = 0; i < n; i++) {
+        if (!cur[i].active && cur[i].total_req == 0) {
+            continue;
+        }
+        char id[16];
+        if (cur[i].id == -1) {
+            snprintf(id, sizeof(id), "vip");
+        }
+        else {
+            snprintf(id, sizeof(id), "%d", cur[i].id);
+        }
+        printf("%4u %6s %-6s %9.1f %10lu %10lu %10lu %8lu\n", i / h->proc_slots, id,
+               !cur[i].active ? "gone" : cur[i].busy ? "busy" : "idle",
+               interval > 0 ? (cur[i].total_req - prev[i].total_req) / interval : 0,
+               cur[i].total_req, cur[i].stat_req, cur[i].dynm_req, cur[i].err_req);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    char name[64];
+    double interval = 1;
+    int count = 0, opt;
+    View v;
+
+    while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch (opt) {
+        case 'i': interval = atof(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-i seconds] [-n count] <port | /segment>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1 || interval <= 0) {
+        fprintf(stderr, "Usage: %s [-i seconds] [-n count] <port | /segment>\n", argv[0]);
+        exit(1);
+    }
+    if (argv[optind][0] == '/') {
+        snprintf(name, sizeof(name), "%s", argv[optind]);
+    }
+    else {
+        snprintf(name, sizeof(name), STATS_SHM_DEFAULT, atoi(argv[optind]));
+    }
+    if (attach(name, &v) < 0) {
+        fprintf(stderr, "%s: %s (is the server running?)\n", name, strerror(errno));
+        exit(1);
+    }
+
+    SlotCopy* prev = calloc(v.header->capacity, sizeof(SlotCopy));
+    SlotCopy* cur = calloc(v.header->capacity, sizeof(SlotCopy));
+    int clear = count == 0 && isatty(STDOUT_FILENO);
+    struct timespec pause = { (time_t)interval, (long)((interval - (time_t)interval) * 1e9) };
+    double elapsed = 0;
+
+    if (prev == NULL || cur == NULL) {
+        exit(1);
+    }
+    // The first view shows totals since startup, later ones rates over the interval
+    for (int i = 0; count == 0 || i < count; i++) {
+        show(&v, prev, cur, elapsed, clear);
+        SlotCopy* t = prev;
+        prev = cur;
+        cur = t;
+        if (count != 0 && i == count - 1) {
+            break;
+        }
+        nanosleep(&pause, NULL);
+        elapsed = interval;
+
+        // A restarted server publishes a fresh segment under the same name
+        if (kill(v.header->pid, 0) < 0 && errno == ESRCH) {
+            View next = { NULL, 0, NULL };
+            if (attach(name, &next) == 0 && next.header->pid != v.header->pid) {
+                detach(&v);
+                v = next;
+                free(prev);
+                free(cur);
+                prev = calloc(v.header->capacity, sizeof(SlotCopy));
+                cur = calloc(v.header->capacity, sizeof(SlotCopy));
+                if (prev == NULL || cur == NULL) {
+                    exit(1);
+                }
+                elapsed = 0;
+            }
+            else if (next.header != NULL && next.header != v.header) {
+                detach(&next);
+            }
+        }
+    }
+    detach(&v);
+    free(prev);
+    free(cur);
+    return 0;
+}
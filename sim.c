@@ -0,0 +1,377 @@
+/*
+ * sim.c: Offline discrete-event simulator for the scheduling and overload policies.
+ *
+ * Runs the real queue.c code against a virtual clock, so thread counts, queue
+ * sizes and schedalg choices can be compared in seconds without a server.
+ *
+ * To run, try:
+ *      ./sim -r 400 -s 0.8 -D 0.05,0.5 -v 0.05 -t 2,4,8,16 -q 8,64
+ *      ./sim -f arrivals.txt -t 4,8 -p block,drop_head
+ *
+ * Synthetic workload (default):
+ *      -n <count>   requests to simulate (default 100000)
+ *      -r <rate>    mean arrivals per second, Poisson (default 200)
+ *      -s <frac>    fraction of static requests (default 0.9)
+ *      -S <sec>     mean static service time, exponential (default 0.0005)
+ *      -D <list>    dynamic service times in seconds, e.g. output.cgi spin
+ *                   values, chosen uniformly (default 0.1,0.5,1)
+ *      -v <frac>    fraction of VIP requests (default 0)
+ *      -x <seed>    random seed (default 1)
+ * Trace workload:
+ *      -f <file>    lines of "<arrival sec> <static|dynamic> <service sec> [vip]"
+ * Sweep:
+ *      -t <list>    worker thread counts (default 1,2,4,8)
+ *      -q <list>    queue sizes (default 16)
+ *      -p <list>    overload policies (default all)
+ *      -a <list>    shortest-job-first aging factors, 0 = FIFO (default 0);
+ *                   jobs are priced at their true service time
+ *      -j           print JSON lines instead of a table
+ */
+
+#include "segel.h"
+#include "queue.h"
+
+#define MAX_SWEEP 32
+
+typedef struct Job {
+    double arrival;
+    double service;
+    int vip;
+    int dynamic;
+} Job;
+
+typedef struct Event {
+    double time;
+    int worker;      // -1 for the next arrival
+    int job;
+} Event;
+
+typedef struct Sim {
+    Job* jobs;
+    int njobs;
+    Queue q;
+    int threads;
+
+    Event* heap;
+    int nheap;
+
+    int* blocked;    // Arrivals stalled in accept() under the block policy
+    int nblocked, blocked_front;
+
+    int* busy;       // Job per worker, -1 when idle; the last worker is the VIP thread
+    double now;
+
+    double* waits;   // Queue wait (incl. blocked time) of completed jobs
+    double* responses;
+    int completed, dropped;
+} Sim;
+
+static int parseList(char* arg, double* out) {
+    int n = 0;
+    for (char* tok = strtok(arg, ","); tok != NULL && n < MAX_SWEEP; tok = strtok(NULL, ",")) {
+        out[n++] = atof(tok);
+    }
+    return n;
+}
+
+static double expRandom(double mean) {
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return -mean * log(u);
+}
+
+/**********************************
+ * Event heap, ordered by time
+ **********************************/
+
+static void heapPush(Sim* s, Event e) {
+    int i = s->nheap++;
+    while (i > 0 && s->heap[(i - 1) / 2].time > e.time) {
+        s->heap[i] = s->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    s->heap[i] = e;
+}
+
+static Event heapPop(Sim* s) {
+    Event top = s->heap[0], last = s->heap[--s->nheap];
+    int i = 0;
+
+    while (2 * i + 1 < s->nheap) {
+        int c = 2 * i + 1;
+        if (c + 1 < s->nheap && s->heap[c + 1].time < s->heap[c].time) {
+            c++;
+        }
+        if (last.time <= s->heap[c].time) {
+            break;
+        }
+        s->heap[i] = s->heap[c];
+        i = c;
+    }
+    s->heap[i] = last;
+    return top;
+}
+
+/**********************************
+ * Simulation
+ **********************************/
+
+static Sim* current;
+
+static void countDrop(Request req) {
+    current->dropped++;
+}
+
+static void startJob(Sim* s, int worker, Request req) {
+    Job* job = &s->jobs[req.connfd];
+
+    s->busy[worker] = req.connfd;
+    heapPush(s, (Event) { s->now + job->service, worker, req.connfd });
+}
+
+static void dispatch(Sim* s) {
+    for (int w = 0; w <= s->threads; w++) {
+        int vip = w == s->threads;
+        if (s->busy[w] >= 0) {
+            continue;
+        }
+        if (vip ? s->q.vip_size == 0 : isQueueEmpty(&s->q)) {
+            continue;
+        }
+        startJob(s, w, dequeue(&s->q, vip));
+    }
+}
+
+static int queueFullFor(Sim* s, int vip) {
+    return vip ? s->q.vip_size == s->q.capacity : isQueueFull(&s->q);
+}
+
+static void admit(Sim* s, int id) {
+    Request req = { .connfd = id };
+    req.is_vip = s->jobs[id].vip;
+    // Virtual time in ns; clockToNs passes it through since clockInit never ran
+    req.cost = s->jobs[id].service * 1e6 + 1;
+    req.trace.stamp[STAGE_ENQUEUE] = s->now * 1e9;
+    enqueue(&s->q, req, req.is_vip);
+}
+
+static void arrive(Sim* s, int id) {
+    // A blocked acceptor stalls every later arrival behind it
+    if (s->q.policy == POLICY_BLOCK && (s->nblocked > s->blocked_front || queueFullFor(s, s->jobs[id].vip))) {
+        s->blocked[s->nblocked++] = id;
+        return;
+    }
+    admit(s, id);
+}
+
+static void unblock(Sim* s) {
+    while (s->blocked_front < s->nblocked && !queueFullFor(s, s->jobs[s->blocked[s->blocked_front]].vip)) {
+        admit(s, s->blocked[s->blocked_front++]);
+    }
+}
+
+static int cmpDouble(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double* sorted, int n, double p) {
+    return n ? sorted[(int)((n - 1) * p)] : 0;
+}
+
+static void runOne(Job* jobs, int njobs, int threads, int queue_size, OverloadPolicy policy, int aging, int json) {
+    Sim s;
+
+    memset(&s, 0, sizeof(s));
+    s.jobs = jobs;
+    s.njobs = njobs;
+    s.threads = threads;
+    s.heap = malloc(sizeof(Event) * (threads + 2));
+    s.blocked = malloc(sizeof(int) * njobs);
+    s.busy = malloc(sizeof(int) * (threads + 1));
+    s.waits = malloc(sizeof(double) * njobs);
+    s.responses = malloc(sizeof(double) * njobs);
+    if (!s.heap || !s.blocked || !s.busy || !s.waits || !s.responses) {
+        exit(1);
+    }
+    for (int w = 0; w <= threads; w++) {
+        s.busy[w] = -1;
+    }
+    current = &s;
+    initQueue(&s.q, queue_size, policy);
+    setQueueAging(&s.q, aging);
+    s.q.on_drop = countDrop;
+
+    int next_arrival = 0;
+    if (njobs > 0) {
+        heapPush(&s, (Event) { jobs[0].arrival, -1, 0 });
+    }
+
+    while (s.nheap > 0) {
+        Event e = heapPop(&s);
+        s.now = e.time;
+
+        if (e.worker < 0) {
+            arrive(&s, e.job);
+            if (++next_arrival < njobs) {
+                heapPush(&s, (Event) { jobs[next_arrival].arrival, -1, next_arrival });
+            }
+        }
+        else {
+            Job* job = &jobs[e.job];
+            double response = s.now - job->arrival;
+            s.waits[s.completed] = response - job->service;
+            s.responses[s.completed] = response;
+            s.completed++;
+            s.busy[e.worker] = -1;
+            unblock(&s);
+        }
+        dispatch(&s);
+    }
+
+    double span = s.now - (njobs ? jobs[0].arrival : 0);
+    qsort(s.waits, s.completed, sizeof(double), cmpDouble);
+    qsort(s.responses, s.completed, sizeof(double), cmpDouble);
+
+    if (json) {
+        printf("{\"policy\":\"%s\",\"threads\":%d,\"queue_size\":%d,\"aging\":%d,\"requests\":%d,\"completed\":%d,"
+               "\"throughput\":%.2f,\"drop_rate\":%.4f,\"wait_p50\":%.6f,\"wait_p95\":%.6f,\"wait_p99\":%.6f,"
+               "\"response_p99\":%.6f}\n",
+               policy_names[policy], threads, queue_size, aging, njobs, s.completed,
+               span > 0 ? s.completed / span : 0, njobs ? (double)s.dropped / njobs : 0,
+               percentile(s.waits, s.completed, 0.5), percentile(s.waits, s.completed, 0.95),
+               percentile(s.waits, s.completed, 0.99), percentile(s.responses, s.completed, 0.99));
+    }
+    else {
+        printf("%-12s %7d %6d %5d %10.1f %8.2f%% %10.4f %10.4f %10.4f %12.4f\n",
+               policy_names[policy], threads, queue_size, aging,
+               span > 0 ? s.completed / span : 0, njobs ? 100.0 * s.dropped / njobs : 0,
+               percentile(s.waits, s.completed, 0.5), percentile(s.waits, s.completed, 0.95),
+               percentile(s.waits, s.completed, 0.99), percentile(s.responses, s.completed, 0.99));
+    }
+
+    destroyQueue(&s.q);
+    free(s.heap);
+    free(s.blocked);
+    free(s.busy);
+    free(s.waits);
+    free(s.responses);
+}
+
+static int loadTrace(const char* path, Job** out) {
+    FILE* f = fopen(path, "r");
+    char line[MAXLINE], kind[MAXLINE], vip[MAXLINE];
+    int n = 0, cap = 1024;
+    Job* jobs = malloc(sizeof(Job) * cap);
+
+    if (f == NULL || jobs == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        Job j = { 0 };
+        int fields = sscanf(line, "%lf %s %lf %s", &j.arrival, kind, &j.service, vip);
+        if (fields < 3 || line[0] == '#') {
+            continue;
+        }
+        j.dynamic = strcmp(kind, "dynamic") == 0;
+        j.vip = fields == 4 && strcmp(vip, "vip") == 0;
+        if (n == cap) {
+            cap *= 2;
+            jobs = realloc(jobs, sizeof(Job) * cap);
+            if (jobs == NULL) {
+                exit(1);
+            }
+        }
+        jobs[n++] = j;
+    }
+    fclose(f);
+    *out = jobs;
+    return n;
+}
+
+static int synthesize(int n, double rate, double static_frac, double static_mean,
+                      double* spins, int nspins, double vip_frac, Job** out) {
+    Job* jobs = malloc(sizeof(Job) * n);
+    double t = 0;
+
+    if (jobs == NULL) {
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        t += expRandom(1.0 / rate);
+        jobs[i].arrival = t;
+        jobs[i].dynamic = rand() >= static_frac * RAND_MAX;
+        jobs[i].service = jobs[i].dynamic ? spins[rand() % nspins] : expRandom(static_mean);
+        jobs[i].vip = rand() < vip_frac * RAND_MAX;
+    }
+    *out = jobs;
+    return n;
+}
+
+int main(int argc, char* argv[]) {
+    double threads[MAX_SWEEP] = { 1, 2, 4, 8 }, sizes[MAX_SWEEP] = { 16 }, spins[MAX_SWEEP] = { 0.1, 0.5, 1 };
+    double agings[MAX_SWEEP] = { 0 };
+    int nthreads = 4, nsizes = 1, nspins = 3, nagings = 1;
+    int policies[POLICY_COUNT] = { POLICY_BLOCK, POLICY_DROP_TAIL, POLICY_DROP_HEAD, POLICY_DROP_RANDOM };
+    int npolicies = POLICY_COUNT;
+    int n = 100000, json = 0;
+    double rate = 200, static_frac = 0.9, static_mean = 0.0005, vip_frac = 0;
+    unsigned int seed = 1;
+    char* trace = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:s:S:D:v:x:f:t:q:p:a:j")) != -1) {
+        switch (opt) {
+        case 'n': n = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 's': static_frac = atof(optarg); break;
+        case 'S': static_mean = atof(optarg); break;
+        case 'D': nspins = parseList(optarg, spins); break;
+        case 'v': vip_frac = atof(optarg); break;
+        case 'x': seed = atoi(optarg); break;
+        case 'f': trace = optarg; break;
+        case 't': nthreads = parseList(optarg, threads); break;
+        case 'q': nsizes = parseList(optarg, sizes); break;
+        case 'a': nagings = parseList(optarg, agings); break;
+        case 'j': json = 1; break;
+        case 'p':
+            npolicies = 0;
+            for (char* tok = strtok(optarg, ","); tok != NULL && npolicies < POLICY_COUNT; tok = strtok(NULL, ",")) {
+                if ((policies[npolicies] = policyFromName(tok)) < 0) {
+                    fprintf(stderr, "unknown policy %s\n", tok);
+                    exit(1);
+                }
+                npolicies++;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n count] [-r rate] [-s static] [-S sec] [-D spins] [-v vip] [-x seed]"
+                    " [-f trace] [-t threads] [-q sizes] [-p policies] [-a agings] [-j]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (nspins == 0) {
+        exit(1);
+    }
+
+    srand(seed);
+    Job* jobs;
+    int njobs = trace ? loadTrace(trace, &jobs) : synthesize(n, rate, static_frac, static_mean, spins, nspins, vip_frac, &jobs);
+
+    if (!json) {
+        printf("%-12s %7s %6s %5s %10s %9s %10s %10s %10s %12s\n",
+               "policy", "threads", "queue", "aging", "req/s", "dropped", "wait p50", "wait p95", "wait p99", "response p99");
+    }
+    for (int p = 0; p < npolicies; p++) {
+        for (int t = 0; t < nthreads; t++) {
+            for (int q = 0; q < nsizes; q++) {
+                for (int a = 0; a < nagings; a++) {
+                    srand(seed);     // Same drop_random choices for every configuration
+                    runOne(jobs, njobs, (int)threads[t], (int)sizes[q], policies[p], (int)agings[a], json);
+                }
+            }
+        }
+    }
+    free(jobs);
+    return 0;
+}
@@ -0,0 +1,323 @@
+//
+// stats.c: Lock-free per-thread request statistics.
+//
+
+#include "segel.h"
+#include "stats.h"
+#include "hugemem.h"
+#include <sched.h>
+
+static StatsShmHeader* header;
+static StatsProcess* process;        // This process's entry in the header
+static struct Threads_stats* all;    // Every process's slots
+static struct Threads_stats* slots;  // This process's range of them
+static int capacity;
+static int nslots;                   // Slots ever handed out, read without the lock
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static char shared_name[64];         // The segment to unlink on the way out, if any
+static pid_t shared_owner;
+
+void statsInit(int n) {
+    statsInitShared(n, 1, NULL);
+}
+
+//
+// Returns the pid of the server still publishing to segment shm_name, or 0
+// when there is none: no segment, a foreign or half-written one, or one
+// whose owner has exited.
+//
+static pid_t statsSegmentOwner(const char* shm_name) {
+    struct stat st;
+    pid_t owner = 0;
+    int fd = shm_open(shm_name, O_RDONLY, 0);
+
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(StatsShmHeader)) {
+        StatsShmHeader* old = mmap(NULL, sizeof(StatsShmHeader), PROT_READ, MAP_SHARED, fd, 0);
+        if (old != MAP_FAILED) {
+            if (old->magic == STATS_SHM_MAGIC && old->pid > 0 && old->pid != getpid()
+                && (kill(old->pid, 0) == 0 || errno == EPERM)) {
+                owner = old->pid;
+            }
+            munmap(old, sizeof(StatsShmHeader));
+        }
+    }
+    close(fd);
+    return owner;
+}
+
+//
+// Lays out the header and n slots for each of nprocs processes in a
+// shared-memory segment called shm_name, or in private memory when it is
+// NULL, cannot be created or belongs to a running server. The caller is
+// process 0 until it attaches as another.
+//
+void statsInitShared(int n, int nprocs, const char* shm_name) {
+    size_t offset = (sizeof(StatsShmHeader) + STATS_CACHELINE - 1) & ~(size_t)(STATS_CACHELINE - 1);
+    size_t size;
+
+    if (nprocs < 1 || nprocs > STATS_SHM_PROCS) {
+        fprintf(stderr, "stats: at most %d processes\n", STATS_SHM_PROCS);
+        exit(1);
+    }
+    size = offset + sizeof(struct Threads_stats) * n * nprocs;
+    void* mem = MAP_FAILED;
+
+    pid_t owner = shm_name != NULL ? statsSegmentOwner(shm_name) : 0;
+    if (owner != 0) {
+        // Most likely a second server on a port the first still holds:
+        // leave its segment alone, it is about to fail to bind anyway
+        fprintf(stderr, "stats: %s belongs to running server %d\n", shm_name, (int)owner);
+    }
+    else if (shm_name != NULL) {
+        // Replace a segment left by an earlier run rather than truncate
+        // it under a monitor that still has it mapped
+        shm_unlink(shm_name);
+        int fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd >= 0 && ftruncate(fd, size) == 0) {
+            mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "stats: cannot share %s: %s\n", shm_name, strerror(errno));
+            shm_unlink(shm_name);
+        }
+        else {
+            snprintf(shared_name, sizeof(shared_name), "%s", shm_name);
+            shared_owner = getpid();
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (mem == MAP_FAILED) {
+        // Shared all the same, so pre-forked processes still aggregate
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            exit(1);
+        }
+    }
+    // Every worker writes its slot on each request
+    hugememAdvise(MEM_STATS, mem, size);
+
+    header = mem;
+    all = (struct Threads_stats*)((char*)mem + offset);
+    header->header_size = sizeof(StatsShmHeader);
+    header->slot_size = sizeof(struct Threads_stats);
+    header->slots_offset = offset;
+    header->capacity = n * nprocs;
+    header->nprocs = nprocs;
+    header->proc_slots = n;
+    header->trace_spans = TRACE_SPANS;
+    header->hist_buckets = HIST_BUCKETS;
+    header->pid = getpid();
+    header->version = STATS_SHM_VERSION;
+    // Readers check the magic first, so it goes last
+    atomic_thread_fence(memory_order_release);
+    header->magic = STATS_SHM_MAGIC;
+    statsAttachProcess(0);
+}
+
+//
+// Removes the segment statsInitShared created, so a stopped server leaves
+// nothing in /dev/shm. Only the process that created it does so, not the
+// pre-forked children; async-signal-safe, for the shutdown handlers.
+//
+void statsUnlinkShared(void) {
+    if (shared_name[0] != '\0' && getpid() == shared_owner) {
+        shm_unlink(shared_name);
+        shared_name[0] = '\0';
+    }
+}
+
+//
+// Takes over slot range index, before any thread has a slot. A restarted
+// process keeps the counts of the one it replaces but none of its threads.
+//
+void statsAttachProcess(int index) {
+    capacity = header->proc_slots;
+    nslots = 0;
+    slots = all + (size_t)index * capacity;
+    process = &header->procs[index];
+    for (int i = 0; i < capacity; i++) {
+        // A writer that died mid-update would leave readers spinning
+        unsigned int seq = atomic_load_explicit(&slots[i].seq, memory_order_relaxed);
+        if (seq & 1) {
+            atomic_store_explicit(&slots[i].seq, seq + 1, memory_order_release);
+        }
+        atomic_store_explicit(&slots[i].busy, 0, memory_order_relaxed);
+        atomic_store_explicit(&slots[i].active, 0, memory_order_relaxed);
+    }
+    process->pid = getpid();
+}
+
+//
+// Called by a single publisher thread
+//
+void statsPublishPools(const StatsPoolGauges* pools, int n, const StatsMemory* memory) {
+    unsigned int seq = atomic_load_explicit(&process->pools_seq, memory_order_relaxed);
+
+    if (n > STATS_SHM_POOLS) {
+        n = STATS_SHM_POOLS;
+    }
+    atomic_store_explicit(&process->pools_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    process->npools = n;
+    memcpy(process->pools, pools, sizeof(StatsPoolGauges) * n);
+    memcpy(process->memory, memory, sizeof(process->memory));
+    atomic_store_explicit(&process->pools_seq, seq + 2, memory_order_release);
+}
+
+int statsCount(void) {
+    return __atomic_load_n(&nslots, __ATOMIC_ACQUIRE);
+}
+
+int statsCapacity(void) {
+    return capacity;
+}
+
+threads_stats statsSlot(int index, int id) {
+    if (index < 0 || index >= capacity) {
+        return NULL;
+    }
+    slots[index].id = id;
+    atomic_store_explicit(&slots[index].active, 1, memory_order_relaxed);
+    if (index >= nslots) {
+        __atomic_store_n(&nslots, index + 1, __ATOMIC_RELEASE);
+        // Other processes raise it too
+        unsigned int top = (unsigned int)(slots - all) + index + 1;
+        unsigned int seen = atomic_load_explicit(&header->nslots, memory_order_relaxed);
+        while (seen < top && !atomic_compare_exchange_weak_explicit(&header->nslots, &seen, top, memory_order_release, memory_order_relaxed)) {
+        }
+    }
+    return &slots[index];
+}
+
+//
+// Hands a new thread a slot: a retired one of the same kind if there is one,
+// so VIP and worker counts stay apart. Workers are numbered by slot.
+//
+threads_stats statsAcquire(int vip) {
+    threads_stats t = NULL;
+
+    pthread_mutex_lock(&slots_lock);
+    for (int i = 0; i < nslots; i++) {
+        if (!atomic_load_explicit(&slots[i].active, memory_order_relaxed) && (slots[i].id == -1) == (vip != 0)) {
+            t = statsSlot(i, slots[i].id);
+            break;
+        }
+    }
+    if (t == NULL) {
+        t = statsSlot(nslots, vip ? -1 : nslots);
+    }
+    pthread_mutex_unlock(&slots_lock);
+    return t;
+}
+
+// The owning thread is exiting
+void statsRelease(threads_stats t) {
+    pthread_mutex_lock(&slots_lock);
+    atomic_store_explicit(&t->busy, 0, memory_order_relaxed);
+    atomic_store_explicit(&t->active, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&slots_lock);
+}
+
+int statsIndex(threads_stats t) {
+    return t - slots;
+}
+
+//
+// Called by the owning thread only
+//
+void statsRecord(threads_stats t, StatKind kind) {
+    unsigned int seq = atomic_load_explicit(&t->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&t->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&t->total_req, atomic_load_explicit(&t->total_req, memory_order_relaxed) + 1, memory_order_relaxed);
+    if (kind == STAT_STATIC) {
+        atomic_store_explicit(&t->stat_req, atomic_load_explicit(&t->stat_req, memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+    else if (kind == STAT_DYNAMIC) {
+        atomic_store_explicit(&t->dynm_req, atomic_load_explicit(&t->dynm_req, memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+    else if (kind == STAT_ERROR) {
+        atomic_store_explicit(&t->err_req, atomic_load_explicit(&t->err_req, memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&t->seq, seq + 2, memory_order_release);
+}
+
+void statsRecordSpans(threads_stats t, const uint64_t* span_ns) {
+    unsigned int seq = atomic_load_explicit(&t->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&t->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (int i = 0; i < TRACE_SPANS; i++) {
+        atomic_ulong* bucket = &t->span_hist[i][traceBucket(span_ns[i])];
+        atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_store_explicit(&t->span_sum[i], atomic_load_explicit(&t->span_sum[i], memory_order_relaxed) + span_ns[i], memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&t->seq, seq + 2, memory_order_release);
+}
+
+void statsSetBusy(threads_stats t, int busy) {
+    atomic_store_explicit(&t->busy, busy, memory_order_relaxed);
+}
+
+void statsSnapshot(threads_stats t, StatsSnapshot* out) {
+    unsigned int before, after;
+
+    do {
+        while ((before = atomic_load_explicit(&t->seq, memory_order_acquire)) & 1) {
+            sched_yield();
+        }
+        out->id = t->id;
+        out->stat_req = atomic_load_explicit(&t->stat_req, memory_order_relaxed);
+        out->dynm_req = atomic_load_explicit(&t->dynm_req, memory_order_relaxed);
+        out->total_req = atomic_load_explicit(&t->total_req, memory_order_relaxed);
+        out->err_req = atomic_load_explicit(&t->err_req, memory_order_relaxed);
+        out->vip_req = t->id == -1 ? out->total_req : 0;
+        out->busy = atomic_load_explicit(&t->busy, memory_order_relaxed);
+        out->threads = atomic_load_explicit(&t->active, memory_order_relaxed);
+        for (int i = 0; i < TRACE_SPANS; i++) {
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                out->span_hist[i][b] = atomic_load_explicit(&t->span_hist[i][b], memory_order_relaxed);
+            }
+            out->span_sum[i] = atomic_load_explicit(&t->span_sum[i], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&t->seq, memory_order_relaxed);
+    } while (before != after);
+}
+
+//
+// Sums every slot in the segment, those of the other server processes too
+//
+void statsAggregate(StatsSnapshot* out) {
+    StatsSnapshot s;
+    int n = atomic_load_explicit(&header->nslots, memory_order_acquire);
+
+    memset(out, 0, sizeof(StatsSnapshot));
+    out->id = -2;
+    for (int i = 0; i < n; i++) {
+        statsSnapshot(&all[i], &s);
+        out->stat_req += s.stat_req;
+        out->dynm_req += s.dynm_req;
+        out->total_req += s.total_req;
+        out->err_req += s.err_req;
+        out->vip_req += s.vip_req;
+        out->busy += s.busy;
+        out->threads += s.threads;
+        for (int span = 0; span < TRACE_SPANS; span++) {
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                out->span_hist[span][b] += s.span_hist[span][b];
+            }
+            out->span_sum[span] += s.span_sum[span];
+        }
+    }
+}
@@ -0,0 +1,123 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include "trace.h"
+
+#define STATS_CACHELINE 64
+
+// Per-thread statistics. Slots live in one contiguous array, each padded to
+// its own cache line; only the owning thread writes a slot, readers use
+// statsSnapshot() which retries until it sees a consistent copy (seqlock).
+// The array is sized once for the most threads the pool may grow to; slots
+// of retired threads keep their counts and are reused by new ones. With
+// statsInitShared it lives in a POSIX shared-memory segment, so monitors
+// read it without going through the server. Pre-forked server processes
+// each own a range of it and aggregate over all of them.
+typedef struct Threads_stats {
+    int id;
+    atomic_int active;               // Owned by a running thread
+    atomic_uint seq;                 // Odd while the owner is updating
+    atomic_ulong stat_req;
+    atomic_ulong dynm_req;
+    atomic_ulong total_req;
+    atomic_ulong err_req;
+    atomic_int busy;                 // Serving a request right now
+    atomic_ulong span_hist[TRACE_SPANS][HIST_BUCKETS];  // Latency per stage, ns
+    atomic_ulong span_sum[TRACE_SPANS];
+} __attribute__((aligned(STATS_CACHELINE))) * threads_stats;
+
+typedef struct StatsSnapshot {
+    int id;
+    unsigned long stat_req;
+    unsigned long dynm_req;
+    unsigned long total_req;
+    unsigned long err_req;
+    unsigned long vip_req;           // Requests served by VIP threads (id -1)
+    int busy;                        // Threads busy (1/0 for a single thread)
+    int threads;                     // Running threads (1/0 for a single slot)
+    unsigned long span_hist[TRACE_SPANS][HIST_BUCKETS];
+    unsigned long span_sum[TRACE_SPANS];
+} StatsSnapshot;
+
+typedef enum { STAT_NONE, STAT_STATIC, STAT_DYNAMIC, STAT_ERROR } StatKind;
+
+/*** Shared-memory segment, read by ./serverstat ***/
+
+#define STATS_SHM_MAGIC 0x53545453u   // "STTS"
+#define STATS_SHM_VERSION 3
+#define STATS_SHM_POOLS 4
+#define STATS_SHM_PROCS 64           // Most server processes sharing a segment
+#define STATS_SHM_NAME 24
+#define STATS_SHM_MEMORY 3           // Memory kinds: cache, queue rings, this segment
+#define STATS_PUBLISH_MS 100         // How often the pool gauges are refreshed
+#define STATS_SHM_DEFAULT "/os-hw3-stats.%d"   // Segment name, given the port
+
+// Queue gauges of one pool
+typedef struct StatsPoolGauges {
+    char name[STATS_SHM_NAME];
+    char policy[STATS_SHM_NAME];
+    int threads;                     // Configured
+    int idle;                        // Workers waiting for a request
+    int depth;
+    int vip_depth;
+    int capacity;
+    int has_queue;                   // 0 for a pool sharing another's queue
+    unsigned long cost_us;
+    unsigned long dropped;
+} StatsPoolGauges;
+
+// Memory of one kind, in bytes
+typedef struct StatsMemory {
+    uint64_t total;
+    uint64_t huge;                   // Backed by (or hinted for) huge pages
+    uint64_t locked;
+} StatsMemory;
+
+// One server process: its pool gauges and memory, written under pools_seq
+typedef struct StatsProcess {
+    int32_t pid;                     // 0 until the process has started
+    atomic_uint pools_seq;           // Odd while the gauges are updated
+    uint32_t npools;
+    StatsPoolGauges pools[STATS_SHM_POOLS];
+    StatsMemory memory[STATS_SHM_MEMORY];
+} StatsProcess;
+
+// Start of the segment; the slot array follows at slots_offset, split into
+// nprocs ranges of proc_slots, one per server process. Everything is written
+// by the server only: slots through their seqlocks, the gauges of each
+// process under its pools_seq.
+typedef struct StatsShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t slot_size;              // sizeof(struct Threads_stats)
+    uint32_t slots_offset;
+    uint32_t capacity;
+    uint32_t trace_spans;
+    uint32_t hist_buckets;
+    int32_t pid;                     // The server, or the master of pre-forked ones
+    atomic_uint nslots;              // Highest slot in use so far, plus one
+    uint32_t nprocs;
+    uint32_t proc_slots;
+    StatsProcess procs[STATS_SHM_PROCS];
+} StatsShmHeader;
+
+void statsInit(int capacity);
+void statsInitShared(int capacity, int nprocs, const char* shm_name);
+void statsUnlinkShared(void);
+void statsAttachProcess(int index);
+void statsPublishPools(const StatsPoolGauges* pools, int n, const StatsMemory* memory);
+int statsCount(void);
+int statsCapacity(void);
+threads_stats statsSlot(int index, int id);
+threads_stats statsAcquire(int vip);
+void statsRelease(threads_stats t);
+int statsIndex(threads_stats t);
+void statsRecord(threads_stats t, StatKind kind);
+void statsRecordSpans(threads_stats t, const uint64_t* span_ns);
+void statsSetBusy(threads_stats t, int busy);
+void statsSnapshot(threads_stats t, StatsSnapshot* out);
+void statsAggregate(StatsSnapshot* out);
+
+#endif
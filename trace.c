@@ -0,0 +1,170 @@
+//
+// trace.c: Per-stage request latency, as histograms and sampled full traces.
+//
+// Histograms live in each thread's stats slot. Every sample_every-th request a
+// worker also copies its full trace into a small shared ring; SIGUSR1 makes
+// the reporter thread print both to stderr.
+//
+
+#include "segel.h"
+#include "trace.h"
+#include "stats.h"
+
+#define TRACE_RING 256
+
+const char* trace_span_names[TRACE_SPANS] = {
+    "classify", "enqueue", "queue_wait", "parse", "lookup",
+    "first_byte", "transfer", "close", "total", "service"
+};
+
+typedef struct TraceSample {
+    atomic_uint seq;        // Odd while being written
+    int thread_id;
+    RequestTrace trace;
+} TraceSample;
+
+static const char* stage_names[STAGE_COUNT] = {
+    "accept", "classify", "enqueue", "dequeue", "parse", "lookup",
+    "first_byte", "last_byte", "close"
+};
+
+static TraceSample samples[TRACE_RING];
+static atomic_uint sample_next;
+static int sample_every;
+static __thread unsigned int sample_countdown;
+
+void traceInit(int every) {
+    sample_every = every;
+}
+
+int traceBucket(uint64_t ns) {
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+// Upper bound (inclusive) of a bucket, in ns
+uint64_t traceBucketBound(int bucket) {
+    return bucket == 0 ? 0 : (1ull << bucket) - 1;
+}
+
+void traceSetUri(RequestTrace* trace, const char* uri) {
+    uint32_t h = 2166136261u;
+    size_t len = strnlen(uri, TRACE_URI);
+
+    // A prefix, NUL padded but not necessarily terminated
+    memcpy(trace->uri, uri, len);
+    memset(trace->uri + len, 0, TRACE_URI - len);
+    while (*uri) {
+        h = (h ^ (unsigned char)*uri++) * 16777619u;
+    }
+    trace->uri_hash = h;
+}
+
+//
+// Called by the worker once the connection is closed
+//
+void traceRecord(struct Threads_stats* t_stats, RequestTrace* trace) {
+    uint64_t span_ns[TRACE_SPANS];
+
+    // Stages a request never reached (e.g. an early error) take zero time
+    for (int i = 1; i < STAGE_COUNT; i++) {
+        if (trace->stamp[i] < trace->stamp[i - 1]) {
+            trace->stamp[i] = trace->stamp[i - 1];
+        }
+    }
+    for (int i = 0; i < STAGE_COUNT - 1; i++) {
+        span_ns[i] = clockToNs(trace->stamp[i + 1] - trace->stamp[i]);
+    }
+    span_ns[TRACE_SPAN_TOTAL] = clockToNs(trace->stamp[STAGE_CLOSE] - trace->stamp[STAGE_ACCEPT]);
+    span_ns[TRACE_SPAN_SERVICE] = clockToNs(trace->stamp[STAGE_CLOSE] - trace->stamp[STAGE_DEQUEUE]);
+
+    statsRecordSpans(t_stats, span_ns);
+
+    if (sample_every <= 0) {
+        return;
+    }
+    if (sample_countdown-- > 0) {
+        return;
+    }
+    sample_countdown = sample_every - 1;
+
+    TraceSample* s = &samples[atomic_fetch_add_explicit(&sample_next, 1, memory_order_relaxed) % TRACE_RING];
+    unsigned int seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, seq | 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    s->thread_id = t_stats->id;
+    s->trace = *trace;
+    atomic_store_explicit(&s->seq, (seq | 1) + 1, memory_order_release);
+}
+
+void traceDump(FILE* out) {
+    StatsSnapshot* total = malloc(sizeof(StatsSnapshot));
+    if (total == NULL) {
+        return;
+    }
+    statsAggregate(total);
+
+    fprintf(out, "# span histograms (count per log2 ns bucket)\n");
+    for (int i = 0; i < TRACE_SPANS; i++) {
+        unsigned long count = 0;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            count += total->span_hist[i][b];
+        }
+        fprintf(out, "%-10s count=%lu mean_ns=%lu", trace_span_names[i], count,
+                count ? total->span_sum[i] / count : 0);
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            if (total->span_hist[i][b]) {
+                fprintf(out, " le%lu:%lu", (unsigned long)traceBucketBound(b), total->span_hist[i][b]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+    free(total);
+
+    fprintf(out, "# sampled traces (ns since accept)\n");
+    for (int i = 0; i < TRACE_RING; i++) {
+        TraceSample copy;
+        unsigned int before = atomic_load_explicit(&samples[i].seq, memory_order_acquire);
+        if (before == 0 || (before & 1)) {
+            continue;
+        }
+        copy.thread_id = samples[i].thread_id;
+        copy.trace = samples[i].trace;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&samples[i].seq, memory_order_relaxed) != before) {
+            continue;
+        }
+        fprintf(out, "thread=%d", copy.thread_id);
+        for (int st = 1; st < STAGE_COUNT; st++) {
+            fprintf(out, " %s=%lu", stage_names[st],
+                    (unsigned long)clockToNs(copy.trace.stamp[st] - copy.trace.stamp[STAGE_ACCEPT]));
+        }
+        fprintf(out, "\n");
+    }
+    fflush(out);
+}
+
+static void* traceReporter(void* arg) {
+    sigset_t* set = (sigset_t*)arg;
+    int sig;
+
+    while (sigwait(set, &sig) == 0) {
+        traceDump(stderr);
+    }
+    return NULL;
+}
+
+//
+// Must run before any other thread is created so they all inherit the mask
+//
+void traceStartReporter(void) {
+    static sigset_t set;
+    pthread_t tid;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (pthread_create(&tid, NULL, traceReporter, &set) == 0) {
+        pthread_detach(tid);
+    }
+}
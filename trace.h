@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "clock.h"
+
+// Points in a request's life, stamped with clockNow()
+typedef enum {
+    STAGE_ACCEPT,
+    STAGE_CLASSIFY,
+    STAGE_ENQUEUE,
+    STAGE_DEQUEUE,
+    STAGE_PARSE,
+    STAGE_LOOKUP,       // open / cache lookup done
+    STAGE_FIRST_BYTE,
+    STAGE_LAST_BYTE,
+    STAGE_CLOSE,
+    STAGE_COUNT
+} TraceStage;
+
+// Span i runs from stage i to stage i + 1, followed by accept -> close
+// and dequeue -> close
+#define TRACE_SPAN_QUEUE_WAIT STAGE_ENQUEUE
+#define TRACE_SPAN_TOTAL (STAGE_COUNT - 1)
+#define TRACE_SPAN_SERVICE STAGE_COUNT
+#define TRACE_SPANS (STAGE_COUNT + 1)
+#define HIST_BUCKETS 40     // log2(ns) buckets, the last one is open-ended
+
+#define TRACE_URI 24
+
+typedef struct RequestTrace {
+    uint64_t stamp[STAGE_COUNT];
+    int status;             // HTTP status sent, 0 if none
+    uint64_t bytes;         // Bytes written by the server itself
+    uint32_t uri_hash;      // FNV-1a of the whole URI
+    char uri[TRACE_URI];    // URI prefix, NUL padded
+} RequestTrace;
+
+#define traceStamp(trace, stage) ((trace)->stamp[(stage)] = clockNow())
+
+extern const char* trace_span_names[TRACE_SPANS];
+
+struct Threads_stats;
+
+void traceInit(int sample_every);
+void traceSetUri(RequestTrace* trace, const char* uri);
+void traceRecord(struct Threads_stats* t_stats, RequestTrace* trace);
+int traceBucket(uint64_t ns);
+uint64_t traceBucketBound(int bucket);
+void traceDump(FILE* out);
+void traceStartReporter(void);
+
+#endif
@@ -0,0 +1,229 @@
+//
+// writer.c: Finishes responses for slow clients so workers do not wait on them.
+//
+// A worker writes what the non-blocking socket accepts and hands the rest
+// (socket, file, offset, length) to a single writer thread, which completes
+// it with sendfile as epoll reports the socket writable. A client that
+// stops reading for WRITER_IDLE_MS loses its transfer, so it cannot hold a
+// descriptor and the file open forever.
+//
+
+#include "segel.h"
+#include "writer.h"
+#include "metrics.h"
+#include "clock.h"
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+
+#define WRITER_EVENTS 64
+#define WRITER_IDLE_MS 30000        // No progress for this long closes a transfer
+#define WRITER_SWEEP_MS 1000        // How often the writer looks for them
+
+typedef struct Transfer {
+    int fd;                 // Our duplicate of the client socket
+    int file_fd;            // Source file, or -1 for data
+    off_t offset;
+    const char* data;
+    size_t left;
+    uint64_t progress_ns;   // Hand-off, or the last write that moved bytes
+    struct Transfer* prev;
+    struct Transfer* next;
+} Transfer;
+
+atomic_int writer_inflight;
+atomic_ulong writer_handoffs;
+atomic_ulong writer_timeouts;
+
+static int epfd = -1;
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+
+// Every transfer in the epoll set, for the idle sweep
+static Transfer* transfers;
+static pthread_mutex_t transfers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns 1 when done, 0 when the socket is full, -1 if the client is gone
+static int transferPush(Transfer* t) {
+    while (t->left > 0) {
+        ssize_t n;
+        if (t->file_fd >= 0) {
+            n = sendfile(t->fd, t->file_fd, &t->offset, t->left);
+        }
+        else {
+            n = write(t->fd, t->data + t->offset, t->left);
+            if (n > 0) t->offset += n;
+        }
+        if (n > 0) {
+            t->left -= n;
+            t->progress_ns = clockToNs(clockNow());
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        metricsIoError(IO_WRITE, n < 0 ? errno : 0);
+        return -1;      // Error, or the file shrank under us
+    }
+    return 1;
+}
+
+static void transferFree(Transfer* t) {
+    pthread_mutex_lock(&transfers_lock);
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    }
+    else {
+        transfers = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    pthread_mutex_unlock(&transfers_lock);
+    // Explicitly: the worker may still hold the socket, which keeps it in the set
+    epoll_ctl(epfd, EPOLL_CTL_DEL, t->fd, NULL);
+    close(t->fd);
+    if (t->file_fd >= 0) {
+        close(t->file_fd);
+    }
+    free(t);
+    atomic_fetch_sub_explicit(&writer_inflight, 1, memory_order_relaxed);
+}
+
+// Closes the transfers whose client has not taken a byte in WRITER_IDLE_MS
+static void transferSweep(void) {
+    uint64_t now = clockToNs(clockNow());
+    Transfer* idle = NULL;
+
+    pthread_mutex_lock(&transfers_lock);
+    for (Transfer* t = transfers, *next; t != NULL; t = next) {
+        next = t->next;
+        if (now - t->progress_ns < WRITER_IDLE_MS * 1000000ULL) {
+            continue;
+        }
+        // Unlinked here and moved to a private list, freed without the lock
+        if (t->prev != NULL) {
+            t->prev->next = next;
+        }
+        else {
+            transfers = next;
+        }
+        if (next != NULL) {
+            next->prev = t->prev;
+        }
+        t->prev = NULL;
+        t->next = idle;
+        idle = t;
+    }
+    pthread_mutex_unlock(&transfers_lock);
+
+    while (idle != NULL) {
+        Transfer* t = idle;
+        idle = t->next;
+        t->next = NULL;
+        atomic_fetch_add_explicit(&writer_timeouts, 1, memory_order_relaxed);
+        transferFree(t);
+    }
+}
+
+static void* writerLoop(void* arg) {
+    struct epoll_event events[WRITER_EVENTS];
+    sigset_t set;
+
+    // A client that went away shows up as EPIPE here instead of killing the server
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    uint64_t swept = clockToNs(clockNow());
+    while (1) {
+        int n = epoll_wait(epfd, events, WRITER_EVENTS, WRITER_SWEEP_MS);
+        for (int i = 0; i < n; i++) {
+            Transfer* t = events[i].data.ptr;
+            if (transferPush(t) != 0) {
+                transferFree(t);
+            }
+        }
+        // Only the writer frees a transfer once it is in the set, so the sweep
+        // cannot free one an event above still points to
+        if (clockToNs(clockNow()) - swept >= WRITER_SWEEP_MS * 1000000ULL) {
+            transferSweep();
+            swept = clockToNs(clockNow());
+        }
+    }
+    return NULL;
+}
+
+// Started by the first hand-off. Should that fail, epfd stays -1 and every
+// worker finishes its own sends.
+static void writerStart(void) {
+    pthread_t tid;
+    int fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (fd < 0) {
+        metricsIoError(IO_WRITE, errno);
+        return;
+    }
+    epfd = fd;
+    if (pthread_create(&tid, NULL, writerLoop, NULL) != 0) {
+        metricsIoError(IO_WRITE, EAGAIN);
+        close(fd);
+        epfd = -1;
+        return;
+    }
+    pthread_detach(tid);
+}
+
+// Without the writer thread the worker waits for the client itself, as it
+// did before there was one (rio_wait, so coroutine workers only yield)
+static void transferFinish(Transfer* t) {
+    while (transferPush(t) == 0) {
+        if (rio_wait(t->fd, POLLOUT) < 0) {
+            break;
+        }
+    }
+    if (t->file_fd >= 0) {
+        close(t->file_fd);
+    }
+}
+
+void writerSend(int fd, int file_fd, off_t offset, const char* data, size_t len) {
+    Transfer local = { fd, file_fd, offset, data, len, 0, NULL, NULL };
+    struct epoll_event ev;
+
+    if (transferPush(&local) != 0) {
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        return;
+    }
+
+    pthread_once(&writer_once, writerStart);
+    Transfer* t = epfd >= 0 ? malloc(sizeof(Transfer)) : NULL;
+    if (t == NULL || (local.fd = dup(fd)) < 0) {
+        if (epfd >= 0) {
+            metricsIoError(IO_WRITE, t == NULL ? ENOMEM : errno);
+        }
+        free(t);
+        local.fd = fd;
+        transferFinish(&local);
+        return;
+    }
+    *t = local;
+    t->progress_ns = clockToNs(clockNow());
+    pthread_mutex_lock(&transfers_lock);
+    t->next = transfers;
+    if (transfers != NULL) {
+        transfers->prev = t;
+    }
+    transfers = t;
+    pthread_mutex_unlock(&transfers_lock);
+    ev.events = EPOLLOUT;
+    ev.data.ptr = t;
+    atomic_fetch_add_explicit(&writer_inflight, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&writer_handoffs, 1, memory_order_relaxed);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, t->fd, &ev) < 0) {
+        transferFree(t);
+    }
+}
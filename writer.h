@@ -0,0 +1,19 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+extern atomic_int writer_inflight;          // Transfers the writer thread is finishing
+extern atomic_ulong writer_handoffs;        // Transfers handed to it so far
+extern atomic_ulong writer_timeouts;        // Transfers closed for a client that stopped reading
+
+// Sends len bytes of file_fd starting at offset, or of data when file_fd is
+// -1 (data must outlive the transfer, as cache entries do). Whatever the
+// socket does not take right away is finished by the writer thread once it
+// becomes writable, so the caller's last-byte stamp marks the hand-off, not
+// delivery. Takes ownership of file_fd; fd is duplicated and stays the
+// caller's to close.
+void writerSend(int fd, int file_fd, off_t offset, const char* data, size_t len);
+
+#endif